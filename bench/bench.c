@@ -0,0 +1,652 @@
+/*
+   Benchmark of the matching engine, built from the same sources as
+   smatch._smatch but without running python; see the Makefile.
+
+   Two sets of random points with the same density are drawn in a square
+   patch of sky, and for each combination of the density, radius, nside,
+   maxmatch and number of threads the stages of a match are timed
+   separately:
+
+       cat_points   the xyz and cos radius of the catalog points
+       discs        the disc pixel ranges of the catalog, from
+                    hpix_disc_intersect_ranges
+       eq2pix       the pixel and xyz of the second set of points
+       index        sorting the second set into the pixel index
+       points       gathering the xyz into index order
+       levels       with --multires, indexing the second set at the coarser
+                    levels
+       candidates   the match with a consumer that only counts the matches
+       push         the match, copying the matches into memory
+       write        the match, writing the matches to a binary match file
+
+   The output stages push and write include the candidate loop; the cost of
+   the output is their difference from candidates.
+
+   With --large-fraction, that fraction of the catalog entries is given the
+   radius --large-radius instead, as for a catalog of masks around bright
+   stars; with --multires those entries are searched at the coarser levels,
+   see engine_level.  Each stage is run
+   repeat times and the fastest is kept.
+
+   The results are written as JSON, to stdout or the file given by
+   --output.  Run with --help for the options.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "defs.h"
+#include "vector.h"
+#include "healpix.h"
+#include "pixindex.h"
+#include "cat.h"
+#include "kernel.h"
+#include "engine.h"
+#include "matchfile.h"
+
+// the largest number of values in a list option
+#define BENCH_MAXVALS 32
+
+#define BENCH_NSTAGES 9
+
+static const char* stage_names[BENCH_NSTAGES] = {
+    "cat_points", "discs", "eq2pix", "index", "points", "levels",
+    "candidates", "push", "write",
+};
+
+struct value_list {
+    size_t n;
+    double vals[BENCH_MAXVALS];
+};
+
+struct bench_options {
+    struct value_list density;  // points per square arcminute
+    struct value_list radius;   // arcseconds
+    struct value_list nside;
+    struct value_list maxmatch;
+    struct value_list nthreads;
+
+    double area;                // square degrees
+    double large_fraction;      // of the catalog entries with large_radius
+    double large_radius;        // degrees
+    int repeat;
+    int single;
+    int multires;
+    uint64_t seed;
+    const char* kernel;
+    const char* output;
+};
+
+// the points and their index for one trial
+struct bench_data {
+    size_t n;
+    double* ra1;
+    double* dec1;
+    double* ra2;
+    double* dec2;
+    unsigned char* large;       // entries of the catalog with large_radius
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9*ts.tv_nsec;
+}
+
+//
+// splitmix64, so the points are the same on all platforms
+//
+
+static uint64_t next_random(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double next_uniform(uint64_t* state)
+{
+    return (next_random(state) >> 11) * (1.0/9007199254740992.0);
+}
+
+//
+// uniform points in a square patch of the given area (square degrees)
+// centered on the equator
+//
+
+static void random_points(uint64_t* state, double area, size_t n,
+                          double* ra, double* dec)
+{
+    size_t i=0;
+    double side = sqrt(area);
+    double zmax = sin(0.5*side*D2R);
+
+    for (i=0; i<n; i++) {
+        ra[i] = 100.0 + side*next_uniform(state);
+        dec[i] = asin(zmax*(2*next_uniform(state) - 1))/D2R;
+    }
+}
+
+static int parse_list(const char* arg, struct value_list* list)
+{
+    char* end=NULL;
+
+    list->n = 0;
+    while (*arg != '\0') {
+        if (list->n == BENCH_MAXVALS) {
+            return 0;
+        }
+        list->vals[list->n] = strtod(arg, &end);
+        if (end == arg) {
+            return 0;
+        }
+        list->n++;
+
+        arg = end;
+        if (*arg == ',') {
+            arg++;
+        } else if (*arg != '\0') {
+            return 0;
+        }
+    }
+    return list->n > 0;
+}
+
+static void usage(FILE* fobj)
+{
+    fprintf(fobj,
+        "usage: bench [options]\n"
+        "\n"
+        "list options take comma separated values\n"
+        "\n"
+        "  --density LIST   points per square arcminute in each set, default 1,10\n"
+        "  --radius LIST    match radius in arcseconds, default 2,10\n"
+        "  --nside LIST     healpix nside, default 1024,4096,16384\n"
+        "  --maxmatch LIST  default 1,0\n"
+        "  --nthreads LIST  default 1,4\n"
+        "  --area A         area of the patch in square degrees, default 1\n"
+        "  --large-fraction F\n"
+        "                   fraction of the catalog with a large radius, default 0\n"
+        "  --large-radius R the large radius in degrees, default 1\n"
+        "  --multires       search the large radii at coarser levels\n"
+        "  --repeat N       times each stage is run, the fastest kept, default 3\n"
+        "  --single         hold the indexed points in single precision\n"
+        "  --kernel NAME    the candidate kernel, default the best supported\n"
+        "  --seed N         for the random points, default 1\n"
+        "  --output FILE    write the JSON here rather than to stdout\n");
+}
+
+static int parse_options(int argc, char** argv, struct bench_options* opts)
+{
+    int i=0, ok=1;
+    const char* arg=NULL;
+    const char* val=NULL;
+
+    parse_list("1,10", &opts->density);
+    parse_list("2,10", &opts->radius);
+    parse_list("1024,4096,16384", &opts->nside);
+    parse_list("1,0", &opts->maxmatch);
+    parse_list("1,4", &opts->nthreads);
+    opts->area = 1.0;
+    opts->large_fraction = 0.0;
+    opts->large_radius = 1.0;
+    opts->repeat = 3;
+    opts->single = 0;
+    opts->multires = 0;
+    opts->seed = 1;
+    opts->kernel = NULL;
+    opts->output = NULL;
+
+    for (i=1; i<argc && ok; i++) {
+        arg = argv[i];
+
+        if (strcmp(arg, "--help") == 0) {
+            usage(stdout);
+            exit(0);
+        } else if (strcmp(arg, "--single") == 0) {
+            opts->single = 1;
+            continue;
+        } else if (strcmp(arg, "--multires") == 0) {
+            opts->multires = 1;
+            continue;
+        }
+
+        if (i+1 == argc) {
+            ok = 0;
+            break;
+        }
+        val = argv[++i];
+
+        if (strcmp(arg, "--density") == 0) {
+            ok = parse_list(val, &opts->density);
+        } else if (strcmp(arg, "--radius") == 0) {
+            ok = parse_list(val, &opts->radius);
+        } else if (strcmp(arg, "--nside") == 0) {
+            ok = parse_list(val, &opts->nside);
+        } else if (strcmp(arg, "--maxmatch") == 0) {
+            ok = parse_list(val, &opts->maxmatch);
+        } else if (strcmp(arg, "--nthreads") == 0) {
+            ok = parse_list(val, &opts->nthreads);
+        } else if (strcmp(arg, "--area") == 0) {
+            opts->area = atof(val);
+            ok = opts->area > 0;
+        } else if (strcmp(arg, "--large-fraction") == 0) {
+            opts->large_fraction = atof(val);
+            ok = opts->large_fraction >= 0 && opts->large_fraction <= 1;
+        } else if (strcmp(arg, "--large-radius") == 0) {
+            opts->large_radius = atof(val);
+            ok = opts->large_radius > 0;
+        } else if (strcmp(arg, "--repeat") == 0) {
+            opts->repeat = atoi(val);
+            ok = opts->repeat > 0;
+        } else if (strcmp(arg, "--seed") == 0) {
+            opts->seed = strtoull(val, NULL, 10);
+        } else if (strcmp(arg, "--kernel") == 0) {
+            opts->kernel = val;
+        } else if (strcmp(arg, "--output") == 0) {
+            opts->output = val;
+        } else {
+            ok = 0;
+        }
+    }
+
+    if (!ok) {
+        fprintf(stderr, "bad option: %s\n\n", arg);
+        usage(stderr);
+        return 0;
+    }
+
+    // hpix_new reports errors through python, so check here
+    for (i=0; i<(int)opts->nside.n; i++) {
+        if (opts->nside.vals[i] < 1 || opts->nside.vals[i] > NS_MAX) {
+            fprintf(stderr, "nside out of range [1, %d]\n", NS_MAX);
+            return 0;
+        }
+    }
+    for (i=0; i<(int)opts->nthreads.n; i++) {
+        if (opts->nthreads.vals[i] < 1) {
+            fprintf(stderr, "nthreads should be >= 1\n");
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+//
+// consumers for the output stages
+//
+
+static int count_consumer(void* data, const match_vector* matches)
+{
+    int64_t* nmatches=data;
+    *nmatches += (int64_t)vector_size(matches);
+    return 1;
+}
+
+static int push_consumer(void* data, const match_vector* matches)
+{
+    match_vector* all=data;
+    size_t i=0;
+
+    for (i=0; i<vector_size(matches); i++) {
+        vector_push(all, matches->data[i]);
+    }
+    return 1;
+}
+
+static int write_consumer(void* data, const match_vector* matches)
+{
+    return matchfile_write_matches((FILE*)data, matches->data,
+                                   vector_size(matches));
+}
+
+// free the index and points at the coarser levels, keeping the healpix
+static void free_levels(struct match_level* levels, size_t nlevels)
+{
+    size_t level=0;
+
+    for (level=1; level<nlevels; level++) {
+        pixindex_delete((struct pixindex*) levels[level].index);
+        soa_points_delete((struct soa_points*) levels[level].points);
+        levels[level].index = NULL;
+        levels[level].points = NULL;
+    }
+}
+
+static void keep_fastest(double* best, double start)
+{
+    double t = now() - start;
+    if (*best < 0 || t < *best) {
+        *best = t;
+    }
+}
+
+/*
+   time the stages for one combination of the parameters, writing a JSON
+   object for the results.  returns 0 on failure to allocate
+*/
+
+static int run_trial(const struct bench_options* opts,
+                     const struct bench_data* data,
+                     double density,
+                     double radius,
+                     int64_t nside,
+                     int64_t maxmatch,
+                     int nthreads,
+                     FILE* out)
+{
+    int status=0, rep=0, stage=0;
+    double times[BENCH_NSTAGES];
+    double start=0, radius_deg=radius/3600.0, max_radius=radius_deg;
+    int64_t nmatches=0;
+    size_t i=0, n=data->n, nalloc=data->n > 0 ? data->n : 1;
+    size_t level=0, nlevels=1;
+    struct healpix* hpix=NULL;
+    struct healpix** level_hpix=NULL;
+    struct match_level* levels=NULL;
+    struct soa_points* level_points=NULL;
+    double* radii=NULL;
+    Catalog* cat=NULL;
+    int64_t* hpixids=NULL;
+    double *x=NULL, *y=NULL, *z=NULL;
+    struct pixindex* index=NULL;
+    struct soa_points* points=NULL;
+    match_vector* all=NULL;
+    FILE* fobj=NULL;
+    struct match_context ctx={0};
+
+    for (stage=0; stage<BENCH_NSTAGES; stage++) {
+        times[stage] = -1;
+    }
+
+    radii = malloc(nalloc*sizeof(double));
+    if (radii == NULL) {
+        goto _run_trial_bail;
+    }
+    for (i=0; i<n; i++) {
+        radii[i] = data->large[i] ? opts->large_radius : radius_deg;
+    }
+    if (opts->large_fraction > 0 && opts->large_radius > max_radius) {
+        max_radius = opts->large_radius;
+    }
+
+    hpix = hpix_new(nside);
+    cat = cat_new(data->ra1, data->dec1, n, radii, n);
+    hpixids = malloc(nalloc*sizeof(int64_t));
+    x = malloc(nalloc*sizeof(double));
+    y = malloc(nalloc*sizeof(double));
+    z = malloc(nalloc*sizeof(double));
+    all = match_vector_new();
+    if (hpix == NULL || cat == NULL || hpixids == NULL
+            || x == NULL || y == NULL || z == NULL || all == NULL) {
+        goto _run_trial_bail;
+    }
+
+    if (opts->multires) {
+        nlevels = engine_nlevels(nside, max_radius*D2R);
+    }
+    if (nlevels > 1) {
+        level_hpix = calloc(nlevels, sizeof(struct healpix*));
+        levels = calloc(nlevels, sizeof(struct match_level));
+        if (level_hpix == NULL || levels == NULL) {
+            goto _run_trial_bail;
+        }
+        for (level=1; level<nlevels; level++) {
+            level_hpix[level] = hpix_new(engine_level_nside(nside, level));
+            if (level_hpix[level] == NULL) {
+                goto _run_trial_bail;
+            }
+            levels[level].hpix = level_hpix[level];
+        }
+    }
+
+    for (rep=0; rep<opts->repeat; rep++) {
+        cat_clear(cat);
+        index = pixindex_delete(index);
+        points = soa_points_delete(points);
+        free_levels(levels, nlevels);
+
+        start = now();
+        if (!cat_build_points(cat)) {
+            goto _run_trial_bail;
+        }
+        keep_fastest(&times[0], start);
+
+        start = now();
+        if (!cat_build_discs(cat, hpix,
+                             nlevels > 1 ? engine_level_max_radius(nside) : HUGE_VAL)) {
+            goto _run_trial_bail;
+        }
+        keep_fastest(&times[1], start);
+
+        start = now();
+        hpix_eq2pix_xyz_array(hpix, data->ra2, data->dec2, n, hpixids, x, y, z);
+        keep_fastest(&times[2], start);
+
+        start = now();
+        index = pixindex_new(hpixids, n);
+        if (index == NULL) {
+            goto _run_trial_bail;
+        }
+        keep_fastest(&times[3], start);
+
+        start = now();
+        points = soa_points_gather(x, y, z, index, opts->single);
+        if (points == NULL) {
+            goto _run_trial_bail;
+        }
+        keep_fastest(&times[4], start);
+
+        start = now();
+        for (level=1; level<nlevels; level++) {
+            levels[level].index = create_hpix_index_points(
+                levels[level].hpix, data->ra2, data->dec2, n,
+                opts->single, &level_points);
+            if (levels[level].index == NULL) {
+                goto _run_trial_bail;
+            }
+            levels[level].points = level_points;
+        }
+        keep_fastest(&times[5], start);
+    }
+
+    ctx.hpix = hpix;
+    ctx.maxmatch = maxmatch;
+    ctx.cat = cat;
+    ctx.ra = data->ra2;
+    ctx.dec = data->dec2;
+    ctx.npoints = n;
+    ctx.index = index;
+    ctx.points = points;
+    if (nlevels > 1) {
+        levels[0].hpix = hpix;
+        levels[0].index = index;
+        levels[0].points = points;
+        ctx.levels = levels;
+        ctx.nlevels = nlevels;
+    }
+
+    for (rep=0; rep<opts->repeat; rep++) {
+        nmatches = 0;
+        start = now();
+        if (!engine_match(&ctx, nthreads, count_consumer, &nmatches)) {
+            goto _run_trial_bail;
+        }
+        keep_fastest(&times[6], start);
+
+        vector_resize(all, 0);
+        start = now();
+        if (!engine_match(&ctx, nthreads, push_consumer, all)) {
+            goto _run_trial_bail;
+        }
+        keep_fastest(&times[7], start);
+
+        fobj = tmpfile();
+        if (fobj == NULL) {
+            goto _run_trial_bail;
+        }
+        setvbuf(fobj, NULL, _IOFBF, MATCHFILE_BUFSIZE);
+
+        start = now();
+        if (!matchfile_write_header(fobj, -1)
+                || !engine_match(&ctx, nthreads, write_consumer, fobj)
+                || !matchfile_set_nmatches(fobj, nmatches)
+                || fflush(fobj) != 0) {
+            goto _run_trial_bail;
+        }
+        keep_fastest(&times[8], start);
+
+        fclose(fobj);
+        fobj = NULL;
+    }
+
+    fprintf(out,
+            "    {\"density\": %g, \"radius\": %g, \"nside\": %ld, "
+            "\"maxmatch\": %ld, \"nthreads\": %d,\n"
+            "     \"npoints\": %zu, \"nmatches\": %ld, \"nlevels\": %zu,\n"
+            "     \"times\": {",
+            density, radius, (long)nside, (long)maxmatch, nthreads,
+            n, (long)nmatches, nlevels);
+    for (stage=0; stage<BENCH_NSTAGES; stage++) {
+        fprintf(out, "%s\"%s\": %.6e", stage > 0 ? ", " : "",
+                stage_names[stage], times[stage]);
+    }
+    fprintf(out, "}}");
+
+    status=1;
+
+_run_trial_bail:
+    if (fobj) {
+        fclose(fobj);
+    }
+    vector_free(all);
+    if (levels) {
+        free_levels(levels, nlevels);
+        free(levels);
+    }
+    if (level_hpix) {
+        for (level=1; level<nlevels; level++) {
+            level_hpix[level] = hpix_delete(level_hpix[level]);
+        }
+        free(level_hpix);
+    }
+    points = soa_points_delete(points);
+    index = pixindex_delete(index);
+    free(radii);
+    free(hpixids);
+    free(x);
+    free(y);
+    free(z);
+    cat_free(cat);
+    hpix = hpix_delete(hpix);
+    return status;
+}
+
+int main(int argc, char** argv)
+{
+    int status=1, first=1;
+    size_t i=0, idens=0, irad=0, inside=0, imax=0, ithr=0, nmax=0, n=0;
+    double density=0;
+    struct bench_options opts;
+    struct bench_data data={0};
+    uint64_t state=0;
+    FILE* out=stdout;
+
+    if (!parse_options(argc, argv, &opts)) {
+        return 2;
+    }
+
+    if (opts.kernel && !kernel_set(opts.kernel)) {
+        fprintf(stderr, "kernel not supported: %s\n", opts.kernel);
+        return 2;
+    }
+
+    // the same points are used for all trials at a density, the densest
+    // first so the arrays can be reused
+    for (idens=0; idens<opts.density.n; idens++) {
+        n = (size_t)(opts.density.vals[idens]*opts.area*3600.0);
+        if (n > nmax) {
+            nmax = n;
+        }
+    }
+    data.ra1 = malloc((nmax+1)*sizeof(double));
+    data.dec1 = malloc((nmax+1)*sizeof(double));
+    data.ra2 = malloc((nmax+1)*sizeof(double));
+    data.dec2 = malloc((nmax+1)*sizeof(double));
+    data.large = malloc(nmax+1);
+    if (data.ra1 == NULL || data.dec1 == NULL
+            || data.ra2 == NULL || data.dec2 == NULL || data.large == NULL) {
+        fprintf(stderr, "could not allocate points\n");
+        goto _main_bail;
+    }
+
+    if (opts.output) {
+        out = fopen(opts.output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "could not open %s\n", opts.output);
+            goto _main_bail;
+        }
+    }
+
+    fprintf(out,
+            "{\n  \"kernel\": \"%s\", \"single\": %d, \"area\": %g, "
+            "\"repeat\": %d, \"seed\": %lu,\n"
+            "  \"large_fraction\": %g, \"large_radius\": %g, \"multires\": %d,\n"
+            "  \"results\": [\n",
+            kernel_name(), opts.single, opts.area, opts.repeat,
+            (unsigned long)opts.seed,
+            opts.large_fraction, opts.large_radius, opts.multires);
+
+    for (idens=0; idens<opts.density.n; idens++) {
+        density = opts.density.vals[idens];
+        data.n = (size_t)(density*opts.area*3600.0);
+
+        state = opts.seed;
+        random_points(&state, opts.area, data.n, data.ra1, data.dec1);
+        random_points(&state, opts.area, data.n, data.ra2, data.dec2);
+        for (i=0; i<data.n; i++) {
+            data.large[i] = next_uniform(&state) < opts.large_fraction;
+        }
+
+        for (irad=0; irad<opts.radius.n; irad++)
+        for (inside=0; inside<opts.nside.n; inside++)
+        for (imax=0; imax<opts.maxmatch.n; imax++)
+        for (ithr=0; ithr<opts.nthreads.n; ithr++) {
+            if (!first) {
+                fprintf(out, ",\n");
+            }
+            first = 0;
+
+            if (!run_trial(&opts, &data, density,
+                           opts.radius.vals[irad],
+                           (int64_t)opts.nside.vals[inside],
+                           (int64_t)opts.maxmatch.vals[imax],
+                           (int)opts.nthreads.vals[ithr],
+                           out)) {
+                fprintf(stderr, "trial failed\n");
+                goto _main_bail;
+            }
+            fflush(out);
+        }
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    status=0;
+
+_main_bail:
+    if (out != stdout && out != NULL) {
+        fclose(out);
+    }
+    free(data.ra1);
+    free(data.dec1);
+    free(data.ra2);
+    free(data.dec2);
+    free(data.large);
+    return status;
+}
@@ -6,9 +6,17 @@ ext = Extension(
     "smatch._smatch",
     ["smatch/smatch.c",
      "smatch/vector.c",
-     "smatch/tree.c",
+     "smatch/pixindex.c",
+     "smatch/arena.c",
      "smatch/cat.c",
+     "smatch/engine.c",
+     "smatch/kernel.c",
+     "smatch/matchfile.c",
+     "smatch/unionfind.c",
      "smatch/healpix.c"],
+    # no fused multiply-add, so all candidate kernels give the same results
+    extra_compile_args=['-pthread', '-ffp-contract=off'],
+    extra_link_args=['-pthread'],
 )
 setup(
     name="smatch",
@@ -3,10 +3,28 @@ from . import smatch
 from .smatch import (
     match,
     match_self,
+    knn,
+    friends_of_friends,
+    count_matches,
+    count_matches_self,
+    pair_counts,
+    pair_counts_self,
+    choose_nside,
     Catalog,
     read_matches,
     match_dtype,
 )
+from .partition import (
+    match_partitioned,
+    match_self_partitioned,
+    ShardPlan,
+    shard_plan,
+    shard_plan_self,
+    read_shard_plan,
+    match_shard,
+    match_self_shard,
+    merge_shards,
+)
 from .matcher import (
     Matcher,
     sphdist,
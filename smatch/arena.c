@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+struct arena_block {
+    struct arena_block* next;
+    size_t size;    // bytes available after the header
+    size_t used;
+};
+
+// the header is padded so the data start aligned
+#define ARENA_HEADER_SIZE \
+    ((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static inline char* arena_block_data(struct arena_block* block)
+{
+    return (char*) block + ARENA_HEADER_SIZE;
+}
+
+static struct arena_block* arena_block_new(size_t size)
+{
+    struct arena_block* block=NULL;
+
+    block = malloc(ARENA_HEADER_SIZE + size);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    return block;
+}
+
+struct arena* arena_new(size_t block_size)
+{
+    struct arena* self=NULL;
+
+    self = calloc(1, sizeof(struct arena));
+    if (self == NULL) {
+        return NULL;
+    }
+
+    self->block_size = block_size > 0 ? block_size : ARENA_BLOCK_SIZE;
+
+    return self;
+}
+
+void* arena_alloc(struct arena* self, size_t nbytes)
+{
+    struct arena_block* block=self->blocks;
+    struct arena_block* new_block=NULL;
+    size_t start=0;
+
+    if (nbytes == 0) {
+        nbytes = 1;
+    }
+
+    if (block) {
+        start = (block->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if (start <= block->size && nbytes <= block->size - start) {
+            block->used = start + nbytes;
+            return arena_block_data(block) + start;
+        }
+    }
+
+    if (nbytes > self->block_size) {
+        // a block of its own, kept behind the one in use so that the space
+        // left there is not lost
+        new_block = arena_block_new(nbytes);
+        if (new_block == NULL) {
+            return NULL;
+        }
+        new_block->used = nbytes;
+        self->nbytes += nbytes;
+
+        if (block) {
+            new_block->next = block->next;
+            block->next = new_block;
+        } else {
+            self->blocks = new_block;
+        }
+        return arena_block_data(new_block);
+    }
+
+    new_block = arena_block_new(self->block_size);
+    if (new_block == NULL) {
+        return NULL;
+    }
+    new_block->used = nbytes;
+    new_block->next = block;
+    self->blocks = new_block;
+    self->nbytes += self->block_size;
+
+    return arena_block_data(new_block);
+}
+
+void arena_reset(struct arena* self)
+{
+    struct arena_block* block=NULL;
+    struct arena_block* keep=NULL;
+
+    // the oldest block is the first allocated
+    while (self->blocks) {
+        block = self->blocks;
+        self->blocks = block->next;
+        if (self->blocks == NULL && block->size == self->block_size) {
+            keep = block;
+        } else {
+            free(block);
+        }
+    }
+
+    self->nbytes = 0;
+    if (keep) {
+        keep->used = 0;
+        keep->next = NULL;
+        self->blocks = keep;
+        self->nbytes = keep->size;
+    }
+}
+
+size_t arena_nbytes(const struct arena* self)
+{
+    if (self == NULL) {
+        return 0;
+    }
+    return sizeof(struct arena) + self->nbytes;
+}
+
+struct arena* arena_delete(struct arena* self)
+{
+    struct arena_block* block=NULL;
+
+    if (self) {
+        while (self->blocks) {
+            block = self->blocks;
+            self->blocks = block->next;
+            free(block);
+        }
+        free(self);
+    }
+    return NULL;
+}
@@ -0,0 +1,52 @@
+/*
+   A bump allocator for the many small allocations made during a match.
+
+   Memory is taken from large blocks in order, and is only released all
+   at once by arena_delete or arena_reset, so an allocation is a pointer
+   increment and the teardown costs one free per block rather than one for
+   each object.  Requests larger than the block size get a block of their
+   own.
+
+   An arena is not thread safe; use one for each thread.
+*/
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stdlib.h>
+
+// the default size of the blocks, in bytes
+#define ARENA_BLOCK_SIZE (1024*1024)
+
+// allocations are aligned to this many bytes
+#define ARENA_ALIGN 16
+
+struct arena_block;
+
+struct arena {
+    struct arena_block* blocks; // the block in use, followed by older ones
+    size_t block_size;
+    size_t nbytes;              // total size of the blocks
+};
+
+/*
+   create an arena, with blocks of block_size bytes; send 0 for
+   ARENA_BLOCK_SIZE.  Returns NULL on failure to allocate
+*/
+struct arena* arena_new(size_t block_size);
+
+/*
+   allocate nbytes, aligned to ARENA_ALIGN.  The memory is not initialized.
+   Returns NULL on failure to allocate
+*/
+void* arena_alloc(struct arena* self, size_t nbytes);
+
+// release all the allocations, keeping the first block for reuse
+void arena_reset(struct arena* self);
+
+// the memory held by the arena in bytes
+size_t arena_nbytes(const struct arena* self);
+
+// usage:  arena=arena_delete(arena);
+struct arena* arena_delete(struct arena* self);
+
+#endif
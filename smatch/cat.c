@@ -1,6 +1,10 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "defs.h"
 #include "vector.h"
+#include "healpix.h"
 #include "cat.h"
 
 // for when we only want one entry
@@ -15,48 +19,102 @@ CatalogEntry* cat_entry_new(void)
 
 
     self->matches = match_vector_new();
-    self->disc_pixels = lvector_new();
+    self->disc_ranges = lvector_new();
 
     return self;
 }
 
 
-/*
-Catalog* cat_new(size_t n)
+Catalog* cat_new(const double* ra,
+                 const double* dec,
+                 size_t size,
+                 const double* radius,
+                 size_t nradius)
 {
-    size_t i=0;
     Catalog* self = calloc(1,sizeof(Catalog));
 
     if (self == NULL) {
-        fprintf(stderr,"Could not allocate Catalog\n");
         return NULL;
     }
 
-    self->size = n;
-    self->data = calloc(self->size, sizeof(CatalogEntry));
-    if (self->data == NULL) {
-        fprintf(stderr,"Could not allocate data for Catalog\n");
-        exit(1);
+    self->size = size;
+    self->ra = ra;
+    self->dec = dec;
+    self->radius = radius;
+    self->nradius = nradius;
+
+    return self;
+}
+
+void cat_fill_point(const Catalog* self, size_t i, CatPoint* cpt)
+{
+    hpix_eq2xyz(self->ra[i], self->dec[i], &cpt->x, &cpt->y, &cpt->z);
+
+    cpt->radius = cat_radius(self, i)*D2R;
+    cpt->cos_radius = cos( cpt->radius );
+}
+
+int cat_build_points(Catalog* self)
+{
+    size_t i=0;
+
+    self->points = calloc(self->size > 0 ? self->size : 1, sizeof(CatPoint));
+    if (self->points == NULL) {
+        return 0;
     }
 
     for (i=0; i<self->size; i++) {
-        self->data[i].matches = match_vector_new();
-        self->data[i].disc_pixels = lvector_new();
+        cat_fill_point(self, i, &self->points[i]);
     }
 
-    return self;
+    return 1;
 }
 
-void cat_free_data(Catalog* self)
+int cat_build_discs(Catalog* self, const struct healpix* hpix, double max_radius)
 {
-    size_t i=0;
+    self->disc_offsets = calloc(self->size+1, sizeof(size_t));
+    self->disc_ranges = lvector_new();
+
+    if (self->disc_offsets == NULL || self->disc_ranges == NULL) {
+        free(self->disc_offsets);
+        self->disc_offsets = NULL;
+        vector_free(self->disc_ranges);
+        return 0;
+    }
+
+    hpix_disc_intersect_ranges_batch(hpix, self->points, self->size, max_radius,
+                                     self->disc_ranges, self->disc_offsets);
+
+    // release the unused capacity
+    vector_realloc(self->disc_ranges, vector_size(self->disc_ranges));
+
+    return 1;
+}
 
+void cat_clear(Catalog* self)
+{
     if (self) {
-        for (i=0; i < self->size; i++) {
-            vector_free(self->data[i].matches);
-            vector_free(self->data[i].disc_pixels);
-        }
+        free(self->points);
+        self->points = NULL;
+        free(self->disc_offsets);
+        self->disc_offsets = NULL;
+        vector_free(self->disc_ranges);
     }
 }
 
-*/
+size_t cat_nbytes(const Catalog* self)
+{
+    size_t nbytes=0;
+
+    if (self) {
+        if (self->points) {
+            nbytes += self->size*sizeof(CatPoint);
+        }
+        if (self->disc_offsets) {
+            nbytes += (self->size+1)*sizeof(size_t);
+            nbytes += vector_capacity(self->disc_ranges)*sizeof(int64_t);
+        }
+    }
+
+    return nbytes;
+}
@@ -4,6 +4,22 @@
 #include <stdint.h>
 #include "vector.h"
 #include "catpoint.h"
+#include "healpix.h"
+
+/*
+   counts kept by the engine over the entries matched with a CatalogEntry,
+   for instrumentation; see the stats in match_context, engine.h
+*/
+struct entry_stats {
+    int64_t nentries;     // catalog entries searched
+    int64_t nranges;      // disc pixel ranges searched
+    int64_t npixels;      // pixels in those ranges
+    int64_t nhits;        // ranges holding points of the index
+    int64_t nmisses;      // ranges holding none
+    int64_t ncandidates;  // points tested
+    int64_t naccepted;    // points within the radius
+    int64_t nreplaced;    // kept matches displaced by closer ones, maxmatch > 0
+};
 
 typedef struct {
     CatPoint point;
@@ -11,9 +27,21 @@ typedef struct {
     // to hold matches
     match_vector *matches;
 
-    // list of healpix ids that intersect the disc around
-    // this point
-    lvector* disc_pixels;
+    // ranges of healpix ids that intersect the disc around
+    // this point, in lo,hi pairs as from hpix_disc_intersect_ranges
+    lvector* disc_ranges;
+
+    // the disc pixel ranges to search, nranges pairs; this points either
+    // to the data in disc_ranges or into the ranges cached for a Catalog
+    const int64_t* ranges;
+    size_t nranges;
+
+    // the resolution level at which the disc pixels are searched, see
+    // engine.h
+    size_t level;
+
+    // added to by the engine for each entry searched
+    struct entry_stats stats;
 
 } CatalogEntry;
 
@@ -24,7 +52,7 @@ CatalogEntry* cat_entry_new(void);
 
 #define cat_entry_free(entry) do {                                           \
     if ((entry)) {                                                           \
-        vector_free(entry->disc_pixels);                                     \
+        vector_free(entry->disc_ranges);                                     \
         vector_free(entry->matches);                                         \
         free((entry));                                                       \
         (entry)=NULL;                                                        \
@@ -33,23 +61,66 @@ CatalogEntry* cat_entry_new(void);
 
 
 /*
+   A catalog to be matched.  The ra, dec and radius (degrees) are not owned
+   by the catalog.  The radius array has either 1 or size elements.
+
+   The points and the disc pixels can be computed once and reused for
+   repeated matches; they are NULL until computed.  The disc pixels for entry
+   i are held as lo,hi pairs of pixel ranges in
+
+       disc_ranges->data[disc_offsets[i]] ... disc_ranges->data[disc_offsets[i+1]-1]
+
+*/
 
 typedef struct {
     size_t size;
-    CatalogEntry* data;
+
+    const double* ra;
+    const double* dec;
+    const double* radius;
+    size_t nradius;
+
+    CatPoint* points;
+
+    size_t* disc_offsets;
+    lvector* disc_ranges;
 } Catalog;
 
-Catalog* cat_new(size_t n);
-void cat_free_data(Catalog *self);
+// create a catalog with no points or disc pixels;
+// returns NULL on failure to allocate
+Catalog* cat_new(const double* ra,
+                 const double* dec,
+                 size_t size,
+                 const double* radius,
+                 size_t nradius);
+
+// get the radius in degrees for entry i
+#define cat_radius(cat, i) ((cat)->nradius == 1 ? (cat)->radius[0] : (cat)->radius[(i)])
+
+// fill the point for entry i; the ra,dec should already have been checked
+void cat_fill_point(const Catalog* self, size_t i, CatPoint* cpt);
+
+// compute the points; returns 0 on failure to allocate
+int cat_build_points(Catalog* self);
+
+// compute the disc pixels, the points must already be computed.  Entries
+// with a radius above max_radius (radians) get no pixels, for entries that
+// are searched at a coarser resolution; send HUGE_VAL to compute all.
+// returns 0 on failure to allocate
+int cat_build_discs(Catalog* self, const struct healpix* hpix, double max_radius);
+
+// free the points and disc pixels
+void cat_clear(Catalog* self);
+
+// the memory used by the points and disc pixels in bytes
+size_t cat_nbytes(const Catalog* self);
 
 #define cat_free(cat) do {                                                   \
     if ((cat)) {                                                             \
-        cat_free_data(cat);                                                  \
-        free((cat)->data);                                                   \
+        cat_clear((cat));                                                    \
         free((cat));                                                         \
         (cat)=NULL;                                                          \
     }                                                                        \
 } while(0)
-*/
 
 #endif
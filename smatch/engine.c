@@ -0,0 +1,2053 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "defs.h"
+#include "vector.h"
+#include "healpix.h"
+#include "pixindex.h"
+#include "catpoint.h"
+#include "cat.h"
+#include "arena.h"
+#include "engine.h"
+
+// matches found when streaming are sent on in batches of this size
+#define ENGINE_STREAM_BATCH 65536
+
+// the first capacity of the match vectors for each catalog entry when
+// indexing the catalog; these grow by doubling within an arena
+#define ENGINE_ARENA_INITCAP 4
+
+// maxmatch up to this keep the closest matches in a sorted buffer rather
+// than a heap; domatch1 has a case for each
+#define ENGINE_SMALL_MAXMATCH 8
+
+//
+// the order of the matches kept when maxmatch > 0: closest first, ties going
+// to the lower input index, so the matches kept do not depend on the order in
+// which the candidates are tested
+//
+
+static inline int match_closer(const Match* a, const Match* b)
+{
+    if (a->cosdist != b->cosdist) {
+        return a->cosdist > b->cosdist;
+    }
+    return a->input_ind < b->input_ind;
+}
+
+//
+// move the element at i down until the data from i form a heap with the
+// farthest match at the top
+//
+
+static inline void match_heap_sift(Match* data, size_t n, size_t i)
+{
+    const Match v = data[i];
+    size_t c = 2*i + 1;
+
+    while (c < n) {
+        if (c+1 < n && match_closer(&data[c], &data[c+1])) {
+            // the right branch is farther
+            c += 1;
+        }
+        if (!match_closer(&v, &data[c])) {
+            // it forms a heap already
+            break;
+        }
+
+        data[i] = data[c]; // promotes the farther of the branches
+        i = c;             // move down the heap
+        c = 2*c + 1;       // left branch
+    }
+
+    data[i] = v;
+}
+
+//
+// build a heap in an existing match vector, sifting down from the last
+// parent
+//
+
+static inline void match_build_heap(match_vector* self)
+{
+    size_t n = vector_size(self), i=0;
+
+    for (i=n/2; i > 0; i--) {
+        match_heap_sift(self->data, n, i-1);
+    }
+}
+
+//
+//    possibly insert value, displacing the farthest.  It is assumed the data
+//    are already a heap.  Returns 1 if it was inserted
+//
+
+static inline int match_heap_insert(match_vector* self, const Match* match)
+{
+    if (match_closer(match, &self->data[0])) {
+        self->data[0] = *match;
+        match_heap_sift(self->data, vector_size(self), 0);
+        return 1;
+    }
+    return 0;
+}
+
+//
+// add a match to the vector.  If maxmatch > 0 only the closest maxmatch are
+// kept: matches are appended up to the max allowed, then the vector is
+// converted to a heap and only matches closer than the farthest current match
+// are added.
+//
+// returns 1 if the number of matches grew
+//
+
+int add_match(match_vector* matches, const Match* match, int64_t maxmatch)
+{
+    if (maxmatch <= 0 || (int64_t)vector_size(matches) < maxmatch) {
+
+        // just keep adding entries
+        vector_push(matches, *match);
+
+        // if we are now at capacity, heapify it
+        if (maxmatch > 1 && (int64_t)vector_size(matches)==maxmatch) {
+            match_build_heap(matches);
+        }
+        return 1;
+    } else {
+        // add only if closer than the farthest match
+        match_heap_insert(matches, match);
+        return 0;
+    }
+}
+
+//
+// sort the matches closest first, ties by input index, as a heap sort: the
+// farthest is moved to the end until none are left
+//
+
+static void sort_nearest(match_vector* matches)
+{
+    size_t n = vector_size(matches);
+    Match tmp;
+
+    match_build_heap(matches);
+
+    while (n > 1) {
+        n--;
+        tmp = matches->data[0];
+        matches->data[0] = matches->data[n];
+        matches->data[n] = tmp;
+        match_heap_sift(matches->data, n, 0);
+    }
+}
+
+//
+// keep the closest k of the matches in best, sorted closest first, where
+// *nbest are held so far.  Returns 1 if a match was displaced
+//
+
+static inline int select_insert(Match* best,
+                                size_t* nbest,
+                                size_t k,
+                                const Match* match)
+{
+    size_t i = *nbest;
+    int replaced=0;
+
+    if (i == k) {
+        if (!match_closer(match, &best[k-1])) {
+            return 0;
+        }
+        // the farthest is dropped
+        i = k-1;
+        replaced = 1;
+    } else {
+        *nbest += 1;
+    }
+
+    while (i > 0 && match_closer(match, &best[i-1])) {
+        best[i] = best[i-1];
+        i--;
+    }
+    best[i] = *match;
+
+    return replaced;
+}
+
+//
+// create the pixel index.  The positions are sorted by healpix id; indices
+// for the objects are held in the index
+//
+
+struct pixindex* create_hpix_index(const struct healpix* hpix,
+                                   const double* ra,
+                                   const double* dec,
+                                   size_t n)
+{
+
+    struct pixindex* index=NULL;
+    int64_t* hpixids=NULL;
+
+    hpixids = malloc((n > 0 ? n : 1)*sizeof(int64_t));
+    if (hpixids == NULL) {
+        return NULL;
+    }
+
+    hpix_eq2pix_xyz_array(hpix, ra, dec, n, hpixids, NULL, NULL, NULL);
+
+    index = pixindex_new(hpixids, n);
+
+    free(hpixids);
+    return index;
+}
+
+//
+// as create_hpix_index, also making the xyz points in index order.  The
+// pixels and xyz are computed in one pass over the input, sharing the
+// trig, and the xyz are then gathered into index order
+//
+
+struct pixindex* create_hpix_index_points(const struct healpix* hpix,
+                                          const double* ra,
+                                          const double* dec,
+                                          size_t n,
+                                          int single,
+                                          struct soa_points** points)
+{
+    struct pixindex* index=NULL;
+    int64_t* hpixids=NULL;
+    double *x=NULL, *y=NULL, *z=NULL;
+    size_t nalloc = n > 0 ? n : 1;
+
+    *points = NULL;
+
+    hpixids = malloc(nalloc*sizeof(int64_t));
+    x = malloc(nalloc*sizeof(double));
+    y = malloc(nalloc*sizeof(double));
+    z = malloc(nalloc*sizeof(double));
+    if (hpixids == NULL || x == NULL || y == NULL || z == NULL) {
+        goto _create_hpix_index_points_bail;
+    }
+
+    hpix_eq2pix_xyz_array(hpix, ra, dec, n, hpixids, x, y, z);
+
+    index = pixindex_new(hpixids, n);
+    if (index == NULL) {
+        goto _create_hpix_index_points_bail;
+    }
+
+    // free these before making the points, to lower the peak memory
+    free(hpixids);
+    hpixids = NULL;
+
+    *points = soa_points_gather(x, y, z, index, single);
+    if (*points == NULL) {
+        index = pixindex_delete(index);
+    }
+
+_create_hpix_index_points_bail:
+    free(hpixids);
+    free(x);
+    free(y);
+    free(z);
+    return index;
+}
+
+int64_t engine_level_nside(int64_t nside, size_t level)
+{
+    size_t i=0;
+
+    for (i=0; i<level && nside > 1; i++) {
+        nside /= ENGINE_LEVEL_FACTOR;
+    }
+    return nside > 1 ? nside : 1;
+}
+
+double engine_level_max_radius(int64_t nside)
+{
+    return ENGINE_LEVEL_MAX_RADIUS/(double)nside;
+}
+
+size_t engine_level(int64_t nside, size_t nlevels, double radius)
+{
+    size_t level=0;
+
+    while (level+1 < nlevels
+            && radius > engine_level_max_radius(engine_level_nside(nside, level))) {
+        level++;
+    }
+    return level;
+}
+
+size_t engine_nlevels(int64_t nside, double max_radius)
+{
+    size_t nlevels=1;
+
+    while (engine_level_nside(nside, nlevels-1) > 1
+            && max_radius > engine_level_max_radius(engine_level_nside(nside, nlevels-1))) {
+        nlevels++;
+    }
+    return nlevels;
+}
+
+//
+// the index and points to search at a level
+//
+
+static inline struct match_level context_level(const struct match_context* ctx,
+                                               size_t level)
+{
+    struct match_level lev={0};
+
+    if (level > 0) {
+        return ctx->levels[level];
+    }
+
+    lev.hpix = ctx->hpix;
+    lev.index = ctx->index;
+    lev.points = ctx->points;
+    return lev;
+}
+
+//
+//   fill the entry with xyz and disc pixel ranges, as well
+//   as resetting the matches
+//
+//   the cached points and disc pixels are used if present; entries searched
+//   at a coarser level have no cached disc pixels
+//
+
+static void load_catalog_entry(const struct match_context* ctx,
+                               CatalogEntry* entry,
+                               size_t i)
+{
+    const Catalog* cat=ctx->cat;
+    CatPoint* cpt=&entry->point;
+
+    if (cat->points) {
+        *cpt = cat->points[i];
+    } else {
+        cat_fill_point(cat, i, cpt);
+    }
+
+    entry->level = 0;
+    if (ctx->nlevels > 1) {
+        entry->level = engine_level(ctx->hpix->nside, ctx->nlevels, cpt->radius);
+    }
+
+    if (cat->disc_offsets && entry->level == 0) {
+        entry->ranges = &cat->disc_ranges->data[cat->disc_offsets[i]];
+        entry->nranges = (cat->disc_offsets[i+1] - cat->disc_offsets[i])/2;
+    } else {
+        hpix_disc_intersect_ranges(context_level(ctx, entry->level).hpix,
+                                   cpt->x, cpt->y, cpt->z, cpt->radius,
+                                   entry->disc_ranges);
+        entry->ranges = vector_data(entry->disc_ranges);
+        entry->nranges = vector_size(entry->disc_ranges)/2;
+    }
+
+    vector_resize(entry->matches, 0);
+}
+
+/*
+   the squared chord distance within which single precision candidates are
+   passed to the double precision test, from the cosine of the radius
+*/
+
+static float screen_max_dist2(const CatPoint* cpt)
+{
+    double chord2 = 2.0 - 2.0*cpt->cos_radius;
+    double chord = sqrt(chord2 > 0 ? chord2 : 0) + KERNEL_SCREEN_MARGIN;
+
+    return (float)(chord*chord);
+}
+
+/*
+   test the n candidates at position j in the index, writing the position
+   within the block and the cosine of the distance of those accepted, as the
+   candidate kernels do.
+
+   With single precision points the candidates are screened in float, and
+   those passing are recomputed in double from the ra,dec as the double
+   precision points are made, so the same candidates are accepted with the
+   same cosdist
+*/
+
+static inline size_t test_candidates(const struct match_context* ctx,
+                                     const struct match_level* level,
+                                     candidate_kernel kernel,
+                                     screen_kernel screen,
+                                     const CatPoint* cpt,
+                                     float max_dist2,
+                                     size_t j,
+                                     size_t n,
+                                     int32_t* acc_ind,
+                                     double* acc_cosdist)
+{
+    const struct soa_points* points=level->points;
+    size_t k=0, npass=0, nacc=0, i=0;
+    double x=0, y=0, z=0, cos_angle=0;
+
+    if (points->x) {
+        return kernel(&points->x[j], &points->y[j], &points->z[j], n,
+                      cpt->x, cpt->y, cpt->z, cpt->cos_radius,
+                      acc_ind, acc_cosdist);
+    }
+
+    npass = screen(&points->xf[j], &points->yf[j], &points->zf[j], n,
+                   (float)cpt->x, (float)cpt->y, (float)cpt->z, max_dist2,
+                   acc_ind);
+
+    for (k=0; k < npass; k++) {
+        i = (size_t)level->index->indices[j + acc_ind[k]];
+
+        hpix_eq2pix_xyz_array(level->hpix, &ctx->ra[i], &ctx->dec[i], 1,
+                              NULL, &x, &y, &z);
+
+        cos_angle = x*cpt->x + y*cpt->y + z*cpt->z;
+        if (cos_angle > cpt->cos_radius) {
+            acc_ind[nacc] = acc_ind[k];
+            acc_cosdist[nacc] = cos_angle;
+            nacc++;
+        }
+    }
+
+    return nacc;
+}
+
+/*
+   for unique pairs, the first position in the index after the entry itself;
+   this is a self match, so the entry is in the index, within its pixel in
+   order of index
+*/
+
+static size_t unique_pairs_start(const struct match_context* ctx,
+                                 const struct match_level* level,
+                                 size_t cat_ind)
+{
+    int64_t pixel=0, ind=(int64_t)cat_ind;
+    size_t start=0, end=0, mid=0;
+
+    hpix_eq2pix_xyz_array(level->hpix, &ctx->ra[cat_ind], &ctx->dec[cat_ind],
+                          1, &pixel, NULL, NULL, NULL);
+
+    if (!pixindex_find(level->index, pixel, &start, &end)) {
+        return 0;
+    }
+
+    while (start < end) {
+        mid = start + (end - start)/2;
+        if (level->index->indices[mid] <= ind) {
+            start = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+
+    return start;
+}
+
+//
+// add a unique pair, ordered with cat_ind < input_ind, and also the other
+// way around for ENGINE_PAIRS_MIRROR
+//
+
+static inline void push_unique_pair(const struct match_context* ctx,
+                                    match_vector* matches,
+                                    const Match* match)
+{
+    Match pair=*match;
+
+    if (ctx->unique_pairs == ENGINE_PAIRS_MIRROR) {
+        vector_push(matches, pair);
+    }
+
+    if (ctx->unique_pairs == ENGINE_PAIRS_MIRROR
+            || pair.input_ind < pair.cat_ind) {
+        pair.cat_ind = match->input_ind;
+        pair.input_ind = match->cat_ind;
+    }
+    vector_push(matches, pair);
+}
+
+/*
+
+   Match the input catalog entry to the second set of points, the
+   hpix ids of which have been put into a sorted pixel index.
+
+   The disc pixels come in ranges, one or two for each ring, and the
+   candidates for a range are contiguous in the index, so each range takes
+   two binary searches rather than one for each pixel.
+
+   The matches are selected by mode, which is a constant in each of the
+   versions made in domatch1 below, so the compiler drops the other cases
+   from the inner loop
+
+       SELECT_ALL:   no restriction on the number of matches (maxmatch <= 0);
+                     matches are simply appended to the match vector in the
+                     catalog entry
+       SELECT_BEST:  maxmatch == 1, keeping a running closest match
+       SELECT_SMALL: maxmatch up to ENGINE_SMALL_MAXMATCH, a sorted buffer of
+                     k matches on the stack
+       SELECT_HEAP:  larger maxmatch; matches are appended up to the max
+                     allowed, then the match vector is converted to a heap and
+                     only matches closer than the farthest current match are
+                     added
+
+   When maxmatch > 0 the matches are left sorted closest first.
+
+   For unique pairs, which are only used with SELECT_ALL, the candidates at
+   or before the entry in the index are skipped
+
+*/
+
+#define SELECT_ALL 0
+#define SELECT_BEST 1
+#define SELECT_SMALL 2
+#define SELECT_HEAP 3
+
+static inline __attribute__((always_inline))
+void domatch1_select(const struct match_context* ctx,
+                     CatalogEntry* entry,
+                     size_t cat_ind,
+                     const int mode,
+                     const size_t kbest)
+{
+
+    struct match_level level=context_level(ctx, entry->level);
+    const struct pixindex* index=level.index;
+    candidate_kernel kernel=ctx->kernel ? ctx->kernel : kernel_get();
+    screen_kernel screen=ctx->screen ? ctx->screen : kernel_get_screen();
+    float max_dist2=0;
+
+    CatPoint *cpt=NULL;
+
+    size_t i=0, j=0, k=0, n=0, nacc=0, start=0, end=0, input_ind=0, first=0;
+
+    int32_t acc_ind[KERNEL_BLOCK];
+    double acc_cosdist[KERNEL_BLOCK];
+
+    int64_t maxmatch = ctx->maxmatch;
+
+    Match match={0};
+    match_vector* matches=NULL;
+
+    Match best[ENGINE_SMALL_MAXMATCH];
+    size_t nbest=0;
+
+    // the counts for entry->stats
+    int64_t npixels=0, nhits=0, ncandidates=0, naccepted=0, nreplaced=0;
+
+    matches = entry->matches;
+    cpt = &entry->point;
+
+    if (level.points->x == NULL) {
+        max_dist2 = screen_max_dist2(cpt);
+    }
+
+    if (mode == SELECT_ALL && ctx->unique_pairs) {
+        first = unique_pairs_start(ctx, &level, cat_ind);
+    }
+
+    // loop over the ranges of pixels that intersected a disc around
+    // this object
+
+    for (i=0; i < entry->nranges; i++) {
+
+        npixels += entry->ranges[2*i+1] - entry->ranges[2*i] + 1;
+
+        // get the points in this range of pixels
+        if (pixindex_find_range(index,
+                                entry->ranges[2*i], entry->ranges[2*i+1],
+                                &start, &end)) {
+
+            nhits++;
+
+            if (start < first) {
+                start = first;
+            }
+
+            // the points in the range are contiguous; test them in blocks
+            for (j=start; j < end; j += n) {
+
+                n = end - j;
+                if (n > KERNEL_BLOCK) {
+                    n = KERNEL_BLOCK;
+                }
+
+                nacc = test_candidates(ctx, &level, kernel, screen,
+                                       cpt, max_dist2, j, n,
+                                       acc_ind, acc_cosdist);
+
+                ncandidates += (int64_t)n;
+                naccepted += (int64_t)nacc;
+
+                for (k=0; k < nacc; k++) {
+
+                    input_ind = (size_t)index->indices[j + acc_ind[k]];
+
+                    if (ctx->matching_self && input_ind==cat_ind) {
+                        continue;
+                    }
+
+                    match.cat_ind=cat_ind;
+                    match.input_ind=(int64_t)input_ind;
+                    match.cosdist=acc_cosdist[k];
+
+                    switch (mode) {
+                        case SELECT_ALL:
+                            if (ctx->unique_pairs) {
+                                push_unique_pair(ctx, matches, &match);
+                            } else {
+                                vector_push(matches, match);
+                            }
+                            break;
+                        case SELECT_BEST:
+                            if (nbest == 0 || match_closer(&match, &best[0])) {
+                                nreplaced += (int64_t)nbest;
+                                best[0] = match;
+                                nbest = 1;
+                            }
+                            break;
+                        case SELECT_SMALL:
+                            nreplaced += select_insert(best, &nbest, kbest, &match);
+                            break;
+                        default:
+                            if ((int64_t)vector_size(matches) < maxmatch) {
+                                add_match(matches, &match, maxmatch);
+                            } else {
+                                nreplaced += match_heap_insert(matches, &match);
+                            }
+                            break;
+                    }
+
+                } // loop over points within distance
+
+            } // loop over blocks in range
+        } // range found in index
+    } // loop over disc pixel ranges
+
+    if (mode == SELECT_BEST || mode == SELECT_SMALL) {
+        for (k=0; k < nbest; k++) {
+            vector_push(matches, best[k]);
+        }
+    } else if (mode == SELECT_HEAP) {
+        sort_nearest(matches);
+    }
+
+    entry->stats.nentries++;
+    entry->stats.nranges += (int64_t)entry->nranges;
+    entry->stats.npixels += npixels;
+    entry->stats.nhits += nhits;
+    entry->stats.nmisses += (int64_t)entry->nranges - nhits;
+    entry->stats.ncandidates += ncandidates;
+    entry->stats.naccepted += naccepted;
+    entry->stats.nreplaced += nreplaced;
+}
+
+static void domatch1(const struct match_context* ctx,
+                     CatalogEntry* entry,
+                     size_t cat_ind)
+{
+    switch (ctx->maxmatch) {
+        case 1:
+            domatch1_select(ctx, entry, cat_ind, SELECT_BEST, 1);
+            break;
+        case 2:
+            domatch1_select(ctx, entry, cat_ind, SELECT_SMALL, 2);
+            break;
+        case 3:
+            domatch1_select(ctx, entry, cat_ind, SELECT_SMALL, 3);
+            break;
+        case 4:
+            domatch1_select(ctx, entry, cat_ind, SELECT_SMALL, 4);
+            break;
+        case 5:
+            domatch1_select(ctx, entry, cat_ind, SELECT_SMALL, 5);
+            break;
+        case 6:
+            domatch1_select(ctx, entry, cat_ind, SELECT_SMALL, 6);
+            break;
+        case 7:
+            domatch1_select(ctx, entry, cat_ind, SELECT_SMALL, 7);
+            break;
+        case 8:
+            domatch1_select(ctx, entry, cat_ind, SELECT_SMALL, 8);
+            break;
+        default:
+            if (ctx->maxmatch <= 0) {
+                domatch1_select(ctx, entry, cat_ind, SELECT_ALL, 0);
+            } else {
+                domatch1_select(ctx, entry, cat_ind, SELECT_HEAP, 0);
+            }
+            break;
+    }
+}
+
+//
+// append the matches in src to dst
+//
+
+static void append_match_data(match_vector* dst, const Match* data, size_t n)
+{
+    size_t oldsize=vector_size(dst), newcap=0;
+    size_t newsize=oldsize + n;
+
+    if (n == 0) {
+        return;
+    }
+
+    // grow geometrically, vector_resize would only grow to the exact size
+    if (newsize > vector_capacity(dst)) {
+        newcap = 2*vector_capacity(dst);
+        if (newcap < newsize) {
+            newcap = newsize;
+        }
+        vector_reserve(dst, newcap);
+    }
+    vector_resize(dst, newsize);
+
+    memcpy(&dst->data[oldsize], data, n*sizeof(Match));
+}
+
+static void append_matches(match_vector* dst, const match_vector* src)
+{
+    append_match_data(dst, src->data, vector_size(src));
+}
+
+/*
+   count the matches for the entry, as domatch1 but without keeping them.
+   All matches are counted, regardless of maxmatch
+*/
+
+static size_t domatch1_count(const struct match_context* ctx,
+                             const CatalogEntry* entry,
+                             size_t cat_ind)
+{
+    struct match_level level=context_level(ctx, entry->level);
+    const struct pixindex* index=level.index;
+    candidate_kernel kernel=ctx->kernel ? ctx->kernel : kernel_get();
+    screen_kernel screen=ctx->screen ? ctx->screen : kernel_get_screen();
+    float max_dist2=0;
+
+    const CatPoint *cpt=&entry->point;
+
+    size_t i=0, j=0, k=0, n=0, nacc=0, start=0, end=0, nmatches=0, first=0;
+
+    int32_t acc_ind[KERNEL_BLOCK];
+    double acc_cosdist[KERNEL_BLOCK];
+
+    if (level.points->x == NULL) {
+        max_dist2 = screen_max_dist2(cpt);
+    }
+
+    if (ctx->unique_pairs) {
+        first = unique_pairs_start(ctx, &level, cat_ind);
+    }
+
+    for (i=0; i < entry->nranges; i++) {
+
+        if (pixindex_find_range(index,
+                                entry->ranges[2*i], entry->ranges[2*i+1],
+                                &start, &end)) {
+
+            if (start < first) {
+                start = first;
+            }
+
+            for (j=start; j < end; j += n) {
+
+                n = end - j;
+                if (n > KERNEL_BLOCK) {
+                    n = KERNEL_BLOCK;
+                }
+
+                nacc = test_candidates(ctx, &level, kernel, screen,
+                                       cpt, max_dist2, j, n,
+                                       acc_ind, acc_cosdist);
+
+                nmatches += nacc;
+
+                if (ctx->matching_self) {
+                    for (k=0; k < nacc; k++) {
+                        if ((size_t)index->indices[j + acc_ind[k]] == cat_ind) {
+                            nmatches--;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (ctx->unique_pairs == ENGINE_PAIRS_MIRROR) {
+        nmatches *= 2;
+    }
+
+    return nmatches;
+}
+
+//
+// run fn for each of the workers, the calling thread being the first.  If a
+// thread cannot be started the work is done by the threads we have, so the
+// workers must share their work through a counter
+//
+
+static void run_workers(void* (*fn)(void*),
+                        void* workers,
+                        size_t worker_size,
+                        int nthreads)
+{
+    int ithread=0, nstarted=0;
+    pthread_t* threads=NULL;
+    char* wptr=workers;
+
+    if (nthreads > 1) {
+        threads = calloc(nthreads, sizeof(pthread_t));
+    }
+
+    if (threads) {
+        for (ithread=1; ithread<nthreads; ithread++) {
+            if (pthread_create(&threads[ithread], NULL,
+                               fn, wptr + ithread*worker_size) != 0) {
+                break;
+            }
+            nstarted++;
+        }
+    }
+
+    fn(wptr);
+
+    for (ithread=1; ithread<=nstarted; ithread++) {
+        pthread_join(threads[ithread], NULL);
+    }
+
+    free(threads);
+}
+
+//
+// get the next chunk of work from a shared counter
+//
+
+static size_t next_chunk(pthread_mutex_t* lock, size_t* next)
+{
+    size_t ichunk=0;
+
+    pthread_mutex_lock(lock);
+    ichunk = *next;
+    *next += 1;
+    pthread_mutex_unlock(lock);
+
+    return ichunk;
+}
+
+//
+// add the counts for the entries searched by a worker to the stats of the
+// match, if they are kept
+//
+
+static void add_entry_stats(const struct match_context* ctx,
+                            const CatalogEntry* entry)
+{
+    struct entry_stats* stats=ctx->stats;
+
+    if (stats == NULL || entry == NULL) {
+        return;
+    }
+
+    stats->nentries += entry->stats.nentries;
+    stats->nranges += entry->stats.nranges;
+    stats->npixels += entry->stats.npixels;
+    stats->nhits += entry->stats.nhits;
+    stats->nmisses += entry->stats.nmisses;
+    stats->ncandidates += entry->stats.ncandidates;
+    stats->naccepted += entry->stats.naccepted;
+    stats->nreplaced += entry->stats.nreplaced;
+}
+
+/*
+   a function run for a catalog entry, with extra data in arg
+*/
+typedef void (*entry_function)(const struct match_context* ctx,
+                               CatalogEntry* entry,
+                               size_t cat_ind,
+                               void* arg);
+
+/*
+   A window of catalog entries [start, end), walked in pixel order so that
+   consecutive entries search nearby parts of the index and reuse the
+   candidates while they are in cache.  The walk is split into chunks of
+   ENGINE_CHUNK_SIZE entries, taken by the threads, and once all are done the
+   matches are gathered back into catalog order for the consumer
+*/
+struct match_window {
+    size_t start;
+    size_t end;
+
+    // the catalog index of each entry in walk order, and the position in
+    // the walk of each entry in catalog order
+    int64_t* order;
+    int64_t* walkpos;
+
+    // the matches for each chunk of the walk, and where those for each
+    // entry start in them, by walk position
+    match_vector** chunks;
+    size_t* mstart;
+    size_t nchunks;
+
+    // the chunks taken and done
+    size_t next;
+    size_t ndone;
+
+    // the matches in catalog order
+    match_vector* matches;
+};
+
+/*
+   the work for a range of catalog entries, shared between the threads.
+
+   The windows are held in nbuf buffers; window k uses buffer k % nbuf.  The
+   calling thread sorts each window and makes it ready, then waits for it to
+   be done, gathers the matches and sends them on.  The workers take chunks
+   from the ready windows in order, so they fill the next window while this
+   one is consumed
+*/
+struct match_work {
+    const struct match_context* ctx;
+
+    // finds the matches for an entry, leaving them in entry->matches
+    entry_function fn;
+    void* arg;
+
+    size_t cat_start;
+    size_t cat_end;
+
+    struct match_window* windows;
+    size_t nbuf;
+    size_t nwindows;
+
+    // the windows made ready, and the one the workers take chunks from
+    size_t nready;
+    size_t current;
+    int stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t window_ready;
+    pthread_cond_t window_done;
+};
+
+struct match_worker {
+    struct match_work* work;
+    CatalogEntry* entry;
+};
+
+static void match_window_free(struct match_window* win)
+{
+    size_t i=0;
+
+    free(win->order);
+    free(win->walkpos);
+    free(win->mstart);
+    if (win->chunks) {
+        for (i=0; i<win->nchunks; i++) {
+            vector_free(win->chunks[i]);
+        }
+        free(win->chunks);
+    }
+    vector_free(win->matches);
+}
+
+// allocate a window of up to size entries; returns 0 on failure
+static int match_window_alloc(struct match_window* win, size_t size)
+{
+    size_t i=0;
+
+    win->nchunks = (size + ENGINE_CHUNK_SIZE - 1)/ENGINE_CHUNK_SIZE;
+    win->order = malloc(size*sizeof(int64_t));
+    win->walkpos = malloc(size*sizeof(int64_t));
+    win->mstart = malloc(size*sizeof(size_t));
+    win->chunks = calloc(win->nchunks, sizeof(match_vector*));
+    win->matches = match_vector_new();
+    if (win->order == NULL || win->walkpos == NULL || win->mstart == NULL
+            || win->chunks == NULL || win->matches == NULL) {
+        return 0;
+    }
+
+    for (i=0; i<win->nchunks; i++) {
+        win->chunks[i] = match_vector_new();
+        if (win->chunks[i] == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+   set up the window for catalog entries [start, end), sorting them by the
+   pixel of the catalog point at the catalog nside.  The sort is stable, so
+   entries in the same pixel stay in catalog order.  returns 0 on failure to
+   allocate
+*/
+static int match_window_prepare(const struct match_work* work,
+                                struct match_window* win,
+                                size_t start,
+                                size_t end)
+{
+    const Catalog* cat=work->ctx->cat;
+    size_t i=0, n=end-start;
+
+    win->start = start;
+    win->end = end;
+    win->nchunks = (n + ENGINE_CHUNK_SIZE - 1)/ENGINE_CHUNK_SIZE;
+    win->next = 0;
+    win->ndone = 0;
+
+    // the pixels are sorted in place of the walk positions
+    hpix_eq2pix_xyz_array(work->ctx->hpix, &cat->ra[start], &cat->dec[start], n,
+                          win->walkpos, NULL, NULL, NULL);
+    for (i=0; i<n; i++) {
+        win->order[i] = (int64_t)(start + i);
+    }
+    if (!pixindex_radix_sort(win->walkpos, win->order, n)) {
+        return 0;
+    }
+
+    for (i=0; i<n; i++) {
+        win->walkpos[win->order[i] - (int64_t)start] = (int64_t)i;
+    }
+    return 1;
+}
+
+// find the matches for a chunk of the walk through the window
+static void match_window_chunk(const struct match_work* work,
+                               CatalogEntry* entry,
+                               struct match_window* win,
+                               size_t ichunk)
+{
+    match_vector* matches=win->chunks[ichunk];
+    size_t pos=0, first=ichunk*ENGINE_CHUNK_SIZE;
+    size_t last=first + ENGINE_CHUNK_SIZE, n=win->end - win->start;
+
+    if (last > n) {
+        last = n;
+    }
+
+    vector_resize(matches, 0);
+
+    for (pos=first; pos<last; pos++) {
+        work->fn(work->ctx, entry, (size_t)win->order[pos], work->arg);
+        win->mstart[pos] = vector_size(matches);
+        append_matches(matches, entry->matches);
+    }
+}
+
+// put the matches for the window in catalog order
+static void match_window_gather(struct match_window* win)
+{
+    const match_vector* chunk=NULL;
+    size_t i=0, pos=0, ichunk=0, mend=0, n=win->end - win->start;
+
+    vector_resize(win->matches, 0);
+
+    for (i=0; i<n; i++) {
+        pos = (size_t)win->walkpos[i];
+        ichunk = pos/ENGINE_CHUNK_SIZE;
+        chunk = win->chunks[ichunk];
+
+        if (pos+1 < n && (pos+1)/ENGINE_CHUNK_SIZE == ichunk) {
+            mend = win->mstart[pos+1];
+        } else {
+            mend = vector_size(chunk);
+        }
+        append_match_data(win->matches, &chunk->data[win->mstart[pos]],
+                          mend - win->mstart[pos]);
+    }
+}
+
+//
+// set up window k in its buffer and make it ready for the workers
+//
+
+static int work_prepare_window(struct match_work* work, size_t k, int threaded)
+{
+    struct match_window* win=&work->windows[k % work->nbuf];
+    size_t start=0, end=0;
+
+    start = work->cat_start + k*ENGINE_ORDER_WINDOW;
+    end = start + ENGINE_ORDER_WINDOW;
+    if (end > work->cat_end) {
+        end = work->cat_end;
+    }
+
+    if (!match_window_prepare(work, win, start, end)) {
+        return 0;
+    }
+
+    if (threaded) {
+        pthread_mutex_lock(&work->lock);
+        work->nready++;
+        pthread_cond_broadcast(&work->window_ready);
+        pthread_mutex_unlock(&work->lock);
+    }
+    return 1;
+}
+
+//
+// the entry function for a match within the catalog radius
+//
+
+static void match_entry(const struct match_context* ctx,
+                        CatalogEntry* entry,
+                        size_t cat_ind,
+                        void* arg)
+{
+    load_catalog_entry(ctx, entry, cat_ind);
+    domatch1(ctx, entry, cat_ind);
+}
+
+//
+// process chunks from the ready windows until there are none left
+//
+
+static void* match_worker_run(void* arg)
+{
+    struct match_worker* worker=arg;
+    struct match_work* work=worker->work;
+    struct match_window* win=NULL;
+    size_t ichunk=0;
+
+    pthread_mutex_lock(&work->lock);
+    while (!work->stop && work->current < work->nwindows) {
+
+        if (work->current >= work->nready) {
+            pthread_cond_wait(&work->window_ready, &work->lock);
+            continue;
+        }
+
+        win = &work->windows[work->current % work->nbuf];
+        ichunk = win->next++;
+        if (win->next == win->nchunks) {
+            work->current++;
+        }
+        pthread_mutex_unlock(&work->lock);
+
+        match_window_chunk(work, worker->entry, win, ichunk);
+
+        pthread_mutex_lock(&work->lock);
+        win->ndone++;
+        if (win->ndone == win->nchunks) {
+            pthread_cond_signal(&work->window_done);
+        }
+    }
+    pthread_mutex_unlock(&work->lock);
+
+    return NULL;
+}
+
+//
+// send the windows on in order as the workers finish them, making the later
+// windows ready as the buffers come free
+//
+
+static int consume_windows(struct match_work* work,
+                           match_consumer consume,
+                           void* data)
+{
+    struct match_window* win=NULL;
+    size_t k=0;
+    int status=1;
+
+    for (k=0; k<work->nbuf && k<work->nwindows; k++) {
+        if (!work_prepare_window(work, k, 1)) {
+            status=0;
+            goto _consume_windows_bail;
+        }
+    }
+
+    for (k=0; k<work->nwindows; k++) {
+        win = &work->windows[k % work->nbuf];
+
+        pthread_mutex_lock(&work->lock);
+        while (win->ndone < win->nchunks) {
+            pthread_cond_wait(&work->window_done, &work->lock);
+        }
+        pthread_mutex_unlock(&work->lock);
+
+        match_window_gather(win);
+        if (!consume(data, win->matches)) {
+            status=0;
+            break;
+        }
+
+        if (k + work->nbuf < work->nwindows
+                && !work_prepare_window(work, k + work->nbuf, 1)) {
+            status=0;
+            break;
+        }
+    }
+
+_consume_windows_bail:
+
+    pthread_mutex_lock(&work->lock);
+    if (!status) {
+        work->stop = 1;
+    }
+    pthread_cond_broadcast(&work->window_ready);
+    pthread_mutex_unlock(&work->lock);
+
+    return status;
+}
+
+int engine_match(const struct match_context* ctx,
+                 int nthreads,
+                 match_consumer consume,
+                 void* data)
+{
+    return engine_match_range(ctx, 0, ctx->cat->size, nthreads, consume, data);
+}
+
+/*
+   run fn for the catalog entries [cat_start, cat_end), a window at a time,
+   sending the matches for each window to the consumer in catalog order.
+
+   With more than one thread the workers are started once for the range, and
+   the calling thread prepares the windows and sends on the matches, which
+   it must do since the consumer may take the GIL.  If no thread can be
+   started, or for one thread, the calling thread does all the work
+*/
+
+static int engine_run_range(const struct match_context* ctx,
+                            size_t cat_start,
+                            size_t cat_end,
+                            int nthreads,
+                            entry_function fn,
+                            void* arg,
+                            match_consumer consume,
+                            void* data)
+{
+    int status=0, ithread=0, nstarted=0, locked=0;
+    size_t i=0, ncat=0, k=0, wsize=0, maxchunks=0;
+    pthread_t* threads=NULL;
+
+    struct match_work work={0};
+    struct match_worker* workers=NULL;
+
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    if (cat_end > ctx->cat->size) {
+        cat_end = ctx->cat->size;
+    }
+    ncat = cat_end > cat_start ? cat_end - cat_start : 0;
+    if (ncat == 0) {
+        return 1;
+    }
+
+    work.ctx = ctx;
+    work.fn = fn;
+    work.arg = arg;
+    work.cat_start = cat_start;
+    work.cat_end = cat_end;
+    work.nwindows = (ncat + ENGINE_ORDER_WINDOW - 1)/ENGINE_ORDER_WINDOW;
+
+    wsize = ncat < ENGINE_ORDER_WINDOW ? ncat : ENGINE_ORDER_WINDOW;
+    maxchunks = (wsize + ENGINE_CHUNK_SIZE - 1)/ENGINE_CHUNK_SIZE;
+    if ((size_t)nthreads > maxchunks) {
+        nthreads = (int)maxchunks;
+    }
+
+    // a window being filled and one being consumed
+    work.nbuf = nthreads > 1 && work.nwindows > 1 ? 2 : 1;
+
+    work.windows = calloc(work.nbuf, sizeof(struct match_window));
+    workers = calloc(nthreads, sizeof(struct match_worker));
+    if (work.windows == NULL || workers == NULL) {
+        goto _engine_run_range_bail;
+    }
+
+    for (i=0; i<work.nbuf; i++) {
+        if (!match_window_alloc(&work.windows[i], wsize)) {
+            goto _engine_run_range_bail;
+        }
+    }
+    for (ithread=0; ithread<nthreads; ithread++) {
+        workers[ithread].work = &work;
+        workers[ithread].entry = cat_entry_new();
+        if (workers[ithread].entry == NULL) {
+            goto _engine_run_range_bail;
+        }
+    }
+
+    if (nthreads > 1) {
+        threads = calloc(nthreads, sizeof(pthread_t));
+    }
+
+    if (threads) {
+        pthread_mutex_init(&work.lock, NULL);
+        pthread_cond_init(&work.window_ready, NULL);
+        pthread_cond_init(&work.window_done, NULL);
+        locked=1;
+
+        for (ithread=0; ithread<nthreads; ithread++) {
+            if (pthread_create(&threads[ithread], NULL,
+                               match_worker_run, &workers[ithread]) != 0) {
+                break;
+            }
+            nstarted++;
+        }
+    }
+
+    if (nstarted > 0) {
+        status = consume_windows(&work, consume, data);
+    } else {
+        status=1;
+        for (k=0; k<work.nwindows; k++) {
+            if (!work_prepare_window(&work, k, 0)) {
+                status=0;
+                break;
+            }
+            for (i=0; i<work.windows[0].nchunks; i++) {
+                match_window_chunk(&work, workers[0].entry, &work.windows[0], i);
+            }
+            match_window_gather(&work.windows[0]);
+            if (!consume(data, work.windows[0].matches)) {
+                status=0;
+                break;
+            }
+        }
+    }
+
+    for (ithread=0; ithread<nstarted; ithread++) {
+        pthread_join(threads[ithread], NULL);
+    }
+
+_engine_run_range_bail:
+
+    if (locked) {
+        pthread_cond_destroy(&work.window_done);
+        pthread_cond_destroy(&work.window_ready);
+        pthread_mutex_destroy(&work.lock);
+    }
+    free(threads);
+
+    if (work.windows) {
+        for (i=0; i<work.nbuf; i++) {
+            match_window_free(&work.windows[i]);
+        }
+        free(work.windows);
+    }
+    if (workers) {
+        for (ithread=0; ithread<nthreads; ithread++) {
+            add_entry_stats(ctx, workers[ithread].entry);
+            cat_entry_free(workers[ithread].entry);
+        }
+        free(workers);
+    }
+
+    return status;
+}
+
+int engine_match_range(const struct match_context* ctx,
+                       size_t cat_start,
+                       size_t cat_end,
+                       int nthreads,
+                       match_consumer consume,
+                       void* data)
+{
+    return engine_run_range(ctx, cat_start, cat_end, nthreads,
+                            match_entry, NULL, consume, data);
+}
+
+/*
+   find the nearest neighbors for the entry.  The search radius starts at
+   the scale of a pixel and is doubled until at least k points are found
+   within it, or it reaches the maximum distance.  Since all points within
+   the radius are found, the k closest of them are the k nearest overall.
+
+   Each pass starts afresh, which costs at most a third more than searching
+   the final disc once, since the disc area grows by four each time.  The
+   matches are left sorted closest first by domatch1
+*/
+
+static void knn_entry(const struct match_context* ctx,
+                      CatalogEntry* entry,
+                      size_t cat_ind,
+                      void* arg)
+{
+    const double* maxdist=arg;
+    const Catalog* cat=ctx->cat;
+    CatPoint* cpt=&entry->point;
+    double radius=0;
+
+    if (cat->points) {
+        *cpt = cat->points[cat_ind];
+    } else {
+        cat_fill_point(cat, cat_ind, cpt);
+    }
+    entry->level = 0;
+
+    radius = ENGINE_KNN_START_RADIUS/(double)ctx->hpix->nside;
+
+    while (1) {
+        if (radius > *maxdist) {
+            radius = *maxdist;
+        }
+
+        cpt->radius = radius;
+        cpt->cos_radius = cos(radius);
+
+        hpix_disc_intersect_ranges(ctx->hpix, cpt->x, cpt->y, cpt->z, radius,
+                                   entry->disc_ranges);
+        entry->ranges = vector_data(entry->disc_ranges);
+        entry->nranges = vector_size(entry->disc_ranges)/2;
+
+        vector_resize(entry->matches, 0);
+        domatch1(ctx, entry, cat_ind);
+
+        if ((int64_t)vector_size(entry->matches) >= ctx->maxmatch
+                || radius >= *maxdist) {
+            break;
+        }
+        radius *= 2;
+    }
+}
+
+int engine_knn(const struct match_context* ctx,
+               double maxdist,
+               int nthreads,
+               match_consumer consume,
+               void* data)
+{
+    if (maxdist <= 0 || maxdist > M_PI) {
+        maxdist = M_PI;
+    }
+
+    return engine_run_range(ctx, 0, ctx->cat->size, nthreads,
+                            knn_entry, &maxdist, consume, data);
+}
+
+/*
+   run a function for each catalog entry, after loading the entry, using up
+   to nthreads threads.  The entries are processed in no particular order
+*/
+
+struct foreach_work {
+    const struct match_context* ctx;
+    entry_function fn;
+    void* arg;
+
+    size_t nchunks;
+    size_t next;
+    pthread_mutex_t lock;
+};
+
+struct foreach_worker {
+    struct foreach_work* work;
+    CatalogEntry* entry;
+};
+
+static void* foreach_worker_run(void* arg)
+{
+    struct foreach_worker* worker=arg;
+    struct foreach_work* work=worker->work;
+    const struct match_context* ctx=work->ctx;
+    size_t ichunk=0, i=0, start=0, end=0, cat_ind=0;
+
+    while (1) {
+        ichunk = next_chunk(&work->lock, &work->next);
+        if (ichunk >= work->nchunks) {
+            break;
+        }
+
+        start = ichunk*ENGINE_CHUNK_SIZE;
+        end = start + ENGINE_CHUNK_SIZE;
+        if (end > ctx->cat->size) {
+            end = ctx->cat->size;
+        }
+
+        for (i=start; i<end; i++) {
+            cat_ind = ctx->cat_order ? (size_t)ctx->cat_order[i] : i;
+            load_catalog_entry(ctx, worker->entry, cat_ind);
+            work->fn(ctx, worker->entry, cat_ind, work->arg);
+        }
+    }
+
+    return NULL;
+}
+
+static int engine_foreach(const struct match_context* ctx,
+                          int nthreads,
+                          entry_function fn,
+                          void* arg)
+{
+    int status=0, ithread=0;
+    struct foreach_work work={0};
+    struct foreach_worker* workers=NULL;
+
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    work.ctx = ctx;
+    work.fn = fn;
+    work.arg = arg;
+    work.nchunks = (ctx->cat->size + ENGINE_CHUNK_SIZE - 1)/ENGINE_CHUNK_SIZE;
+    if ((size_t)nthreads > work.nchunks) {
+        nthreads = work.nchunks > 0 ? (int)work.nchunks : 1;
+    }
+
+    workers = calloc(nthreads, sizeof(struct foreach_worker));
+    if (workers == NULL) {
+        return 0;
+    }
+
+    for (ithread=0; ithread<nthreads; ithread++) {
+        workers[ithread].work = &work;
+        workers[ithread].entry = cat_entry_new();
+        if (workers[ithread].entry == NULL) {
+            goto _engine_foreach_bail;
+        }
+    }
+
+    pthread_mutex_init(&work.lock, NULL);
+    run_workers(foreach_worker_run, workers, sizeof(struct foreach_worker), nthreads);
+    pthread_mutex_destroy(&work.lock);
+
+    status=1;
+
+_engine_foreach_bail:
+
+    for (ithread=0; ithread<nthreads; ithread++) {
+        add_entry_stats(ctx, workers[ithread].entry);
+        cat_entry_free(workers[ithread].entry);
+    }
+    free(workers);
+
+    return status;
+}
+
+static void count_entry(const struct match_context* ctx,
+                        CatalogEntry* entry,
+                        size_t cat_ind,
+                        void* arg)
+{
+    int64_t* counts=arg;
+    int64_t count=0;
+
+    count = (int64_t)domatch1_count(ctx, entry, cat_ind);
+    if (ctx->maxmatch > 0 && count > ctx->maxmatch) {
+        count = ctx->maxmatch;
+    }
+    counts[cat_ind] = count;
+}
+
+int engine_count(const struct match_context* ctx,
+                 int nthreads,
+                 int64_t* counts)
+{
+    return engine_foreach(ctx, nthreads, count_entry, counts);
+}
+
+/*
+   the bin of a pair with cosine of the separation cosdist, for bins with
+   cos_edges decreasing; bin k holds cos_edges[k] >= cosdist >
+   cos_edges[k+1].  Returns nbins for pairs outside the bins
+*/
+
+static inline size_t find_pair_bin(const double* cos_edges,
+                                   size_t nbins,
+                                   double cosdist)
+{
+    size_t lo=0, hi=nbins, mid=0;
+
+    if (cosdist > cos_edges[0] || cosdist <= cos_edges[nbins]) {
+        return nbins;
+    }
+
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo)/2;
+        if (cosdist > cos_edges[mid]) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+   the pair counts, with a histogram for each chunk of catalog entries.  A
+   chunk is only worked on by one thread, and the histograms are summed in
+   order at the end, so the weighted counts do not depend on the number of
+   threads.  Without weights only chunk_counts is used, with weights only
+   chunk_wcounts
+*/
+struct pair_count_data {
+    const double* cos_edges;
+    size_t nbins;
+    const double* w1;
+    const double* w2;
+    int64_t* chunk_counts;
+    double* chunk_wcounts;
+};
+
+/*
+   add the pairs for the entry to the histogram, as domatch1_count finds
+   them
+*/
+
+static void pair_count_entry(const struct match_context* ctx,
+                             CatalogEntry* entry,
+                             size_t cat_ind,
+                             void* arg)
+{
+    struct pair_count_data* data=arg;
+    struct match_level level=context_level(ctx, entry->level);
+    const struct pixindex* index=level.index;
+    candidate_kernel kernel=ctx->kernel ? ctx->kernel : kernel_get();
+    screen_kernel screen=ctx->screen ? ctx->screen : kernel_get_screen();
+    float max_dist2=0;
+
+    const CatPoint *cpt=&entry->point;
+    size_t offset=(cat_ind/ENGINE_CHUNK_SIZE)*data->nbins;
+    int64_t* counts=data->chunk_counts ? &data->chunk_counts[offset] : NULL;
+    double* wcounts=data->chunk_wcounts ? &data->chunk_wcounts[offset] : NULL;
+    double w1=data->w1 ? data->w1[cat_ind] : 1.0, weight=0;
+
+    size_t i=0, j=0, k=0, n=0, nacc=0, start=0, end=0, first=0;
+    size_t input_ind=0, bin=0;
+
+    int32_t acc_ind[KERNEL_BLOCK];
+    double acc_cosdist[KERNEL_BLOCK];
+
+    if (level.points->x == NULL) {
+        max_dist2 = screen_max_dist2(cpt);
+    }
+
+    if (ctx->unique_pairs) {
+        first = unique_pairs_start(ctx, &level, cat_ind);
+    }
+
+    for (i=0; i < entry->nranges; i++) {
+
+        if (pixindex_find_range(index,
+                                entry->ranges[2*i], entry->ranges[2*i+1],
+                                &start, &end)) {
+
+            if (start < first) {
+                start = first;
+            }
+
+            for (j=start; j < end; j += n) {
+
+                n = end - j;
+                if (n > KERNEL_BLOCK) {
+                    n = KERNEL_BLOCK;
+                }
+
+                nacc = test_candidates(ctx, &level, kernel, screen,
+                                       cpt, max_dist2, j, n,
+                                       acc_ind, acc_cosdist);
+
+                for (k=0; k < nacc; k++) {
+                    bin = find_pair_bin(data->cos_edges, data->nbins,
+                                        acc_cosdist[k]);
+                    if (bin == data->nbins) {
+                        continue;
+                    }
+
+                    input_ind = (size_t)index->indices[j + acc_ind[k]];
+                    if (ctx->matching_self && input_ind == cat_ind) {
+                        continue;
+                    }
+
+                    if (counts) {
+                        counts[bin]++;
+                        continue;
+                    }
+
+                    weight = w1;
+                    if (data->w2) {
+                        weight *= data->w2[input_ind];
+                    }
+                    wcounts[bin] += weight;
+                }
+            }
+        }
+    }
+}
+
+int engine_pair_counts(const struct match_context* ctx,
+                       int nthreads,
+                       const double* cos_edges,
+                       size_t nbins,
+                       const double* w1,
+                       const double* w2,
+                       int64_t* counts,
+                       double* wcounts)
+{
+    int status=0;
+    size_t nchunks=0, ichunk=0, bin=0;
+    struct match_context pctx=*ctx;
+    struct pair_count_data data={0};
+
+    // the histograms are kept by chunk of catalog index
+    pctx.cat_order = NULL;
+
+    nchunks = (ctx->cat->size + ENGINE_CHUNK_SIZE - 1)/ENGINE_CHUNK_SIZE;
+
+    data.cos_edges = cos_edges;
+    data.nbins = nbins;
+    data.w1 = w1;
+    data.w2 = w2;
+    if (w1 == NULL && w2 == NULL) {
+        data.chunk_counts = calloc(nchunks*nbins + 1, sizeof(int64_t));
+        if (data.chunk_counts == NULL) {
+            return 0;
+        }
+    } else {
+        data.chunk_wcounts = calloc(nchunks*nbins + 1, sizeof(double));
+        if (data.chunk_wcounts == NULL) {
+            return 0;
+        }
+    }
+
+    status = engine_foreach(&pctx, nthreads, pair_count_entry, &data);
+
+    if (status && data.chunk_counts) {
+        for (bin=0; bin<nbins; bin++) {
+            counts[bin] = 0;
+        }
+        for (ichunk=0; ichunk<nchunks; ichunk++) {
+            for (bin=0; bin<nbins; bin++) {
+                counts[bin] += data.chunk_counts[ichunk*nbins + bin];
+            }
+        }
+    } else if (status) {
+        for (bin=0; bin<nbins; bin++) {
+            wcounts[bin] = 0;
+        }
+        for (ichunk=0; ichunk<nchunks; ichunk++) {
+            for (bin=0; bin<nbins; bin++) {
+                wcounts[bin] += data.chunk_wcounts[ichunk*nbins + bin];
+            }
+        }
+    }
+
+    free(data.chunk_counts);
+    free(data.chunk_wcounts);
+    return status;
+}
+
+struct fill_data {
+    const int64_t* offsets;
+    Match* matches;
+};
+
+static void fill_entry(const struct match_context* ctx,
+                       CatalogEntry* entry,
+                       size_t cat_ind,
+                       void* arg)
+{
+    struct fill_data* fill=arg;
+
+    domatch1(ctx, entry, cat_ind);
+
+    memcpy(&fill->matches[fill->offsets[cat_ind]],
+           entry->matches->data,
+           vector_size(entry->matches)*sizeof(Match));
+}
+
+int engine_fill(const struct match_context* ctx,
+                int nthreads,
+                const int64_t* offsets,
+                Match* matches)
+{
+    struct fill_data fill={0};
+
+    fill.offsets = offsets;
+    fill.matches = matches;
+
+    return engine_foreach(ctx, nthreads, fill_entry, &fill);
+}
+
+/*
+   The matches for the catalog entries when indexing the catalog, with the
+   data held in an arena so there is no allocation or free for each entry.
+
+   With maxmatch > 0 each entry has a match vector for add_match, the
+   capacity doubling up to maxmatch; the old data are left in the arena, but
+   they total less than maxmatch.  Otherwise each entry has a list of
+   segments, which double in size but are not copied as they grow
+*/
+
+struct match_segment {
+    struct match_segment* next;
+    size_t size;
+    size_t capacity;
+    Match data[];
+};
+
+struct match_list {
+    struct match_segment* head;
+    struct match_segment* tail;
+};
+
+//
+// make room for another match in the vector, so that add_match does not
+// reallocate.  Returns 0 on failure to allocate
+//
+
+static int arena_reserve_match(struct arena* arena,
+                               match_vector* matches,
+                               int64_t maxmatch)
+{
+    size_t newcap=0;
+    Match* data=NULL;
+
+    if (vector_size(matches) < vector_capacity(matches)
+            || (int64_t)vector_size(matches) >= maxmatch) {
+        return 1;
+    }
+
+    newcap = vector_capacity(matches) > 0
+        ? 2*vector_capacity(matches) : ENGINE_ARENA_INITCAP;
+    if ((int64_t)newcap > maxmatch) {
+        newcap = (size_t)maxmatch;
+    }
+
+    data = arena_alloc(arena, newcap*sizeof(Match));
+    if (data == NULL) {
+        return 0;
+    }
+    if (vector_size(matches) > 0) {
+        memcpy(data, matches->data, vector_size(matches)*sizeof(Match));
+    }
+
+    matches->data = data;
+    matches->capacity = newcap;
+    return 1;
+}
+
+//
+// append a match to the list.  Returns 0 on failure to allocate
+//
+
+static int match_list_push(struct arena* arena,
+                           struct match_list* list,
+                           const Match* match)
+{
+    struct match_segment* tail=list->tail;
+    struct match_segment* seg=NULL;
+    size_t capacity=0;
+
+    if (tail == NULL || tail->size == tail->capacity) {
+        capacity = tail ? 2*tail->capacity : ENGINE_ARENA_INITCAP;
+
+        seg = arena_alloc(arena,
+                          sizeof(struct match_segment) + capacity*sizeof(Match));
+        if (seg == NULL) {
+            return 0;
+        }
+        seg->next = NULL;
+        seg->size = 0;
+        seg->capacity = capacity;
+
+        if (tail) {
+            tail->next = seg;
+        } else {
+            list->head = seg;
+        }
+        list->tail = tail = seg;
+    }
+
+    tail->data[tail->size] = *match;
+    tail->size++;
+    return 1;
+}
+
+//
+// append the matches in the list to dst
+//
+
+static void append_match_list(match_vector* dst, const struct match_list* list)
+{
+    const struct match_segment* seg=NULL;
+    match_vector src={0};
+
+    for (seg=list->head; seg != NULL; seg=seg->next) {
+        src.size = seg->size;
+        src.capacity = seg->capacity;
+        src.data = (Match*) seg->data;
+        append_matches(dst, &src);
+    }
+}
+
+/*
+
+   Match with the index built over the catalog, streaming through the second
+   set of points one at a time, so the memory used follows the size of the
+   catalog rather than the input.
+
+   Each input point is searched with a disc of the largest catalog radius, and
+   candidates are kept if they are within the radius of the catalog entry.
+   Matches are gathered for each catalog entry with the same maxmatch rules as
+   domatch1, so the same matches are found as when indexing the input.  The
+   matches for the entries are kept in an arena, so growing them does not
+   call the allocator for each entry, and they are all released at once.
+
+*/
+
+int engine_match_catalog_index(const struct match_context* ctx,
+                               const struct pixindex* cat_index,
+                               int ordered,
+                               match_consumer consume,
+                               void* data)
+{
+    int status=0;
+    size_t i=0, j=0, k=0, start=0, end=0, cat_ind=0;
+    double max_radius=0, cos_angle=0;
+
+    int64_t maxmatch = ctx->maxmatch;
+
+    const Catalog* cat=ctx->cat;
+    const CatPoint* cpt=NULL;
+    lvector* disc_ranges=NULL;
+    match_vector* cat_matches=NULL;
+    struct match_list* cat_lists=NULL;
+    struct arena* arena=NULL;
+    match_vector* batch=NULL;
+    Point pt={0};
+    Match match={0};
+
+    ordered = ordered || maxmatch > 0;
+
+    disc_ranges = lvector_new();
+    if (disc_ranges == NULL) {
+        goto _engine_match_catalog_index_bail;
+    }
+
+    batch = match_vector_new();
+    if (batch == NULL) {
+        goto _engine_match_catalog_index_bail;
+    }
+
+    if (ordered) {
+        arena = arena_new(0);
+        if (arena == NULL) {
+            goto _engine_match_catalog_index_bail;
+        }
+        if (maxmatch > 0) {
+            cat_matches = calloc(cat->size > 0 ? cat->size : 1, sizeof(match_vector));
+        } else {
+            cat_lists = calloc(cat->size > 0 ? cat->size : 1, sizeof(struct match_list));
+        }
+        if (cat_matches == NULL && cat_lists == NULL) {
+            goto _engine_match_catalog_index_bail;
+        }
+    }
+
+    for (k=0; k<cat->size; k++) {
+        if (cat->points[k].radius > max_radius) {
+            max_radius = cat->points[k].radius;
+        }
+    }
+
+    for (i=0; i<ctx->npoints; i++) {
+
+        hpix_eq2xyz(ctx->ra[i], ctx->dec[i], &pt.x, &pt.y, &pt.z);
+
+        hpix_disc_intersect_ranges(ctx->hpix, pt.x, pt.y, pt.z, max_radius, disc_ranges);
+
+        for (j=0; j < vector_size(disc_ranges); j += 2) {
+
+            if (!pixindex_find_range(cat_index,
+                                     vector_get(disc_ranges, j),
+                                     vector_get(disc_ranges, j+1),
+                                     &start, &end)) {
+                continue;
+            }
+
+            for (k=start; k < end; k++) {
+
+                cat_ind = (size_t)cat_index->indices[k];
+
+                if (ctx->matching_self && cat_ind==i) {
+                    continue;
+                }
+
+                cpt = &cat->points[cat_ind];
+
+                cos_angle = pt.x*cpt->x + pt.y*cpt->y + pt.z*cpt->z;
+
+                if (cos_angle > cpt->cos_radius) {
+                    match.cat_ind=(int64_t)cat_ind;
+                    match.input_ind=(int64_t)i;
+                    match.cosdist=cos_angle;
+
+                    if (cat_matches) {
+                        if (!arena_reserve_match(arena, &cat_matches[cat_ind],
+                                                 maxmatch)) {
+                            goto _engine_match_catalog_index_bail;
+                        }
+                        add_match(&cat_matches[cat_ind], &match, maxmatch);
+                    } else if (cat_lists) {
+                        if (!match_list_push(arena, &cat_lists[cat_ind], &match)) {
+                            goto _engine_match_catalog_index_bail;
+                        }
+                    } else {
+                        vector_push(batch, match);
+                    }
+                } // within distance
+
+            } // loop over catalog entries in range
+        } // loop over disc pixel ranges
+
+        if (!ordered && vector_size(batch) >= ENGINE_STREAM_BATCH) {
+            if (!consume(data, batch)) {
+                goto _engine_match_catalog_index_bail;
+            }
+            vector_resize(batch, 0);
+        }
+
+    } // loop over input points
+
+    if (ordered) {
+        for (k=0; k<cat->size; k++) {
+            if (cat_matches) {
+                // closest first, as when indexing the input points
+                sort_nearest(&cat_matches[k]);
+                append_matches(batch, &cat_matches[k]);
+            } else {
+                append_match_list(batch, &cat_lists[k]);
+            }
+
+            if (vector_size(batch) >= ENGINE_STREAM_BATCH) {
+                if (!consume(data, batch)) {
+                    goto _engine_match_catalog_index_bail;
+                }
+                vector_resize(batch, 0);
+            }
+        }
+    }
+
+    if (!consume(data, batch)) {
+        goto _engine_match_catalog_index_bail;
+    }
+
+    status=1;
+
+_engine_match_catalog_index_bail:
+
+    vector_free(disc_ranges);
+    vector_free(batch);
+    // the match data are all in the arena
+    free(cat_matches);
+    free(cat_lists);
+    arena = arena_delete(arena);
+
+    return status;
+}
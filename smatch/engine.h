@@ -0,0 +1,262 @@
+/*
+   The matching engine.  This code does not use the python api, so it can be
+   run from multiple threads.
+
+   The ra,dec sent to these routines must already have been checked to be
+   within range
+*/
+#ifndef _ENGINE_H
+#define _ENGINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "vector.h"
+#include "healpix.h"
+#include "pixindex.h"
+#include "cat.h"
+#include "kernel.h"
+
+// number of catalog entries processed as a unit by a thread
+#define ENGINE_CHUNK_SIZE 1024
+
+// number of chunks per thread in a range given to engine_match_range by a
+// caller that wants to bound the memory, see ENGINE_WINDOW_SIZE
+#define ENGINE_CHUNKS_PER_THREAD 4
+
+// engine_match walks the catalog a window of this many entries at a time,
+// in pixel order within the window, collecting the matches for the window
+// before sending them on in catalog order.  The window must be large for
+// consecutive entries in the walk to be near each other on the sky
+#define ENGINE_ORDER_WINDOW 262144
+
+// the first search radius for the nearest neighbors, in units of 1/nside
+// radians, about the size of a pixel
+#define ENGINE_KNN_START_RADIUS 1.0
+
+/*
+   Multi-resolution matching.  The disc of an entry with a large radius
+   covers many pixels at the nside of the catalog, most of them empty.  In
+   multi-resolution mode the second set of points is also indexed at coarser
+   levels, the nside being divided by ENGINE_LEVEL_FACTOR at each, and each
+   entry is searched at the finest level at which its radius is at most
+   ENGINE_LEVEL_MAX_RADIUS/nside, so its disc spans a few pixels across.
+   Level 0 is the nside of the catalog.
+*/
+#define ENGINE_LEVEL_FACTOR 4
+#define ENGINE_LEVEL_MAX_RADIUS 4.0
+
+/*
+   Unique pairs in a self match.  When all entries have the same radius the
+   matches are symmetric, so each entry only tests the points after it in the
+   index, which holds the same points, and about half the candidates are
+   tested.  ENGINE_PAIRS_UNIQUE gives each pair once, with cat_ind <
+   input_ind, and ENGINE_PAIRS_MIRROR gives it in both orders.  The pairs are
+   sent with the entry that found them, so they are not ordered by cat_ind
+*/
+#define ENGINE_PAIRS_ALL 0
+#define ENGINE_PAIRS_UNIQUE 1
+#define ENGINE_PAIRS_MIRROR 2
+
+// the second set of points indexed at one level
+struct match_level {
+    const struct healpix* hpix;
+    const struct pixindex* index;
+    const struct soa_points* points;
+};
+
+// the number of levels needed for radii up to max_radius (radians), at
+// least 1
+size_t engine_nlevels(int64_t nside, double max_radius);
+
+// the nside at the level, for a catalog nside
+int64_t engine_level_nside(int64_t nside, size_t level);
+
+// the largest radius (radians) searched at an nside
+double engine_level_max_radius(int64_t nside);
+
+// the level at which a disc of the radius (radians) is searched
+size_t engine_level(int64_t nside, size_t nlevels, double radius);
+
+/*
+   The state for a match.  This is only read during the match, so it is
+   shared between threads.
+*/
+struct match_context {
+    const struct healpix* hpix;
+
+    int64_t maxmatch;
+    int matching_self;
+
+    // for a self match with maxmatch <= 0 and the same radius for all
+    // entries, find each pair once; see ENGINE_PAIRS_UNIQUE
+    int unique_pairs;
+
+    // the catalog; cached points and disc pixels are used if present
+    const Catalog* cat;
+
+    // the second set of points, and the index over them
+    const double* ra;
+    const double* dec;
+    size_t npoints;
+
+    // the xyz of the second set of points, in index order
+    const struct pixindex* index;
+    const struct soa_points* points;
+
+    // for multi-resolution matching, the index at each level when nlevels
+    // > 1; levels[0] must match hpix, index and points above.  Only used
+    // when indexing the second set of points
+    const struct match_level* levels;
+    size_t nlevels;
+
+    // the candidate test kernel; if NULL the kernel from kernel_get() is used
+    candidate_kernel kernel;
+
+    // the screen for single precision points; if NULL the kernel from
+    // kernel_get_screen() is used.  The ra,dec above are used to recompute
+    // the candidates that pass in double precision
+    screen_kernel screen;
+
+    // if set, the counts for the entries searched for matches are added
+    // here; see entry_stats in cat.h.  The counting in engine_count and
+    // engine_pair_counts, and the match with the catalog index, are not
+    // counted
+    struct entry_stats* stats;
+
+    // if set, engine_count and engine_fill visit the catalog entries in this
+    // order, usually the catalog sorted by pixel so that consecutive entries
+    // use nearby candidates.  The results are still placed by catalog index
+    const int64_t* cat_order;
+};
+
+/*
+   Called with the matches for each block of catalog entries, in order of
+   catalog index.  Return 0 to stop the match.
+*/
+typedef int (*match_consumer)(void* data, const match_vector* matches);
+
+// index the points by healpix id; returns NULL on failure to allocate
+struct pixindex* create_hpix_index(const struct healpix* hpix,
+                                   const double* ra,
+                                   const double* dec,
+                                   size_t n);
+
+// index the points by healpix id, also making their xyz in index order, in
+// single precision if single is set; returns NULL on failure to allocate,
+// in which case *points is also NULL
+struct pixindex* create_hpix_index_points(const struct healpix* hpix,
+                                          const double* ra,
+                                          const double* dec,
+                                          size_t n,
+                                          int single,
+                                          struct soa_points** points);
+
+/*
+   add a match to the vector.  If maxmatch > 0 only the closest maxmatch are
+   kept, ties going to the lower input index, held as a heap with the
+   farthest first.  Returns 1 if the number of matches grew
+*/
+int add_match(match_vector* matches, const Match* match, int64_t maxmatch);
+
+/*
+   match each catalog entry to the indexed second set of points, using up to
+   nthreads threads.  The matches are sent to the consumer in order of
+   catalog index, so the results do not depend on the number of threads.
+
+   returns 0 on failure to allocate or if the consumer returns 0
+*/
+int engine_match(const struct match_context* ctx,
+                 int nthreads,
+                 match_consumer consume,
+                 void* data);
+
+/*
+   as engine_match, for the catalog entries [cat_start, cat_end)
+*/
+int engine_match_range(const struct match_context* ctx,
+                       size_t cat_start,
+                       size_t cat_end,
+                       int nthreads,
+                       match_consumer consume,
+                       void* data);
+
+/*
+   count the matches for each catalog entry, as found by engine_match, using
+   up to nthreads threads.  counts must have an element for each catalog
+   entry.  returns 0 on failure to allocate
+*/
+int engine_count(const struct match_context* ctx,
+                 int nthreads,
+                 int64_t* counts);
+
+/*
+   match each catalog entry, writing the matches for entry i at
+   matches[offsets[i]], using up to nthreads threads.  The offsets are the
+   cumulative counts from engine_count, so the matches are in the same order
+   as for engine_match.  returns 0 on failure to allocate
+*/
+int engine_fill(const struct match_context* ctx,
+                int nthreads,
+                const int64_t* offsets,
+                Match* matches);
+
+/*
+   find the ctx->maxmatch nearest of the second set of points to each catalog
+   entry, within maxdist radians; send maxdist <= 0 for no limit.  The
+   catalog radii are not used.  The matches for each entry are sorted with
+   the closest first, and are sent to the consumer in order of catalog index
+   as for engine_match.  The multi-resolution levels are not used.
+
+   returns 0 on failure to allocate or if the consumer returns 0
+*/
+int engine_knn(const struct match_context* ctx,
+               double maxdist,
+               int nthreads,
+               match_consumer consume,
+               void* data);
+
+/*
+   count the pairs in bins of separation, using up to nthreads threads.  The
+   nbins+1 cos_edges are the cosines of the bin edges, decreasing, and bin k
+   holds the pairs with cos_edges[k] >= cosdist > cos_edges[k+1].  The last
+   edge should be the cosine of the catalog radius, as computed for the
+   catalog points.
+
+   Each pair counts w1[cat_ind]*w2[input_ind]; either may be NULL for
+   weights of 1.  When both are NULL the pairs are counted exactly in
+   counts, otherwise the weighted counts go in wcounts; nbins of them, which
+   do not depend on the number of threads.  With unique_pairs each pair is
+   counted once.  returns 0 on failure to allocate
+*/
+int engine_pair_counts(const struct match_context* ctx,
+                       int nthreads,
+                       const double* cos_edges,
+                       size_t nbins,
+                       const double* w1,
+                       const double* w2,
+                       int64_t* counts,
+                       double* wcounts);
+
+// a range of catalog entries for engine_match_range that keeps the threads
+// busy while bounding the matches held
+#define ENGINE_WINDOW_SIZE(nthreads) \
+    ((size_t)(nthreads)*ENGINE_CHUNKS_PER_THREAD*ENGINE_CHUNK_SIZE)
+
+/*
+   match using an index built over the catalog, streaming through the second
+   set of points.  The catalog points must have been computed.
+
+   If ordered is set, the matches are gathered for each catalog entry and
+   sent to the consumer in order of catalog index at the end.  Otherwise the
+   matches are only gathered this way if maxmatch > 0, and are sent on in
+   batches as they are found otherwise.
+
+   returns 0 on failure to allocate or if the consumer returns 0
+*/
+int engine_match_catalog_index(const struct match_context* ctx,
+                               const struct pixindex* cat_index,
+                               int ordered,
+                               match_consumer consume,
+                               void* data);
+
+#endif
@@ -20,9 +20,65 @@ double hpix_area(int64 nside) {
     return 4.0*M_PI/npix;
 }
 
+//
+// fill the geometry for ring iz
+//
+
+static void hpix_fill_ring(const struct healpix* hpix, int64 iz, struct hpix_ring* ring)
+{
+    int64 nside=hpix->nside, ir=0;
+    double dth1 = 1. / (3.0*nside*nside);
+    double dth2 = 2. / (3.0*nside);
+    double tmp=0;
+
+    if (iz <= nside-1) { // north polar cap
+        ring->z = 1.  - iz*iz*dth1;
+    } else if (iz <= 3*nside) { // tropical band + equat.
+        ring->z = (2*nside-iz) * dth2;
+    } else {
+        tmp = 4*nside-iz;
+        ring->z = - 1. + tmp*tmp*dth1;
+    }
+    ring->c = 1. - ring->z*ring->z;
+
+    ring->shift = 0.5;
+    if (iz<nside) {
+        // north pole
+        ir = iz;
+        ring->nr = ir*4;
+        ring->ipix1 = 2*ir*(ir-1);        //    lowest pixel number in the ring
+    } else if (iz>(3*nside)) {
+        // south pole
+        ir = 4*nside - iz;
+        ring->nr = ir*4;
+        ring->ipix1 = hpix->npix - 2*ir*(ir+1); // lowest pixel number in the ring
+    } else {
+        // equatorial region
+        ir = iz - nside + 1;           //    within {1, 2*nside + 1}
+        ring->nr = nside*4;
+        if ((ir&1)==0) ring->shift = 0;
+        ring->ipix1 = hpix->ncap + (ir-1)*ring->nr; // lowest pixel number in the ring
+    }
+}
+
+//
+// get ring iz from the table, or compute it into tmp if there is no table
+//
+
+static inline const struct hpix_ring* hpix_get_ring(const struct healpix* hpix,
+                                                    int64 iz,
+                                                    struct hpix_ring* tmp)
+{
+    if (hpix->rings) {
+        return &hpix->rings[iz];
+    }
+    hpix_fill_ring(hpix, iz, tmp);
+    return tmp;
+}
 
 struct healpix* hpix_new(int64 nside) {
     struct healpix* hpix=NULL;
+    int64 iz=0;
 
     if (nside < 1 || nside > NS_MAX) {
         char err[128];
@@ -41,6 +97,17 @@ struct healpix* hpix_new(int64 nside) {
     hpix->npix = hpix_npix(nside);
     hpix->area = hpix_area(nside);
     hpix->ncap = 2*nside*(nside-1); // number of pixels in the north polar cap
+    hpix->rings = NULL;
+
+    // the table is optional, we compute the rings as needed without it
+    if (nside <= HPIX_RING_TABLE_MAX_NSIDE) {
+        hpix->rings = malloc(4*nside*sizeof(struct hpix_ring));
+        if (hpix->rings) {
+            for (iz=1; iz<4*nside; iz++) {
+                hpix_fill_ring(hpix, iz, &hpix->rings[iz]);
+            }
+        }
+    }
 
 _hpix_new_bail:
 
@@ -49,7 +116,10 @@ _hpix_new_bail:
 
 // usage:  hpix=hpix_delete(hpix);
 struct healpix* hpix_delete(struct healpix* hpix) {
-    free(hpix);
+    if (hpix) {
+        free(hpix->rings);
+        free(hpix);
+    }
     return NULL;
 }
 
@@ -68,100 +138,266 @@ void hpix_disc_intersect(
     double fudge = 1.362*M_PI/(4*hpix->nside);
 
     radius += fudge;
+    if (radius > M_PI) {
+        // the whole sphere; a larger radius would shrink the disc
+        radius = M_PI;
+    }
     hpix_disc_contains(hpix, x, y, z, radius, listpix);
 }
 
-void hpix_disc_contains(
+//
+// get the pixels within dphi of phi0 in the ring, as the first pixel and
+// the count.  The pixels run from first, wrapping past the highest pixel in
+// the ring to the lowest
+//
+
+static int64 hpix_ring_interval(const struct hpix_ring* ring,
+                                double phi0,
+                                double dphi,
+                                int64* first)
+{
+    int64 ip_lo=0, ip_hi=0, pixnum=0;
+    int64 nr=ring->nr, ipix1=ring->ipix1;
+
+    if (dphi > (M_PI-1e-7)) {
+        ip_lo = 0;
+        ip_hi = nr-1;
+        pixnum = ipix1;
+    } else {
+        // M_1_PI is 1/pi
+        ip_lo = (int64)( floor(nr*.5*M_1_PI*(phi0-dphi) - ring->shift) )+1;
+        ip_hi = (int64)( floor(nr*.5*M_1_PI*(phi0+dphi) - ring->shift) );
+        pixnum = ip_lo+ipix1;
+        if (pixnum<ipix1) {
+            pixnum += nr;
+        }
+    }
+
+    *first = pixnum;
+    return ip_hi - ip_lo + 1;
+}
+
+//
+// append the pixels within dphi of phi0 in the ring.  The space is reserved
+// once and the pixels written directly
+//
+
+static void hpix_append_ring(const struct hpix_ring* ring,
+                             double phi0,
+                             double dphi,
+                             lvector* plist)
+{
+    int64 i=0, count=0, pixnum=0;
+    int64 nr=ring->nr;
+    int64 ipix2 = ring->ipix1 + nr - 1;  //    highest pixel number in the ring
+    size_t size=vector_size(plist), newcap=0;
+    int64_t* data=NULL;
+
+    count = hpix_ring_interval(ring, phi0, dphi, &pixnum);
+    if (count <= 0) {
+        return;
+    }
+
+    // grow geometrically, as vector_push would
+    if (size + count > vector_capacity(plist)) {
+        newcap = 2*vector_capacity(plist);
+        if (newcap < size + count) {
+            newcap = size + count;
+        }
+        vector_realloc(plist, newcap);
+    }
+    vector_resize(plist, size + count);
+    data = &plist->data[size];
+
+    for (i=0; i<count; ++i, ++pixnum) {
+        if (pixnum>ipix2) {
+            pixnum -= nr;
+        }
+        data[i] = pixnum;
+    }
+}
+
+//
+// append the pixels within dphi of phi0 in the ring as ranges of pixel
+// numbers, lo and hi inclusive.  An interval that wraps is split in two, so
+// the pixels are in the same order as for hpix_append_ring
+//
+
+static void hpix_append_ring_ranges(const struct hpix_ring* ring,
+                                    double phi0,
+                                    double dphi,
+                                    lvector* ranges)
+{
+    int64 count=0, first=0, last=0;
+    int64 nr=ring->nr, ipix1=ring->ipix1;
+    int64 ipix2 = ipix1 + nr - 1;
+
+    count = hpix_ring_interval(ring, phi0, dphi, &first);
+    if (count <= 0) {
+        return;
+    }
+
+    last = first + count - 1;
+    if (last <= ipix2) {
+        vector_push(ranges, first);
+        vector_push(ranges, last);
+    } else {
+        vector_push(ranges, first);
+        vector_push(ranges, ipix2);
+        vector_push(ranges, ipix1);
+        vector_push(ranges, last - nr);
+    }
+}
+
+//
+// append the pixels with centers in the disc; cosang and sinang are the
+// cosine and sine of the radius, so they can be computed once for a fixed
+// radius.  If as_ranges is set the pixels are appended as ranges, see
+// hpix_append_ring_ranges
+//
+
+static void hpix_disc_append(
         const struct healpix* hpix,
-        double x0, double y0, double z0, double radius, 
+        double x0, double y0, double z0, double cosang, double sinang,
+        int as_ranges,
         lvector* listpix) {
 
-    //double vector0[3];
     int64 nside=hpix->nside;
-    double cosang = cos(radius);
-
-    // this does not alter the storage
-    vector_resize(listpix, 0);
-
-    double dth1 = 1. / (3.0*nside*nside);
-    double dth2 = 2. / (3.0*nside);
+    struct hpix_ring tmpring;
+    const struct hpix_ring* ring=NULL;
 
     double phi0=0.0;
     if ((x0 != 0.) || (y0 != 0.)) {
         // in (-Pi, Pi]
         phi0 = atan2(y0, x0);
     }
-    double cosphi0 = cos(phi0);
     double a = x0*x0 + y0*y0;
 
     //     --- coordinate z of highest and lowest points in the disc ---
-    double rlat0  = asin(z0);    // latitude in RAD of the center
-    double rlat1  = rlat0 + radius;
-    double rlat2  = rlat0 - radius;
+    // these are sin(lat0 +/- radius), where sin(lat0)=z0 and cos(lat0)=sqrt(a);
+    // the disc reaches the north pole when radius >= colatitude, i.e.
+    // cos(radius) <= z0, and similarly for the south pole
+    double rlat = sqrt(a);
     double zmax;
-    if (rlat1 >=  M_PI_2) {
+    if (cosang <= z0) {
         zmax =  1.0;
     } else {
-        zmax = sin(rlat1);
+        zmax = z0*cosang + rlat*sinang;
     }
     int64 irmin = hpix_ring_num(hpix, zmax);
     irmin = i64max(1, irmin-1); // start from a higher point, to be safe
 
     double zmin;
-    if (rlat2 <= -M_PI_2) {
+    if (cosang <= -z0) {
         zmin = -1.;
     } else {
-        zmin = sin(rlat2);
+        zmin = z0*cosang - rlat*sinang;
     }
     int64 irmax = hpix_ring_num(hpix, zmin);
     irmax = i64min(4*nside-1, irmax + 1); // go down to a lower point
 
-    //double z, tmp=0;
-    double tmp=0;
     int64 iz=0;
     for (iz=irmin; iz<= irmax; iz++) {
 
-        double z;
-        if (iz <= nside-1) { // north polar cap
-              z = 1.  - iz*iz*dth1;
-        } else if (iz <= 3*nside) { // tropical band + equat.
-            z = (2*nside-iz) * dth2;
-        } else {
-            tmp = 4*nside-iz;
-            z = - 1. + tmp*tmp*dth1;
-        }
-        double b = cosang - z*z0;
-        double c = 1. - z*z;
-        //double x = (cosang-z*z0)/sqrt((1-z0)*(1+z0));
+        ring = hpix_get_ring(hpix, iz, &tmpring);
+
+        double b = cosang - ring->z*z0;
 
         double dphi;
         if ((x0==0.) && (y0==0.)) {
             dphi=M_PI;
             if (b > 0.) {
-                goto SKIP2; // out of the disc, 2008-03-30
+                continue; // out of the disc, 2008-03-30
             }
-            goto SKIP1;
-        } 
-
-        double cosdphi = b / sqrt(a*c);
-        if (fabs(cosdphi) <= 1.) {
-              dphi = acos(cosdphi); // in [0,Pi]
         } else {
-            if (cosphi0 < cosdphi) {
-                goto SKIP2; // out of the disc
+            double cosdphi = b / sqrt(a*ring->c);
+            if (fabs(cosdphi) <= 1.) {
+                  dphi = acos(cosdphi); // in [0,Pi]
+            } else {
+                // this was cos(phi0) < cosdphi, but |cos(phi0)| <= 1 < |cosdphi|
+                if (cosdphi > 0.) {
+                    continue; // out of the disc
+                }
+                dphi = M_PI; // all the pixels at this elevation are in the disc
             }
-            dphi = M_PI; // all the pixels at this elevation are in the disc
         }
-SKIP1:
-        hpix_in_ring(hpix, iz, phi0, dphi, listpix);
 
-SKIP2:
-        // we have to put something here
-        continue;
+        if (as_ranges) {
+            hpix_append_ring_ranges(ring, phi0, dphi, listpix);
+        } else {
+            hpix_append_ring(ring, phi0, dphi, listpix);
+        }
+    }
+}
+
+void hpix_disc_contains(
+        const struct healpix* hpix,
+        double x0, double y0, double z0, double radius, 
+        lvector* listpix) {
+
+    // this does not alter the storage
+    vector_resize(listpix, 0);
+
+    hpix_disc_append(hpix, x0, y0, z0, cos(radius), sin(radius), 0, listpix);
+}
+
+void hpix_disc_intersect_ranges(
+        const struct healpix* hpix,
+        double x, double y, double z, double radius,
+        lvector* ranges) {
 
+    // as in hpix_disc_intersect
+    double fudge = 1.362*M_PI/(4*hpix->nside);
+
+    radius += fudge;
+    if (radius > M_PI) {
+        radius = M_PI;
     }
 
+    vector_resize(ranges, 0);
+    hpix_disc_append(hpix, x, y, z, cos(radius), sin(radius), 1, ranges);
+}
+
+void hpix_disc_intersect_ranges_batch(
+        const struct healpix* hpix,
+        const CatPoint* points,
+        size_t n,
+        double max_radius,
+        lvector* ranges,
+        size_t* offsets) {
 
+    // as in hpix_disc_intersect
+    double fudge = 1.362*M_PI/(4*hpix->nside);
+    double radius=0, cosang=0, sinang=0, last_radius=0;
+    const CatPoint* pt=NULL;
+    size_t i=0;
+    int have_radius=0;
+
+    vector_resize(ranges, 0);
+    offsets[0] = 0;
+
+    for (i=0; i<n; i++) {
+        pt = &points[i];
+
+        if (pt->radius > max_radius) {
+            offsets[i+1] = vector_size(ranges);
+            continue;
+        }
+
+        if (!have_radius || pt->radius != last_radius) {
+            have_radius = 1;
+            last_radius = pt->radius;
+            radius = pt->radius + fudge;
+            if (radius > M_PI) {
+                radius = M_PI;
+            }
+            cosang = cos(radius);
+            sinang = sin(radius);
+        }
+
+        hpix_disc_append(hpix, pt->x, pt->y, pt->z, cosang, sinang, 1, ranges);
+        offsets[i+1] = vector_size(ranges);
+    }
 }
 
 int64 i64max(int64 v1, int64 v2) {
@@ -178,52 +414,9 @@ void hpix_in_ring(
         double dphi, 
         lvector* plist) {
 
-    int64 nr, ir, ipix1,i;
-    double shift=0.5;
-    int64 nside = hpix->nside;
-
-    if (iz<nside) {
-        // north pole
-        ir = iz;
-        nr = ir*4;
-        ipix1 = 2*ir*(ir-1);        //    lowest pixel number in the ring
-    } else if (iz>(3*nside)) {
-        // south pole
-        ir = 4*nside - iz;
-        nr = ir*4;
-        ipix1 = hpix->npix - 2*ir*(ir+1); // lowest pixel number in the ring
-    } else {
-        // equatorial region
-        ir = iz - nside + 1;           //    within {1, 2*nside + 1}
-        nr = nside*4;
-        if ((ir&1)==0) shift = 0;
-        ipix1 = hpix->ncap + (ir-1)*nr; // lowest pixel number in the ring
-    }
-
-    int64 ipix2 = ipix1 + nr - 1;  //    highest pixel number in the ring
- 
-
-    if (dphi > (M_PI-1e-7)) {
-        for (i=ipix1; i<=ipix2; ++i) {
-            vector_push(plist, i);
-        }
-    } else {
-
-        // M_1_PI is 1/pi
-        int64 ip_lo = (int64)( floor(nr*.5*M_1_PI*(phi0-dphi) - shift) )+1;
-        int64 ip_hi = (int64)( floor(nr*.5*M_1_PI*(phi0+dphi) - shift) );
-        int64 pixnum = ip_lo+ipix1;
-        if (pixnum<ipix1) {
-            pixnum += nr;
-        }
-        for (i=ip_lo; i<=ip_hi; ++i, ++pixnum) {
-            if (pixnum>ipix2) {
-                pixnum -= nr;
-            }
-            vector_push(plist, pixnum);
-        }
-    }
+    struct hpix_ring tmpring;
 
+    hpix_append_ring(hpix_get_ring(hpix, iz, &tmpring), phi0, dphi, plist);
 }
 
 
@@ -251,19 +444,14 @@ int64 hpix_ring_num(const struct healpix* hpix, double z) {
     return iring;
 }
 
-int64 hpix_eq2pix(const struct healpix* hpix,
-                  double ra, double dec,
-                  int *status) {
+//
+// the pixel from z=cos(theta) and phi, both in radians
+//
+
+static inline int64 hpix_zphi2pix(const struct healpix* hpix, double z, double phi) {
     int64 nside=hpix->nside;
     int64 ipix=0;
-    double theta=0, phi=0;
-
-    *status = hpix_radec_degrees_to_thetaphi_radians(ra, dec, &theta, &phi);
-    if (! (*status) ) {
-        goto _hpix_eq2pix_bail;
-    }
 
-    double z = cos(theta);
     double za = fabs(z);
 
     // in [0,4)
@@ -307,11 +495,72 @@ int64 hpix_eq2pix(const struct healpix* hpix,
 
     }
 
+    return ipix;
+}
+
+int64 hpix_eq2pix(const struct healpix* hpix,
+                  double ra, double dec,
+                  int *status) {
+    int64 ipix=0;
+    double theta=0, phi=0;
+
+    *status = hpix_radec_degrees_to_thetaphi_radians(ra, dec, &theta, &phi);
+    if (! (*status) ) {
+        goto _hpix_eq2pix_bail;
+    }
+
+    ipix = hpix_zphi2pix(hpix, cos(theta), phi);
+
 _hpix_eq2pix_bail:
 
     return ipix;
 }
 
+int hpix_check_radec_array(const double* ra, const double* dec, size_t n, size_t* bad) {
+    size_t i=0;
+
+    for (i=0; i<n; i++) {
+        // as in hpix_radec_degrees_to_thetaphi_radians; written so that
+        // NaN fails
+        if (!(ra[i] >= 0.0 && ra[i] <= 360.) || !(dec[i] >= -90. && dec[i] <= 90.)) {
+            *bad = i;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void hpix_eq2pix_xyz_array(const struct healpix* hpix,
+                           const double* ra,
+                           const double* dec,
+                           size_t n,
+                           int64* pixels,
+                           double* x,
+                           double* y,
+                           double* z) {
+    size_t i=0;
+    double theta=0, phi=0, cth=0, sth=0;
+
+    for (i=0; i<n; i++) {
+        // as in hpix_radec_degrees_to_thetaphi_radians
+        phi = ra[i]*D2R;
+        theta = -dec[i]*D2R + M_PI_2;
+
+        cth = cos(theta);
+
+        if (pixels) {
+            pixels[i] = hpix_zphi2pix(hpix, cth, phi);
+        }
+        if (x) {
+            sth = sin(theta);
+            x[i] = sth * cos(phi);
+            y[i] = sth * sin(phi);
+            z[i] = cth;
+        }
+    }
+}
+
 
 int hpix_eq2xyz(double ra, double dec, double* x, double* y, double* z) {
 
@@ -339,13 +588,13 @@ int hpix_radec_degrees_to_thetaphi_radians(double ra, double dec, double* theta,
 
     int status=0;
 
-    if (ra < 0.0 || ra > 360.) {
+    if (!(ra >= 0.0 && ra <= 360.)) {
         char err[128];
         sprintf(err,"ra = %g out of range [0,360]", ra);
         PyErr_SetString(PyExc_ValueError, err);
         goto _hpix_conv_bail;
     }
-    if (dec < -90. || dec > 90.) {
+    if (!(dec >= -90. && dec <= 90.)) {
         char err[128];
         sprintf(err,"dec = %g out of range [-90,90]", dec);
         PyErr_SetString(PyExc_ValueError, err);
@@ -4,14 +4,35 @@
 #include <stdint.h>
 #include "defs.h"
 #include "vector.h"
+#include "catpoint.h"
 
 #define NS_MAX 268435456 // 2^28 : largest nside available
 
+// the largest nside for which the ring table is kept; the table uses
+// 4*nside*sizeof(struct hpix_ring) bytes
+#define HPIX_RING_TABLE_MAX_NSIDE 16384
+
+/*
+   the geometry of a ring, as used by the disc queries
+*/
+struct hpix_ring {
+    double z;      // z of the pixel centers
+    double c;      // 1 - z*z
+    double shift;  // 0.5 if the first pixel center is offset by half a pixel
+    int64 nr;      // number of pixels in the ring
+    int64 ipix1;   // lowest pixel number in the ring
+};
+
 struct healpix {
     int64 nside;
     int64 npix;
     int64 ncap;
     double area;
+
+    // indexed by ring number in {1, 4*nside-1}; NULL if the nside is larger
+    // than HPIX_RING_TABLE_MAX_NSIDE, in which case the rings are computed
+    // as needed
+    struct hpix_ring* rings;
 };
 
 /* number of pixels in the map for the given nside */
@@ -37,6 +58,30 @@ int64 hpix_eq2pix(const struct healpix* hpix,
                   double ra, double dec,
                   int *status);
 
+/*
+   check that all ra are in [0,360] and dec in [-90,90], in degrees.  Returns
+   1 if so, otherwise 0 with *bad set to the index of the first bad point.
+   This does not set a python error
+*/
+int hpix_check_radec_array(const double* ra, const double* dec, size_t n, size_t* bad);
+
+/*
+   the pixel number and x,y,z for arrays of ra,dec in degrees, in one pass.
+   The results are the same as for hpix_eq2pix and hpix_eq2xyz.
+
+   The ra,dec must already have been checked, for example with
+   hpix_check_radec_array.  pixels may be NULL, and x,y,z may all be NULL, if
+   they are not wanted
+*/
+void hpix_eq2pix_xyz_array(const struct healpix* hpix,
+                           const double* ra,
+                           const double* dec,
+                           size_t n,
+                           int64* pixels,
+                           double* x,
+                           double* y,
+                           double* z);
+
 /* fill listpix with list of all pixels with centers in the disc 
 
    Note unlike disc_contains this function is inclusive, including all pixels
@@ -49,6 +94,42 @@ void hpix_disc_intersect(
         const struct healpix* hpix,
         double x, double y, double z, double radius, 
         lvector* listpix);
+
+/*
+   as hpix_disc_intersect, but fill ranges with the pixels as ranges of
+   pixel numbers, held in pairs
+
+       lo = ranges->data[2*i], hi = ranges->data[2*i+1], lo <= hi
+
+   with hi inclusive.  Each range is the part of the disc in one ring, or
+   half of it if it wraps past the end of the ring.  The ranges and the
+   pixels within them are in the same order as the pixels from
+   hpix_disc_intersect
+*/
+void hpix_disc_intersect_ranges(
+        const struct healpix* hpix,
+        double x, double y, double z, double radius,
+        lvector* ranges);
+
+/*
+   the batch version of hpix_disc_intersect_ranges, for n points with radii
+   in radians.  The ranges for all points are put in ranges, those for point
+   i being the pairs in
+
+       ranges->data[offsets[i]] ... ranges->data[offsets[i+1]-1]
+
+   offsets must have n+1 elements.  Points with a radius above max_radius
+   are given no ranges.  The cosine of the radius is only recomputed when the
+   radius changes, so this is fastest for a fixed radius
+*/
+void hpix_disc_intersect_ranges_batch(
+        const struct healpix* hpix,
+        const CatPoint* points,
+        size_t n,
+        double max_radius,
+        lvector* ranges,
+        size_t* offsets);
+
 /*
  Fill listpix with all pixels whose centers are contained within the disc
 
@@ -0,0 +1,641 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "healpix.h"
+#include "pixindex.h"
+#include "kernel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define KERNEL_NEON 1
+#include <arm_neon.h>
+#endif
+
+//
+// allocate the points for the index, with undefined values
+//
+
+static struct soa_points* soa_points_alloc(const struct pixindex* index,
+                                           int single)
+{
+    size_t n=0;
+    struct soa_points* self=NULL;
+
+    self = calloc(1, sizeof(struct soa_points));
+    if (self == NULL) {
+        return NULL;
+    }
+
+    n = index->npoints;
+    self->size = n;
+    if (single) {
+        self->xf = malloc((n > 0 ? n : 1)*sizeof(float));
+        self->yf = malloc((n > 0 ? n : 1)*sizeof(float));
+        self->zf = malloc((n > 0 ? n : 1)*sizeof(float));
+        if (self->xf == NULL || self->yf == NULL || self->zf == NULL) {
+            return soa_points_delete(self);
+        }
+    } else {
+        self->x = malloc((n > 0 ? n : 1)*sizeof(double));
+        self->y = malloc((n > 0 ? n : 1)*sizeof(double));
+        self->z = malloc((n > 0 ? n : 1)*sizeof(double));
+        if (self->x == NULL || self->y == NULL || self->z == NULL) {
+            return soa_points_delete(self);
+        }
+    }
+
+    return self;
+}
+
+//
+// set point j, in the precision of the points
+//
+
+static inline void soa_points_set(struct soa_points* self,
+                                  size_t j,
+                                  double x,
+                                  double y,
+                                  double z)
+{
+    if (self->x) {
+        self->x[j] = x;
+        self->y[j] = y;
+        self->z[j] = z;
+    } else {
+        self->xf[j] = (float) x;
+        self->yf[j] = (float) y;
+        self->zf[j] = (float) z;
+    }
+}
+
+struct soa_points* soa_points_new(const double* ra,
+                                  const double* dec,
+                                  const struct pixindex* index,
+                                  int single)
+{
+    size_t j=0, i=0;
+    double x=0, y=0, z=0;
+    struct soa_points* self=NULL;
+
+    self = soa_points_alloc(index, single);
+    if (self == NULL) {
+        return NULL;
+    }
+
+    for (j=0; j<self->size; j++) {
+        i = (size_t)index->indices[j];
+        hpix_eq2xyz(ra[i], dec[i], &x, &y, &z);
+        soa_points_set(self, j, x, y, z);
+    }
+
+    return self;
+}
+
+struct soa_points* soa_points_gather(const double* x,
+                                     const double* y,
+                                     const double* z,
+                                     const struct pixindex* index,
+                                     int single)
+{
+    size_t j=0, i=0;
+    struct soa_points* self=NULL;
+
+    self = soa_points_alloc(index, single);
+    if (self == NULL) {
+        return NULL;
+    }
+
+    for (j=0; j<self->size; j++) {
+        i = (size_t)index->indices[j];
+        soa_points_set(self, j, x[i], y[i], z[i]);
+    }
+
+    return self;
+}
+
+struct soa_points* soa_points_delete(struct soa_points* self)
+{
+    if (self) {
+        free(self->x);
+        free(self->y);
+        free(self->z);
+        free(self->xf);
+        free(self->yf);
+        free(self->zf);
+        free(self);
+    }
+    return NULL;
+}
+
+size_t soa_points_nbytes(const struct soa_points* self)
+{
+    if (self == NULL) {
+        return 0;
+    }
+    if (self->x == NULL) {
+        return sizeof(struct soa_points) + 3*self->size*sizeof(float);
+    }
+    return sizeof(struct soa_points) + 3*self->size*sizeof(double);
+}
+
+static size_t kernel_scalar(const double* x,
+                            const double* y,
+                            const double* z,
+                            size_t n,
+                            double cx,
+                            double cy,
+                            double cz,
+                            double cos_radius,
+                            int32_t* ind,
+                            double* cosdist)
+{
+    size_t k=0, nacc=0;
+    double cos_angle=0;
+
+    for (k=0; k<n; k++) {
+        cos_angle = x[k]*cx + y[k]*cy + z[k]*cz;
+        if (cos_angle > cos_radius) {
+            ind[nacc] = (int32_t)k;
+            cosdist[nacc] = cos_angle;
+            nacc++;
+        }
+    }
+
+    return nacc;
+}
+
+static size_t screen_scalar(const float* x,
+                            const float* y,
+                            const float* z,
+                            size_t n,
+                            float cx,
+                            float cy,
+                            float cz,
+                            float max_dist2,
+                            int32_t* ind)
+{
+    size_t k=0, npass=0;
+    float dx=0, dy=0, dz=0;
+
+    for (k=0; k<n; k++) {
+        dx = x[k] - cx;
+        dy = y[k] - cy;
+        dz = z[k] - cz;
+        if (dx*dx + dy*dy + dz*dz <= max_dist2) {
+            ind[npass] = (int32_t)k;
+            npass++;
+        }
+    }
+
+    return npass;
+}
+
+#if defined(KERNEL_X86) || defined(KERNEL_NEON)
+
+//
+// test the candidates from k to n left over by a vector kernel, which has
+// already accepted nacc
+//
+
+static size_t kernel_tail(const double* x,
+                          const double* y,
+                          const double* z,
+                          size_t n,
+                          size_t k,
+                          double cx,
+                          double cy,
+                          double cz,
+                          double cos_radius,
+                          int32_t* ind,
+                          double* cosdist,
+                          size_t nacc)
+{
+    size_t i=0, ntail=0;
+
+    ntail = kernel_scalar(&x[k], &y[k], &z[k], n-k,
+                          cx, cy, cz, cos_radius,
+                          &ind[nacc], &cosdist[nacc]);
+
+    for (i=nacc; i<nacc+ntail; i++) {
+        ind[i] += (int32_t)k;
+    }
+
+    return nacc + ntail;
+}
+
+//
+// screen the candidates from k to n left over by a vector screen, which has
+// already passed npass
+//
+
+static size_t screen_tail(const float* x,
+                          const float* y,
+                          const float* z,
+                          size_t n,
+                          size_t k,
+                          float cx,
+                          float cy,
+                          float cz,
+                          float max_dist2,
+                          int32_t* ind,
+                          size_t npass)
+{
+    size_t i=0, ntail=0;
+
+    ntail = screen_scalar(&x[k], &y[k], &z[k], n-k,
+                          cx, cy, cz, max_dist2, &ind[npass]);
+
+    for (i=npass; i<npass+ntail; i++) {
+        ind[i] += (int32_t)k;
+    }
+
+    return npass + ntail;
+}
+#endif
+
+#ifdef KERNEL_X86
+
+__attribute__((target("avx2")))
+static size_t kernel_avx2(const double* x,
+                          const double* y,
+                          const double* z,
+                          size_t n,
+                          double cx,
+                          double cy,
+                          double cz,
+                          double cos_radius,
+                          int32_t* ind,
+                          double* cosdist)
+{
+    size_t k=0, nacc=0;
+    int mask=0, bit=0;
+    double tmp[4];
+
+    __m256d vcx = _mm256_set1_pd(cx);
+    __m256d vcy = _mm256_set1_pd(cy);
+    __m256d vcz = _mm256_set1_pd(cz);
+    __m256d vcr = _mm256_set1_pd(cos_radius);
+    __m256d d;
+
+    for (k=0; k+4 <= n; k+=4) {
+        d = _mm256_add_pd(
+                _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(&x[k]), vcx),
+                              _mm256_mul_pd(_mm256_loadu_pd(&y[k]), vcy)),
+                _mm256_mul_pd(_mm256_loadu_pd(&z[k]), vcz));
+
+        mask = _mm256_movemask_pd(_mm256_cmp_pd(d, vcr, _CMP_GT_OQ));
+        if (mask) {
+            _mm256_storeu_pd(tmp, d);
+            while (mask) {
+                bit = __builtin_ctz(mask);
+                ind[nacc] = (int32_t)(k + bit);
+                cosdist[nacc] = tmp[bit];
+                nacc++;
+                mask &= mask-1;
+            }
+        }
+    }
+
+    // the tail is a sibling call, before which the compiler does not clear
+    // the upper halves of the vector registers; left dirty they slow the
+    // sse code that runs next, such as the trig in libm, several times over
+    _mm256_zeroupper();
+
+    return kernel_tail(x, y, z, n, k, cx, cy, cz, cos_radius,
+                       ind, cosdist, nacc);
+}
+
+__attribute__((target("avx512f")))
+static size_t kernel_avx512(const double* x,
+                            const double* y,
+                            const double* z,
+                            size_t n,
+                            double cx,
+                            double cy,
+                            double cz,
+                            double cos_radius,
+                            int32_t* ind,
+                            double* cosdist)
+{
+    size_t k=0, nacc=0;
+    __mmask8 mask=0;
+
+    __m512d vcx = _mm512_set1_pd(cx);
+    __m512d vcy = _mm512_set1_pd(cy);
+    __m512d vcz = _mm512_set1_pd(cz);
+    __m512d vcr = _mm512_set1_pd(cos_radius);
+    __m512i iota = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+                                    7, 6, 5, 4, 3, 2, 1, 0);
+    __m512d d;
+
+    for (k=0; k+8 <= n; k+=8) {
+        d = _mm512_add_pd(
+                _mm512_add_pd(_mm512_mul_pd(_mm512_loadu_pd(&x[k]), vcx),
+                              _mm512_mul_pd(_mm512_loadu_pd(&y[k]), vcy)),
+                _mm512_mul_pd(_mm512_loadu_pd(&z[k]), vcz));
+
+        mask = _mm512_cmp_pd_mask(d, vcr, _CMP_GT_OQ);
+        if (mask) {
+            _mm512_mask_compressstoreu_pd(&cosdist[nacc], mask, d);
+            _mm512_mask_compressstoreu_epi32(
+                &ind[nacc],
+                (__mmask16) mask,
+                _mm512_add_epi32(_mm512_set1_epi32((int)k), iota)
+            );
+            nacc += __builtin_popcount(mask);
+        }
+    }
+
+    // see kernel_avx2
+    _mm256_zeroupper();
+
+    return kernel_tail(x, y, z, n, k, cx, cy, cz, cos_radius,
+                       ind, cosdist, nacc);
+}
+
+__attribute__((target("avx2")))
+static size_t screen_avx2(const float* x,
+                          const float* y,
+                          const float* z,
+                          size_t n,
+                          float cx,
+                          float cy,
+                          float cz,
+                          float max_dist2,
+                          int32_t* ind)
+{
+    size_t k=0, npass=0;
+    int mask=0;
+
+    __m256 vcx = _mm256_set1_ps(cx);
+    __m256 vcy = _mm256_set1_ps(cy);
+    __m256 vcz = _mm256_set1_ps(cz);
+    __m256 vmax = _mm256_set1_ps(max_dist2);
+    __m256 dx, dy, dz, d;
+
+    for (k=0; k+8 <= n; k+=8) {
+        dx = _mm256_sub_ps(_mm256_loadu_ps(&x[k]), vcx);
+        dy = _mm256_sub_ps(_mm256_loadu_ps(&y[k]), vcy);
+        dz = _mm256_sub_ps(_mm256_loadu_ps(&z[k]), vcz);
+        d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx),
+                                        _mm256_mul_ps(dy, dy)),
+                          _mm256_mul_ps(dz, dz));
+
+        mask = _mm256_movemask_ps(_mm256_cmp_ps(d, vmax, _CMP_LE_OQ));
+        while (mask) {
+            ind[npass] = (int32_t)(k + __builtin_ctz(mask));
+            npass++;
+            mask &= mask-1;
+        }
+    }
+
+    return screen_tail(x, y, z, n, k, cx, cy, cz, max_dist2, ind, npass);
+}
+
+__attribute__((target("avx512f")))
+static size_t screen_avx512(const float* x,
+                            const float* y,
+                            const float* z,
+                            size_t n,
+                            float cx,
+                            float cy,
+                            float cz,
+                            float max_dist2,
+                            int32_t* ind)
+{
+    size_t k=0, npass=0;
+    __mmask16 mask=0;
+
+    __m512 vcx = _mm512_set1_ps(cx);
+    __m512 vcy = _mm512_set1_ps(cy);
+    __m512 vcz = _mm512_set1_ps(cz);
+    __m512 vmax = _mm512_set1_ps(max_dist2);
+    __m512i iota = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+                                    7, 6, 5, 4, 3, 2, 1, 0);
+    __m512 dx, dy, dz, d;
+
+    for (k=0; k+16 <= n; k+=16) {
+        dx = _mm512_sub_ps(_mm512_loadu_ps(&x[k]), vcx);
+        dy = _mm512_sub_ps(_mm512_loadu_ps(&y[k]), vcy);
+        dz = _mm512_sub_ps(_mm512_loadu_ps(&z[k]), vcz);
+        d = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx),
+                                        _mm512_mul_ps(dy, dy)),
+                          _mm512_mul_ps(dz, dz));
+
+        mask = _mm512_cmp_ps_mask(d, vmax, _CMP_LE_OQ);
+        if (mask) {
+            _mm512_mask_compressstoreu_epi32(
+                &ind[npass],
+                mask,
+                _mm512_add_epi32(_mm512_set1_epi32((int)k), iota)
+            );
+            npass += __builtin_popcount(mask);
+        }
+    }
+
+    return screen_tail(x, y, z, n, k, cx, cy, cz, max_dist2, ind, npass);
+}
+
+#endif
+
+#ifdef KERNEL_NEON
+
+static size_t kernel_neon(const double* x,
+                          const double* y,
+                          const double* z,
+                          size_t n,
+                          double cx,
+                          double cy,
+                          double cz,
+                          double cos_radius,
+                          int32_t* ind,
+                          double* cosdist)
+{
+    size_t k=0, nacc=0;
+
+    float64x2_t vcx = vdupq_n_f64(cx);
+    float64x2_t vcy = vdupq_n_f64(cy);
+    float64x2_t vcz = vdupq_n_f64(cz);
+    float64x2_t vcr = vdupq_n_f64(cos_radius);
+    float64x2_t d;
+    uint64x2_t mask;
+
+    for (k=0; k+2 <= n; k+=2) {
+        d = vaddq_f64(
+                vaddq_f64(vmulq_f64(vld1q_f64(&x[k]), vcx),
+                          vmulq_f64(vld1q_f64(&y[k]), vcy)),
+                vmulq_f64(vld1q_f64(&z[k]), vcz));
+
+        mask = vcgtq_f64(d, vcr);
+        if (vgetq_lane_u64(mask, 0)) {
+            ind[nacc] = (int32_t)k;
+            cosdist[nacc] = vgetq_lane_f64(d, 0);
+            nacc++;
+        }
+        if (vgetq_lane_u64(mask, 1)) {
+            ind[nacc] = (int32_t)(k+1);
+            cosdist[nacc] = vgetq_lane_f64(d, 1);
+            nacc++;
+        }
+    }
+
+    return kernel_tail(x, y, z, n, k, cx, cy, cz, cos_radius,
+                       ind, cosdist, nacc);
+}
+
+static size_t screen_neon(const float* x,
+                          const float* y,
+                          const float* z,
+                          size_t n,
+                          float cx,
+                          float cy,
+                          float cz,
+                          float max_dist2,
+                          int32_t* ind)
+{
+    size_t k=0, npass=0;
+    uint32_t lanes[4];
+    int i=0;
+
+    float32x4_t vcx = vdupq_n_f32(cx);
+    float32x4_t vcy = vdupq_n_f32(cy);
+    float32x4_t vcz = vdupq_n_f32(cz);
+    float32x4_t vmax = vdupq_n_f32(max_dist2);
+    float32x4_t dx, dy, dz, d;
+
+    for (k=0; k+4 <= n; k+=4) {
+        dx = vsubq_f32(vld1q_f32(&x[k]), vcx);
+        dy = vsubq_f32(vld1q_f32(&y[k]), vcy);
+        dz = vsubq_f32(vld1q_f32(&z[k]), vcz);
+        d = vaddq_f32(vaddq_f32(vmulq_f32(dx, dx), vmulq_f32(dy, dy)),
+                      vmulq_f32(dz, dz));
+
+        vst1q_u32(lanes, vcleq_f32(d, vmax));
+        for (i=0; i<4; i++) {
+            if (lanes[i]) {
+                ind[npass] = (int32_t)(k + i);
+                npass++;
+            }
+        }
+    }
+
+    return screen_tail(x, y, z, n, k, cx, cy, cz, max_dist2, ind, npass);
+}
+
+#endif
+
+struct kernel_info {
+    const char* name;
+    candidate_kernel kernel;
+    screen_kernel screen;
+};
+
+// in order of preference
+static const struct kernel_info kernels[] = {
+#ifdef KERNEL_X86
+    {"avx512", kernel_avx512, screen_avx512},
+    {"avx2", kernel_avx2, screen_avx2},
+#endif
+#ifdef KERNEL_NEON
+    {"neon", kernel_neon, screen_neon},
+#endif
+    {"scalar", kernel_scalar, screen_scalar},
+};
+
+#define NKERNELS (sizeof(kernels)/sizeof(kernels[0]))
+
+static const struct kernel_info* active_kernel=NULL;
+
+static const struct kernel_info* kernel_find(const char* name)
+{
+    size_t i=0;
+
+    for (i=0; i<NKERNELS; i++) {
+        if (strcmp(kernels[i].name, name) == 0) {
+            return &kernels[i];
+        }
+    }
+    return NULL;
+}
+
+static int kernel_info_supported(const struct kernel_info* info)
+{
+#ifdef KERNEL_X86
+    __builtin_cpu_init();
+    if (info->kernel == kernel_avx512) {
+        return __builtin_cpu_supports("avx512f");
+    }
+    if (info->kernel == kernel_avx2) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return 1;
+}
+
+int kernel_supported(const char* name)
+{
+    const struct kernel_info* info = kernel_find(name);
+
+    return info != NULL && kernel_info_supported(info);
+}
+
+int kernel_set(const char* name)
+{
+    const struct kernel_info* info = kernel_find(name);
+
+    if (info == NULL || !kernel_info_supported(info)) {
+        return 0;
+    }
+    active_kernel = info;
+    return 1;
+}
+
+//
+// choose the kernel from the environment, or the best supported
+//
+
+static void kernel_init(void)
+{
+    size_t i=0;
+    const char* name=getenv("SMATCH_KERNEL");
+
+    if (name != NULL && kernel_set(name)) {
+        return;
+    }
+
+    for (i=0; i<NKERNELS; i++) {
+        if (kernel_info_supported(&kernels[i])) {
+            active_kernel = &kernels[i];
+            return;
+        }
+    }
+}
+
+candidate_kernel kernel_get(void)
+{
+    if (active_kernel == NULL) {
+        kernel_init();
+    }
+    return active_kernel->kernel;
+}
+
+const char* kernel_name(void)
+{
+    if (active_kernel == NULL) {
+        kernel_init();
+    }
+    return active_kernel->name;
+}
+
+screen_kernel kernel_get_screen(void)
+{
+    if (active_kernel == NULL) {
+        kernel_init();
+    }
+    return active_kernel->screen;
+}
@@ -0,0 +1,120 @@
+/*
+   The candidate test kernels.
+
+   The indexed points are held as separate x, y and z arrays in index order,
+   so the candidates in a pixel are contiguous.  A kernel computes the dot
+   product of a block of candidates with the catalog point and returns those
+   closer than the radius.
+
+   The dot products are computed as x*cx + y*cy + z*cz without fused
+   multiply-add, so all kernels give exactly the same results.
+
+   The kernel is chosen at run time from those supported by the cpu; this can
+   be overridden with the SMATCH_KERNEL environment variable or kernel_set
+
+   In single precision mode the points are held as float, halving the memory
+   and bandwidth.  A screen kernel then passes the candidates within the
+   squared chord distance of the catalog point, computed in float, and
+   the survivors are recomputed in double from the ra,dec.  The screen uses
+   a margin of KERNEL_SCREEN_MARGIN on the chord, well above the float
+   rounding error, so it passes every candidate the double kernels would
+   accept, and the results are the same as in double precision.
+*/
+#ifndef _KERNEL_H
+#define _KERNEL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "pixindex.h"
+
+// the largest number of candidates sent to a kernel at once
+#define KERNEL_BLOCK 256
+
+// the margin on the chord distance (radians) for the single precision
+// screen.  The float rounding error in the chord is below 5e-7
+#define KERNEL_SCREEN_MARGIN 1.0e-6
+
+/*
+   the points in index order: element j is the point index->indices[j].
+   In single precision x, y and z are NULL and xf, yf, zf are set instead
+*/
+struct soa_points {
+    size_t size;
+    double* x;
+    double* y;
+    double* z;
+
+    float* xf;
+    float* yf;
+    float* zf;
+};
+
+// make the points, in single precision if single is set; the ra,dec should
+// already have been checked.  returns NULL on failure to allocate
+struct soa_points* soa_points_new(const double* ra,
+                                  const double* dec,
+                                  const struct pixindex* index,
+                                  int single);
+
+// make the points from x,y,z in their original order, in single precision
+// if single is set; returns NULL on failure to allocate
+struct soa_points* soa_points_gather(const double* x,
+                                     const double* y,
+                                     const double* z,
+                                     const struct pixindex* index,
+                                     int single);
+
+// usage:  points=soa_points_delete(points);
+struct soa_points* soa_points_delete(struct soa_points* self);
+
+// the memory used by the points in bytes
+size_t soa_points_nbytes(const struct soa_points* self);
+
+/*
+   test the n <= KERNEL_BLOCK candidates, writing the position within the
+   block and the cosine of the distance of those with cosdist > cos_radius.
+   returns the number accepted
+*/
+typedef size_t (*candidate_kernel)(const double* x,
+                                   const double* y,
+                                   const double* z,
+                                   size_t n,
+                                   double cx,
+                                   double cy,
+                                   double cz,
+                                   double cos_radius,
+                                   int32_t* ind,
+                                   double* cosdist);
+
+/*
+   screen the n <= KERNEL_BLOCK single precision candidates, writing the
+   position within the block of those with squared chord distance
+   (x-cx)^2 + (y-cy)^2 + (z-cz)^2 <= max_dist2.  returns the number passed
+*/
+typedef size_t (*screen_kernel)(const float* x,
+                                const float* y,
+                                const float* z,
+                                size_t n,
+                                float cx,
+                                float cy,
+                                float cz,
+                                float max_dist2,
+                                int32_t* ind);
+
+// the kernel in use, chosen on first call
+candidate_kernel kernel_get(void);
+
+// the screen kernel matching the kernel in use
+screen_kernel kernel_get_screen(void);
+
+// the name of the kernel in use
+const char* kernel_name(void);
+
+// use the named kernel; returns 0 if it is not known or not supported by
+// this cpu, in which case the kernel is not changed
+int kernel_set(const char* name);
+
+// returns 1 if the named kernel is supported by this cpu
+int kernel_supported(const char* name);
+
+#endif
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "match.h"
+#include "matchfile.h"
+
+// the numpy byte order character for this machine
+static char matchfile_byteorder(void)
+{
+    uint16_t one=1;
+    return (*(const char*)&one == 1) ? '<' : '>';
+}
+
+int matchfile_write_header(FILE* fobj, int64_t nmatches)
+{
+    char header[MATCHFILE_HEADER_SIZE];
+    char* dtype=NULL;
+    uint32_t version=MATCHFILE_VERSION;
+    uint32_t record_size=sizeof(Match);
+    char order=0;
+
+    memset(header, 0, sizeof(header));
+
+    memcpy(&header[0], MATCHFILE_MAGIC, MATCHFILE_MAGIC_SIZE);
+    memcpy(&header[8], &version, sizeof(version));
+    memcpy(&header[12], &record_size, sizeof(record_size));
+    memcpy(&header[16], &nmatches, sizeof(nmatches));
+
+    order = matchfile_byteorder();
+    dtype = &header[MATCHFILE_HEADER_SIZE-MATCHFILE_DTYPE_SIZE];
+    snprintf(dtype, MATCHFILE_DTYPE_SIZE, "%ci8,%ci8,%cf8", order, order, order);
+
+    return fwrite(header, sizeof(header), 1, fobj) == 1;
+}
+
+int matchfile_write_matches(FILE* fobj, const Match* matches, size_t n)
+{
+    if (n == 0) {
+        return 1;
+    }
+    return fwrite(matches, sizeof(Match), n, fobj) == n;
+}
+
+int matchfile_set_nmatches(FILE* fobj, int64_t nmatches)
+{
+    if (fseek(fobj, 16, SEEK_SET) != 0) {
+        return 0;
+    }
+    if (fwrite(&nmatches, sizeof(nmatches), 1, fobj) != 1) {
+        return 0;
+    }
+    return fseek(fobj, 0, SEEK_END) == 0;
+}
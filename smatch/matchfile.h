@@ -0,0 +1,49 @@
+/*
+   The binary match file format
+
+   A fixed 64 byte header followed by the packed Match records
+
+       char     magic[8]        MATCHFILE_MAGIC
+       uint32   version         MATCHFILE_VERSION
+       uint32   record_size     sizeof(Match), 24 bytes
+       int64    nmatches        number of records, -1 while being written
+       char     dtype[40]       numpy type codes of the fields, nul padded,
+                                e.g. "<i8,<i8,<f8"
+
+   The numbers in the header and the records are in the byte order of the
+   machine that wrote the file, which is given by the first character of the
+   dtype.
+*/
+#ifndef _MATCHFILE_H
+#define _MATCHFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "match.h"
+
+#define MATCHFILE_MAGIC "SMATCHBN"
+#define MATCHFILE_MAGIC_SIZE 8
+#define MATCHFILE_VERSION 1
+#define MATCHFILE_DTYPE_SIZE 40
+#define MATCHFILE_HEADER_SIZE 64
+
+// size of the stdio buffer used when writing match files
+#define MATCHFILE_BUFSIZE (1<<20)
+
+/*
+   write the header with the given count; returns 1 on success
+*/
+int matchfile_write_header(FILE* fobj, int64_t nmatches);
+
+/*
+   write the records; returns 1 on success
+*/
+int matchfile_write_matches(FILE* fobj, const Match* matches, size_t n);
+
+/*
+   rewrite the count in the header, once all matches are written, and
+   move back to the end of the file.  returns 1 on success
+*/
+int matchfile_set_nmatches(FILE* fobj, int64_t nmatches);
+
+#endif
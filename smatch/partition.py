@@ -0,0 +1,722 @@
+"""
+Matching of catalogs too large to hold in memory, by splitting the sky into
+coarse healpix partitions
+"""
+import os
+import tempfile
+import numpy as np
+from . import _smatch
+from .smatch import (
+    NSIDE_DEFAULT,
+    Catalog,
+    choose_nside,
+    match_dtype,
+    read_matches,
+    _is_auto,
+    _write_matchfile_header,
+)
+
+# the nside of the partitions; 768 pixels of about 7.3 degrees
+PARTITION_NSIDE_DEFAULT=8
+
+# the number of rows read at a time when partitioning
+PARTITION_CHUNK_SIZE=1000000
+
+# the area of the sky in square degrees
+SKY_AREA=4*np.pi*(180/np.pi)**2
+
+# the partitions in a shard plan
+shard_plan_dtype=[
+    ('partition','i8'),
+    ('shard','i8'),
+    ('n1','i8'),
+    ('n2','i8'),
+    ('npairs','f8'),
+]
+
+
+def match_partitioned(ra1, dec1, radius1, ra2, dec2,
+                      nside=NSIDE_DEFAULT, maxmatch=1, file=None,
+                      partition_nside=PARTITION_NSIDE_DEFAULT,
+                      chunk_size=PARTITION_CHUNK_SIZE, nthreads=1,
+                      multires=False, float32=False, tmpdir=None):
+    """
+    match points on the sphere, one sky partition at a time, so the memory
+    needed is set by the densest partition rather than the whole catalogs.
+
+    The sky is split into the pixels of a coarse healpix layout.  Each point
+    in the first set belongs to the partition holding it, and each point in
+    the second set is also put in every partition within the largest
+    radius1 of it, the halo.  The partitions are matched in turn, so each
+    match is found once, in the partition of the first point.
+
+    The inputs can be arrays, np.memmap, or the names of .npy files, which
+    are memory mapped, so only the rows of one partition are in memory at a
+    time.  The lists of rows in each partition are kept in temporary files.
+
+    parameters
+    ----------
+
+    ra1: array or string
+        right ascension array 1 in degrees, or a .npy file holding it
+    dec1: array or string
+        declination array 1 in degrees, same size as ra1
+    radius1: array, scalar or string
+        search radius around each point in degrees; can be a scalar
+        or same size as ra1/dec1.
+    ra2: array or string
+        right ascension array 2 in degrees
+    dec2: array or string
+        declination array 2 same size as ra2 in degrees
+
+    nside: int or 'auto', optional
+        nside for the healpix layout used for matching.  If 'auto', choose
+        the nside for each partition; see choose_nside.  Default 4096
+    maxmatch: int, optional
+        maximum number of matches to allow per point, as for match.
+        Default 1
+    file: string, optional
+        File in which to write matches, in the binary format; see
+        read_matches.  The matches are written one partition at a time, so
+        they are grouped by partition rather than ordered by i1
+    partition_nside: int, optional
+        nside of the partitions.  Default 8
+    chunk_size: int, optional
+        The number of rows read at a time when partitioning.  Default 1000000
+    nthreads: int, optional
+        Number of threads to use for each partition.  Default 1
+    multires: bool, optional
+        If True, search entries with large radii at a coarser resolution;
+        see Catalog.  Default False
+    float32: bool, optional
+        If True, hold the indexed points in single precision, with the same
+        results; see Catalog.  Default False
+    tmpdir: string, optional
+        Directory for the temporary files.  Default is the system default
+
+    returns
+    -------
+    matchcat: structured array
+        The same matches as from match, ordered by i1, and closest first
+        for each i1 when maxmatch > 0.  If a file is sent, None is returned
+    """
+
+    return _match_partitioned(
+        ra1, dec1, radius1, ra2, dec2, False,
+        nside, maxmatch, file, partition_nside, chunk_size, nthreads,
+        multires, float32, tmpdir,
+    )
+
+def match_self_partitioned(ra, dec, radius,
+                           nside=NSIDE_DEFAULT, maxmatch=1, file=None,
+                           partition_nside=PARTITION_NSIDE_DEFAULT,
+                           chunk_size=PARTITION_CHUNK_SIZE, nthreads=1,
+                           multires=False, float32=False, tmpdir=None):
+    """
+    match points on the sphere to themselves, ignoring exact matches, one sky
+    partition at a time; see match_partitioned
+
+    parameters
+    ----------
+
+    ra: array or string
+        right ascension array in degrees, or a .npy file holding it
+    dec: array or string
+        declination array in degrees, same size as ra
+    radius: array, scalar or string
+        search radius around each point in degrees; can be a scalar
+        or same size as ra/dec.
+
+    The other parameters are as for match_partitioned
+
+    returns
+    -------
+    matchcat: structured array
+        The same matches as from match_self, ordered as for
+        match_partitioned.  If a file is sent, None is returned
+    """
+
+    return _match_partitioned(
+        ra, dec, radius, ra, dec, True,
+        nside, maxmatch, file, partition_nside, chunk_size, nthreads,
+        multires, float32, tmpdir,
+    )
+
+class ShardPlan(object):
+    """
+    A plan for spreading one match over several shards, for example on
+    different nodes of a cluster.  The shards are sets of the partitions
+    used by match_partitioned, balanced by the estimated number of pairs.
+    Each shard is run on its own with match_shard or match_self_shard,
+    writing a partial match file, and the files are combined with
+    merge_shards.
+
+    Create a plan with shard_plan or shard_plan_self, save it with write and
+    read it back with read_shard_plan
+
+    attributes
+    ----------
+    partitions: structured array
+        An entry for each partition holding points of both sets, with fields
+            partition: the pixel number at partition_nside
+            shard: the shard it is assigned to
+            n1: the number of points from the first set
+            n2: the number of points from the second set, with the halo
+            npairs: the estimated number of pairs within the radii
+    partition_nside: int
+        The nside of the partitions
+    halo: float
+        The halo around each partition, the largest radius, in degrees
+    nshards: int
+        The number of shards
+    """
+    def __init__(self, partitions, partition_nside, halo, nshards):
+        self.partitions = partitions
+        self.partition_nside = int(partition_nside)
+        self.halo = float(halo)
+        self.nshards = int(nshards)
+
+    def get_shard_partitions(self, shard):
+        """
+        get the partitions assigned to the shard
+        """
+        shard = self._check_shard(shard)
+        w, = np.where(self.partitions['shard'] == shard)
+        return self.partitions['partition'][w]
+
+    def get_loads(self):
+        """
+        get the estimated number of pairs in each shard
+        """
+        return np.bincount(
+            self.partitions['shard'],
+            weights=self.partitions['npairs'],
+            minlength=self.nshards,
+        )
+
+    def write(self, filename):
+        """
+        write the plan to a numpy .npz file
+        """
+        with open(filename, 'wb') as fobj:
+            np.savez(
+                fobj,
+                partitions=self.partitions,
+                partition_nside=self.partition_nside,
+                halo=self.halo,
+                nshards=self.nshards,
+            )
+
+    def _check_shard(self, shard):
+        shard = int(shard)
+        if shard < 0 or shard >= self.nshards:
+            raise ValueError("shard should be in [0, %d), got %d" %
+                             (self.nshards, shard))
+        return shard
+
+    def _get_keep(self, shard):
+        """
+        a mask over all the partitions, True for those in the shard
+        """
+        keep = np.zeros(12*self.partition_nside**2, dtype=bool)
+        keep[self.get_shard_partitions(shard)] = True
+        return keep
+
+    def __repr__(self):
+        loads = self.get_loads()
+        lines = [
+            'smatch shard plan',
+            '    nshards:             %d' % self.nshards,
+            '    partition nside:     %d' % self.partition_nside,
+            '    npartitions:         %d' % self.partitions.size,
+            '    halo (deg):          %g' % self.halo,
+            '    max/mean load:       %g' % (
+                loads.max()/loads.mean() if loads.sum() > 0 else 1.0
+            ),
+        ]
+        return '\n'.join(lines)
+
+def shard_plan(ra1, dec1, radius1, ra2, dec2, nshards,
+               partition_nside=PARTITION_NSIDE_DEFAULT,
+               chunk_size=PARTITION_CHUNK_SIZE):
+    """
+    make a plan for spreading a match over shards; see ShardPlan.
+
+    The pairs in each partition are estimated from the number of points of
+    the second set in it and its halo, spread over the area, and the sum of
+    the disc areas of the first set.  The partitions are assigned to shards
+    largest first, each to the shard with the least work so far, where each
+    point of the first set counts as one pair for the cost of its search
+
+    parameters
+    ----------
+    ra1, dec1, radius1, ra2, dec2:
+        The points, as for match_partitioned.  The same points must be sent
+        to match_shard
+    nshards: int
+        The number of shards
+    partition_nside: int, optional
+        nside of the partitions.  Default 8
+    chunk_size: int, optional
+        The number of rows read at a time.  Default 1000000
+
+    returns
+    -------
+    plan: ShardPlan
+    """
+
+    nshards = int(nshards)
+    if nshards < 1:
+        raise ValueError("nshards should be >= 1, got %d" % nshards)
+
+    ra1, dec1 = _open_columns(ra1, dec1)
+    ra2, dec2 = _open_columns(ra2, dec2)
+    radius1 = _open_radius(radius1, ra1.size)
+    chunk_size = _check_chunk_size(chunk_size)
+
+    halo = _max_radius(radius1, chunk_size)
+
+    n1 = _partition_counts(ra1, dec1, None, partition_nside, chunk_size)
+    n2 = _partition_counts(ra2, dec2, halo, partition_nside, chunk_size)
+
+    if radius1.size == 1:
+        sumr2 = n1*float(radius1[0])**2
+    else:
+        sumr2 = _partition_counts(
+            ra1, dec1, None, partition_nside, chunk_size, radii=radius1,
+        )
+
+    npart = n1.size
+    side = np.sqrt(SKY_AREA/npart)
+    halo_area = min((side + 2*halo)**2, SKY_AREA)
+
+    w, = np.where((n1 > 0) & (n2 > 0))
+    partitions = np.zeros(w.size, dtype=shard_plan_dtype)
+    partitions['partition'] = w
+    partitions['n1'] = n1[w]
+    partitions['n2'] = n2[w]
+    partitions['npairs'] = n2[w]*np.pi*sumr2[w]/halo_area
+
+    cost = partitions['npairs'] + partitions['n1']
+    loads = np.zeros(nshards)
+    for i in np.argsort(-cost, kind='stable'):
+        shard = np.argmin(loads)
+        partitions['shard'][i] = shard
+        loads[shard] += cost[i]
+
+    return ShardPlan(partitions, partition_nside, halo, nshards)
+
+def shard_plan_self(ra, dec, radius, nshards,
+                    partition_nside=PARTITION_NSIDE_DEFAULT,
+                    chunk_size=PARTITION_CHUNK_SIZE):
+    """
+    make a plan for spreading a self match over shards; see shard_plan
+    """
+    return shard_plan(ra, dec, radius, ra, dec, nshards,
+                      partition_nside=partition_nside,
+                      chunk_size=chunk_size)
+
+def read_shard_plan(filename):
+    """
+    read a plan written with ShardPlan.write
+    """
+    with np.load(filename) as data:
+        return ShardPlan(
+            data['partitions'],
+            data['partition_nside'],
+            data['halo'],
+            data['nshards'],
+        )
+
+def match_shard(plan, shard, ra1, dec1, radius1, ra2, dec2,
+                nside=NSIDE_DEFAULT, maxmatch=1, file=None,
+                chunk_size=PARTITION_CHUNK_SIZE, nthreads=1,
+                multires=False, float32=False, tmpdir=None):
+    """
+    run one shard of a plan made with shard_plan, matching the points in
+    its partitions
+
+    parameters
+    ----------
+    plan: ShardPlan
+        The plan
+    shard: int
+        The shard to run, in [0, plan.nshards)
+    ra1, dec1, radius1, ra2, dec2:
+        The points sent to shard_plan
+
+    The other parameters are as for match_partitioned.  The same maxmatch
+    should be used for all shards
+
+    returns
+    -------
+    matchcat: structured array
+        The matches for the points of the first set in the shard, with i1
+        and i2 the indices in the full sets.  If a file is sent, None is
+        returned
+    """
+
+    return _match_partitioned(
+        ra1, dec1, radius1, ra2, dec2, False,
+        nside, maxmatch, file, plan.partition_nside, chunk_size, nthreads,
+        multires, float32, tmpdir,
+        halo=plan.halo, keep=plan._get_keep(shard),
+    )
+
+def match_self_shard(plan, shard, ra, dec, radius,
+                     nside=NSIDE_DEFAULT, maxmatch=1, file=None,
+                     chunk_size=PARTITION_CHUNK_SIZE, nthreads=1,
+                     multires=False, float32=False, tmpdir=None):
+    """
+    run one shard of a plan made with shard_plan_self, matching the points
+    in its partitions to themselves, ignoring exact matches; see match_shard
+    """
+
+    return _match_partitioned(
+        ra, dec, radius, ra, dec, True,
+        nside, maxmatch, file, plan.partition_nside, chunk_size, nthreads,
+        multires, float32, tmpdir,
+        halo=plan.halo, keep=plan._get_keep(shard),
+    )
+
+def merge_shards(filenames, maxmatch=1, file=None):
+    """
+    combine the partial match files written by the shards into the final
+    result.
+
+    Each entry is matched in only one shard, but the merge does not rely on
+    it: a pair found in more than one file is kept once, and at most the
+    closest maxmatch matches are kept for each entry
+
+    parameters
+    ----------
+    filenames: list of strings
+        The match files from the shards
+    maxmatch: int, optional
+        The maxmatch used for the shards.  Default 1
+    file: string, optional
+        File in which to write the matches, in the binary format
+
+    returns
+    -------
+    matchcat: structured array
+        The matches, ordered by i1 and closest first for each, ties going to
+        the lower i2.  If a file is sent, None is returned
+    """
+
+    parts = [read_matches(fname) for fname in filenames]
+    if len(parts) == 0:
+        matches = np.zeros(0, dtype=match_dtype)
+    else:
+        matches = np.concatenate(parts)
+    del parts
+
+    s = np.lexsort((matches['i2'], -matches['cosdist'], matches['i1']))
+    matches = matches[s]
+
+    if matches.size > 1:
+        i1 = matches['i1']
+        i2 = matches['i2']
+        dup = np.r_[False, (i1[1:] == i1[:-1]) & (i2[1:] == i2[:-1])]
+        matches = matches[~dup]
+
+    matches = _limit_matches(matches, int(maxmatch))
+
+    if file is not None:
+        with open(file, 'wb') as fobj:
+            _write_matchfile_header(fobj, matches.size)
+            matches.tofile(fobj)
+        return None
+
+    return matches
+
+def _match_partitioned(ra1, dec1, radius1, ra2, dec2, matching_self,
+                       nside, maxmatch, file, partition_nside, chunk_size,
+                       nthreads, multires, float32, tmpdir,
+                       halo=None, keep=None):
+    """
+    match the partitions, or only those for which keep is True.  The halo
+    is the largest radius unless sent
+    """
+
+    ra1, dec1 = _open_columns(ra1, dec1)
+    ra2, dec2 = _open_columns(ra2, dec2)
+    radius1 = _open_radius(radius1, ra1.size)
+    chunk_size = _check_chunk_size(chunk_size)
+
+    maxmatch = int(maxmatch)
+    if halo is None:
+        halo = _max_radius(radius1, chunk_size)
+
+    with tempfile.TemporaryDirectory(dir=tmpdir) as dirname:
+
+        rows1, offsets1 = _partition_rows(
+            ra1, dec1, None, partition_nside, chunk_size,
+            os.path.join(dirname, 'rows1.dat'), keep=keep,
+        )
+        rows2, offsets2 = _partition_rows(
+            ra2, dec2, halo, partition_nside, chunk_size,
+            os.path.join(dirname, 'rows2.dat'), keep=keep,
+        )
+
+        fobj = None
+        parts = []
+        nmatches = 0
+        try:
+            if file is not None:
+                fobj = open(file, 'wb')
+                _write_matchfile_header(fobj, -1)
+
+            for p in range(offsets1.size-1):
+                idx1 = np.array(rows1[offsets1[p]:offsets1[p+1]])
+                idx2 = np.array(rows2[offsets2[p]:offsets2[p+1]])
+                if idx1.size == 0 or idx2.size == 0:
+                    continue
+
+                matches = _match_partition(
+                    ra1, dec1, radius1, ra2, dec2, idx1, idx2,
+                    matching_self, nside, maxmatch, nthreads,
+                    multires, float32,
+                )
+
+                if fobj is not None:
+                    matches.tofile(fobj)
+                    nmatches += matches.size
+                else:
+                    parts.append(matches)
+
+            if fobj is not None:
+                fobj.seek(0)
+                _write_matchfile_header(fobj, nmatches)
+        finally:
+            if fobj is not None:
+                fobj.close()
+
+            # the maps must be closed before the directory is removed
+            del rows1, rows2
+
+    if file is not None:
+        return None
+
+    if len(parts) == 0:
+        return np.zeros(0, dtype=match_dtype)
+
+    # each partition holds whole, ordered, runs of i1
+    matches = np.concatenate(parts)
+    s = np.argsort(matches['i1'], kind='stable')
+    return matches[s]
+
+def _match_partition(ra1, dec1, radius1, ra2, dec2, idx1, idx2,
+                     matching_self, nside, maxmatch, nthreads,
+                     multires, float32):
+    """
+    match the first set of points idx1 in a partition to the second set idx2
+    in it and its halo.  The rows are in increasing order, so the matches for
+    each point are in the same order as for the whole catalogs
+    """
+
+    pra1 = _take(ra1, idx1)
+    pdec1 = _take(dec1, idx1)
+    pradius1 = radius1 if radius1.size == 1 else _take(radius1, idx1)
+    pra2 = _take(ra2, idx2)
+    pdec2 = _take(dec2, idx2)
+
+    if _is_auto(nside):
+        nside = choose_nside(pradius1, pra2, pdec2)
+
+    # for a self match the point itself is in the partition, so ask for one
+    # more match and remove it after mapping back to the full catalog
+    pmaxmatch = maxmatch
+    if matching_self and maxmatch > 0:
+        pmaxmatch = maxmatch + 1
+
+    cat = Catalog(pra1, pdec1, pradius1, nside=nside, cache=False,
+                  multires=multires, float32=float32)
+    cat.match(pra2, pdec2, maxmatch=pmaxmatch, nthreads=nthreads)
+
+    matches = cat.matches
+    matches['i1'] = idx1[matches['i1']]
+    matches['i2'] = idx2[matches['i2']]
+
+    if matching_self:
+        matches = _remove_self(matches, maxmatch)
+
+    return matches
+
+def _remove_self(matches, maxmatch):
+    """
+    remove the matches of points to themselves, keeping at most maxmatch for
+    each point
+    """
+
+    matches = matches[matches['i1'] != matches['i2']]
+    return _limit_matches(matches, maxmatch)
+
+def _limit_matches(matches, maxmatch):
+    """
+    keep at most the first maxmatch matches for each point; the matches must
+    be ordered by i1
+    """
+
+    if maxmatch > 0 and matches.size > 0:
+        i1 = matches['i1']
+        first = np.flatnonzero(np.r_[True, i1[1:] != i1[:-1]])
+        sizes = np.diff(np.r_[first, i1.size])
+        rank = np.arange(i1.size) - np.repeat(first, sizes)
+        matches = matches[rank < maxmatch]
+
+    return matches
+
+def _partition_rows(ra, dec, radius, partition_nside, chunk_size, fname,
+                    keep=None):
+    """
+    get the rows in each partition, in a file mapped into memory.  The rows
+    for partition p are
+
+        rows[offsets[p]:offsets[p+1]]
+
+    in increasing order.  If radius is None each point is in the partition
+    holding it, otherwise it is in every partition intersecting the disc of
+    that radius around it.  If keep is sent, only the partitions for which
+    it is True are filled
+
+    The partitions are found in two passes over the points, the first to
+    count the rows in each and the second to fill them in
+    """
+
+    npart = 12*partition_nside*partition_nside
+
+    counts = _partition_counts(
+        ra, dec, radius, partition_nside, chunk_size, keep=keep,
+    )
+
+    offsets = np.zeros(npart+1, dtype='i8')
+    offsets[1:] = np.cumsum(counts)
+
+    if offsets[-1] == 0:
+        return np.zeros(0, dtype='i8'), offsets
+
+    rows = np.memmap(fname, dtype='i8', mode='w+', shape=(offsets[-1],))
+
+    fill = offsets[:-1].copy()
+    for start in range(0, ra.size, chunk_size):
+        ind, pixels = _chunk_partitions(
+            ra, dec, start, chunk_size, radius, partition_nside, keep,
+        )
+
+        # a stable sort keeps the rows in increasing order in each partition
+        s = np.argsort(pixels, kind='stable')
+        ind = ind[s]
+        pixels = pixels[s]
+
+        chunk_counts = np.bincount(pixels, minlength=npart)
+        chunk_starts = np.cumsum(chunk_counts) - chunk_counts
+
+        pos = fill[pixels] + np.arange(pixels.size) - chunk_starts[pixels]
+        rows[pos] = start + ind
+        fill += chunk_counts
+
+    rows.flush()
+    return rows, offsets
+
+def _partition_counts(ra, dec, radius, partition_nside, chunk_size,
+                      keep=None, radii=None):
+    """
+    the number of rows in each partition, as for _partition_rows, or the sum
+    of the squares of the radii over them if sent
+    """
+
+    npart = 12*partition_nside*partition_nside
+
+    counts = np.zeros(npart, dtype='i8' if radii is None else 'f8')
+    for start in range(0, ra.size, chunk_size):
+        ind, pixels = _chunk_partitions(
+            ra, dec, start, chunk_size, radius, partition_nside, keep,
+        )
+        if radii is None:
+            counts += np.bincount(pixels, minlength=npart)
+        else:
+            cradii = np.array(radii[start:start+chunk_size], dtype='f8')
+            counts += np.bincount(pixels, weights=cradii[ind]**2,
+                                  minlength=npart)
+
+    return counts
+
+def _chunk_partitions(ra, dec, start, chunk_size, radius, partition_nside,
+                      keep=None):
+    """
+    the partitions for the rows in the chunk, as the index of the row in the
+    chunk and the partition for each
+    """
+
+    cra = np.array(ra[start:start+chunk_size], dtype='f8', order='C')
+    cdec = np.array(dec[start:start+chunk_size], dtype='f8', order='C')
+
+    if radius is None:
+        pixels = np.zeros(cra.size, dtype='i8')
+        _smatch._eq2pix(partition_nside, cra, cdec, pixels)
+        ind = np.arange(cra.size)
+    else:
+        ind, pixels = _smatch._disc_pixels(partition_nside, cra, cdec, radius)
+
+    if keep is not None:
+        w = keep[pixels]
+        ind = ind[w]
+        pixels = pixels[w]
+
+    return ind, pixels
+
+def _check_chunk_size(chunk_size):
+    chunk_size = int(chunk_size)
+    if chunk_size < 1:
+        raise ValueError("chunk_size should be >= 1, got %d" % chunk_size)
+    return chunk_size
+
+def _max_radius(radius, chunk_size):
+    """
+    the largest radius, read in chunks
+    """
+
+    maxrad = 0.0
+    for start in range(0, radius.size, chunk_size):
+        maxrad = max(maxrad, float(np.max(radius[start:start+chunk_size])))
+    return maxrad
+
+def _take(column, rows):
+    """
+    read the rows from the column as a contiguous float64 array
+    """
+    return np.array(column[rows], dtype='f8', order='C')
+
+def _open_columns(ra, dec):
+    ra = _open_column(ra)
+    dec = _open_column(dec)
+
+    if ra.size != dec.size:
+        mess="ra/dec size mismatch: %d %d"
+        raise ValueError(mess % (ra.size,dec.size))
+
+    return ra, dec
+
+def _open_radius(radius, n):
+    radius = _open_column(radius)
+
+    if radius.size != 1 and radius.size != n:
+        mess=("radius has size %d but expected either "
+              "a scalar/size 1 array or array of size %d")
+        raise ValueError(mess % (radius.size, n))
+
+    return radius
+
+def _open_column(column):
+    """
+    a one dimensional view of the column, memory mapping it if it is the
+    name of a .npy file
+    """
+
+    if isinstance(column, str):
+        column = np.load(column, mmap_mode='r')
+    elif not isinstance(column, np.ndarray):
+        column = np.array(column, ndmin=1, dtype='f8')
+
+    return column.reshape(-1)
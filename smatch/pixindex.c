@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "pixindex.h"
+
+#define PIXINDEX_RADIX_BITS 8
+#define PIXINDEX_RADIX_SIZE (1<<PIXINDEX_RADIX_BITS)
+
+//
+// This is an LSD radix sort, which is stable, so points within a pixel keep
+// their original order.  We only do as many passes as are needed for the
+// largest key.
+//
+
+int pixindex_radix_sort(int64_t* keys, int64_t* indices, size_t n)
+{
+    size_t i=0, counts[PIXINDEX_RADIX_SIZE];
+    size_t pos=0, tmp=0;
+    int64_t maxkey=0, *keys_tmp=NULL, *indices_tmp=NULL, *swap=NULL;
+    int shift=0, pass=0, npass=0;
+
+    for (i=0; i<n; i++) {
+        if (keys[i] > maxkey) {
+            maxkey = keys[i];
+        }
+    }
+    while (maxkey > 0) {
+        npass++;
+        maxkey >>= PIXINDEX_RADIX_BITS;
+    }
+    if (npass == 0) {
+        // all keys are zero: already sorted
+        return 1;
+    }
+
+    keys_tmp = malloc(n*sizeof(int64_t));
+    indices_tmp = malloc(n*sizeof(int64_t));
+    if (keys_tmp == NULL || indices_tmp == NULL) {
+        free(keys_tmp);
+        free(indices_tmp);
+        return 0;
+    }
+
+    for (pass=0; pass<npass; pass++) {
+        shift = pass*PIXINDEX_RADIX_BITS;
+
+        memset(counts, 0, sizeof(counts));
+        for (i=0; i<n; i++) {
+            counts[ (keys[i] >> shift) & (PIXINDEX_RADIX_SIZE-1) ]++;
+        }
+
+        // convert counts to starting positions
+        pos=0;
+        for (i=0; i<PIXINDEX_RADIX_SIZE; i++) {
+            tmp = counts[i];
+            counts[i] = pos;
+            pos += tmp;
+        }
+
+        for (i=0; i<n; i++) {
+            pos = counts[ (keys[i] >> shift) & (PIXINDEX_RADIX_SIZE-1) ]++;
+            keys_tmp[pos] = keys[i];
+            indices_tmp[pos] = indices[i];
+        }
+
+        swap=keys; keys=keys_tmp; keys_tmp=swap;
+        swap=indices; indices=indices_tmp; indices_tmp=swap;
+    }
+
+    // after an odd number of passes the result is in the scratch space
+    if (npass % 2 != 0) {
+        memcpy(keys_tmp, keys, n*sizeof(int64_t));
+        memcpy(indices_tmp, indices, n*sizeof(int64_t));
+        free(keys);
+        free(indices);
+    } else {
+        free(keys_tmp);
+        free(indices_tmp);
+    }
+
+    return 1;
+}
+
+struct pixindex* pixindex_new(const int64_t* hpixids, size_t n)
+{
+    struct pixindex* self=NULL;
+    int64_t* keys=NULL;
+    size_t i=0, ipix=0;
+
+    self = calloc(1, sizeof(struct pixindex));
+    if (self == NULL) {
+        goto _pixindex_new_bail;
+    }
+
+    self->npoints = n;
+
+    keys = malloc((n > 0 ? n : 1)*sizeof(int64_t));
+    self->indices = malloc((n > 0 ? n : 1)*sizeof(int64_t));
+    if (keys == NULL || self->indices == NULL) {
+        goto _pixindex_new_bail;
+    }
+
+    for (i=0; i<n; i++) {
+        keys[i] = hpixids[i];
+        self->indices[i] = (int64_t)i;
+    }
+
+    if (!pixindex_radix_sort(keys, self->indices, n)) {
+        goto _pixindex_new_bail;
+    }
+
+    // count the distinct pixels
+    for (i=0; i<n; i++) {
+        if (i == 0 || keys[i] != keys[i-1]) {
+            self->npix++;
+        }
+    }
+
+    self->pixels = malloc((self->npix > 0 ? self->npix : 1)*sizeof(int64_t));
+    self->offsets = malloc((self->npix+1)*sizeof(size_t));
+    if (self->pixels == NULL || self->offsets == NULL) {
+        goto _pixindex_new_bail;
+    }
+
+    for (i=0; i<n; i++) {
+        if (i == 0 || keys[i] != keys[i-1]) {
+            self->pixels[ipix] = keys[i];
+            self->offsets[ipix] = i;
+            ipix++;
+        }
+    }
+    self->offsets[self->npix] = n;
+
+    free(keys);
+    return self;
+
+_pixindex_new_bail:
+    free(keys);
+    return pixindex_delete(self);
+}
+
+size_t pixindex_nbytes(const struct pixindex* self)
+{
+    size_t nbytes=0;
+
+    if (self) {
+        nbytes += sizeof(struct pixindex);
+        nbytes += self->npix*sizeof(int64_t);
+        nbytes += (self->npix+1)*sizeof(size_t);
+        nbytes += self->npoints*sizeof(int64_t);
+    }
+
+    return nbytes;
+}
+
+struct pixindex* pixindex_delete(struct pixindex* self)
+{
+    if (self) {
+        free(self->pixels);
+        free(self->offsets);
+        free(self->indices);
+        free(self);
+    }
+    return NULL;
+}
+
+//
+// the position of the first pixel >= hpixid, searching from lo
+//
+
+static size_t pixindex_lower_bound(const struct pixindex* self,
+                                   int64_t hpixid,
+                                   size_t lo)
+{
+    size_t hi=self->npix, mid=0;
+
+    while (lo < hi) {
+        mid = lo + (hi-lo)/2;
+        if (self->pixels[mid] < hpixid) {
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+int pixindex_find(const struct pixindex* self,
+                  int64_t hpixid,
+                  size_t* start,
+                  size_t* end)
+{
+    size_t lo=0;
+
+    lo = pixindex_lower_bound(self, hpixid, 0);
+
+    if (lo < self->npix && self->pixels[lo] == hpixid) {
+        *start = self->offsets[lo];
+        *end = self->offsets[lo+1];
+        return 1;
+    }
+
+    return 0;
+}
+
+int pixindex_find_range(const struct pixindex* self,
+                        int64_t lo,
+                        int64_t hi,
+                        size_t* start,
+                        size_t* end)
+{
+    size_t ilo=0, ihi=0;
+
+    ilo = pixindex_lower_bound(self, lo, 0);
+    if (ilo == self->npix || self->pixels[ilo] > hi) {
+        return 0;
+    }
+    ihi = pixindex_lower_bound(self, hi+1, ilo);
+
+    *start = self->offsets[ilo];
+    *end = self->offsets[ihi];
+    return 1;
+}
@@ -0,0 +1,71 @@
+/*
+   A flat index of points keyed by healpix id
+
+   The points are sorted by pixel, and we keep one entry for each distinct
+   pixel that holds at least one point.  The points that fall into pixel
+   pixels[i] are
+
+       indices[offsets[i]] ... indices[offsets[i+1]-1]
+
+   so all candidates for a pixel are contiguous in memory, and a lookup is a
+   binary search over the pixels array.  Within a pixel the indices are in
+   their original order.
+*/
+#ifndef _PIXINDEX_H
+#define _PIXINDEX_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+struct pixindex {
+    size_t npix;      // number of distinct pixels holding points
+    size_t npoints;   // number of points in the index
+
+    int64_t* pixels;  // sorted distinct pixel ids, size npix
+    size_t* offsets;  // start of each pixel in indices, size npix+1
+    int64_t* indices; // point indices sorted by pixel, size npoints
+};
+
+/*
+   build the index from the pixel id of each point; the ids must be
+   non-negative, which is always the case for healpix
+
+   returns NULL on failure to allocate memory
+*/
+struct pixindex* pixindex_new(const int64_t* hpixids, size_t n);
+
+/*
+   sort the keys, carrying the indices along, keeping the order of equal
+   keys.  The keys must be non-negative.  returns 0 on failure to allocate
+   the scratch space
+*/
+int pixindex_radix_sort(int64_t* keys, int64_t* indices, size_t n);
+
+// the memory used by the index in bytes
+size_t pixindex_nbytes(const struct pixindex* self);
+
+// usage:  index=pixindex_delete(index);
+struct pixindex* pixindex_delete(struct pixindex* self);
+
+/*
+   find the points in the requested pixel.  If found, returns 1 and sets
+   [*start, *end) to the range in the indices array, otherwise returns 0
+*/
+int pixindex_find(const struct pixindex* self,
+                  int64_t hpixid,
+                  size_t* start,
+                  size_t* end);
+
+/*
+   find the points in the pixels lo through hi inclusive.  These are
+   contiguous in the indices array, so this takes two binary searches
+   whatever the number of pixels.  If any are found, returns 1 and sets
+   [*start, *end) to the range in the indices array, otherwise returns 0
+*/
+int pixindex_find_range(const struct pixindex* self,
+                        int64_t lo,
+                        int64_t hi,
+                        size_t* start,
+                        size_t* end);
+
+#endif
@@ -3,28 +3,88 @@
 */
 
 #include <Python.h>
-#include <numpy/arrayobject.h> 
+#include <time.h>
+#include <numpy/arrayobject.h>
 
 #include "math.h"
 #include "defs.h"
 #include "vector.h"
-#include "tree.h"
+#include "pixindex.h"
 #include "healpix.h"
 #include "catpoint.h"
 #include "cat.h"
+#include "kernel.h"
+#include "engine.h"
+#include "matchfile.h"
+#include "unionfind.h"
+
+/*
+   the counts and wall times (seconds) for the last match, kept if the
+   catalog was made with collect_stats; see Catalog.stats
+*/
+struct match_stats {
+    // summed over the catalog entries searched
+    struct entry_stats search;
+
+    // growths of the numpy output array, with the GIL taken
+    int64_t nresize;
+    double time_resize;
+
+    // building the catalog points and disc pixels, if not cached
+    double time_prepare;
+    // indexing the second set of points, or the catalog
+    double time_index;
+    // the search, including sending on the matches
+    double time_search;
+    // the final resize of the output, or finishing the file
+    double time_finish;
+};
 
 struct PySMatchCat {
     PyObject_HEAD
-    int64_t maxmatch;
-    int matching_self;
 
-    //Catalog *cat;
     struct healpix* hpix;
 
+    // the catalog ra, dec and radius arrays; we hold references
+    // since the catalog points to their data
+    PyObject* raObj;
+    PyObject* decObj;
+    PyObject* radiusObj;
+
+    // if use_cache is set, the catalog points and disc pixels are built on
+    // first use and kept for later matches, as is the index over the catalog
+    // itself for matching the catalog to itself
+    int use_cache;
+    Catalog* cat;
+    struct pixindex* self_index;
+    struct soa_points* self_points;
+
+    // if set, the cached data above are views of these arrays, usually
+    // mapped from a file by load_index, rather than owned by the catalog
+    PyObject* loadedObj;
+
+    // for multi-resolution matching, the healpix at each level; level 0 is
+    // hpix above.  nlevels is 1 if not in multi-resolution mode, or if all
+    // radii are small enough to search at the catalog nside
+    size_t nlevels;
+    struct healpix** level_hpix;
+
+    // if set the indexed points are held in single precision; the results
+    // are the same, see kernel.h
+    int single;
+
     // we keep this separately, for the case of writing
     // matches to a file
     int64_t nmatches;
 
+    // the number of matches running.  The GIL is released during the match,
+    // so the catalog must not be re-initialized while this is non-zero
+    int nactive;
+
+    // if set, the counts and times for the last match are kept here
+    int collect_stats;
+    struct match_stats stats;
+
 };
 
 typedef struct {
@@ -33,249 +93,495 @@ typedef struct {
     PyObject *data;
 } np_match_vector;
 
-static inline void np_match_vector_realloc(np_match_vector* self, npy_intp newcap)
+// the GIL must be held; returns 0 on failure, with the python error set
+static inline int np_match_vector_realloc(np_match_vector* self, npy_intp newcap)
 {
 	npy_intp dm[1];
 	PyArray_Dims dims;
+    PyObject* res=NULL;
 
 	dm[0] = newcap;
 	dims.ptr = dm;
 	dims.len = 1;
     // returns NULL on failure, otherwise Py_None
-	PyArray_Resize((PyArrayObject *)self->data, &dims, 0, NPY_CORDER);
+	res = PyArray_Resize((PyArrayObject *)self->data, &dims, 0, NPY_CORDER);
+    if (res == NULL) {
+        return 0;
+    }
+    Py_DECREF(res);
 
     self->capacity = newcap;
     if (self->size > self->capacity) {
         self->size = self->capacity;
     }
+    return 1;
 }
 
-static inline void np_match_vector_push(np_match_vector *self, Match* match)
+// the new capacity when growing to hold at least size elements
+static inline npy_intp np_match_vector_newcap(const np_match_vector *self,
+                                              npy_intp size)
 {
-    Match *ptr=NULL;
     npy_intp newcap=0;
     double tmp=0;
 
-    if (self->size == self->capacity) {
-        tmp = ceil(self->capacity*1.5);
-        newcap = (npy_intp)tmp;
-        if (newcap < 2) {
-            newcap = 2;
-        }
-        np_match_vector_realloc(self, newcap);
+    tmp = ceil(self->capacity*1.5);
+    newcap = (npy_intp)tmp;
+    if (newcap < 2) {
+        newcap = 2;
     }
+    if (newcap < size) {
+        newcap = size;
+    }
+    return newcap;
+}
+
+/*
+   where the matches from the engine are sent: either pushed onto the numpy
+   array or written to the file
+
+   The engine runs with the GIL released; the thread state is held here so
+   it can be taken back when the numpy array must grow
+*/
+struct match_sink {
+    np_match_vector nv;
+    FILE* fobj;
 
-    self->size++;
-    ptr = (Match *) PyArray_GETPTR1(self->data, self->size-1);
-    *ptr = *match;
+    int64_t nmatches;
+    int write_failed;
+
+    // growths of the numpy array and the time taken, with the GIL
+    int64_t nresize;
+    double time_resize;
+
+    PyThreadState* thread_state;
+};
+
+// monotonic wall time in seconds
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1.0e-9*(double)ts.tv_nsec;
 }
 
-static inline void np_match_vector_push_many(np_match_vector *self,
-                                             match_vector * matches)
+//
+// copy the matches onto the end of the numpy array.  The data of the array
+// are written directly; the GIL is only taken when it must be resized, which
+// is safe since the array is only referenced by the catalog
+//
+
+static int push_matches(void* data, const match_vector* matches)
 {
-    size_t i=0;
+    struct match_sink* sink=data;
+    np_match_vector* nv=&sink->nv;
+    npy_intp n=0;
+    int status=1;
+    double t0=0;
+
+    n = (npy_intp)vector_size(matches);
+    if (n == 0) {
+        return 1;
+    }
 
-    for (i=0; i<vector_size(matches); i++) {
-        np_match_vector_push(self, &matches->data[i]);
+    if (nv->size + n > nv->capacity) {
+        t0 = now();
+        if (sink->thread_state) {
+            PyEval_RestoreThread(sink->thread_state);
+        }
+
+        status = np_match_vector_realloc(nv, np_match_vector_newcap(nv, nv->size + n));
+
+        if (sink->thread_state) {
+            sink->thread_state = PyEval_SaveThread();
+        }
+        sink->nresize++;
+        sink->time_resize += now() - t0;
+
+        if (!status) {
+            return 0;
+        }
     }
+
+    memcpy(PyArray_GETPTR1(nv->data, nv->size), matches->data, n*sizeof(Match));
+    nv->size += n;
+
+    sink->nmatches += (int64_t)n;
+    return 1;
 }
 
 //
-// build a heap in an existing match vector
+// write a match to a file
 //
 
-static inline void match_build_heap(match_vector* self)
+static inline int write_match(const Match* match, FILE *fobj)
 {
-    size_t i=0, c=0, parent;
-    Match* data = self->data;
-    Match tmp;
+    int nret=0;
 
-    if (vector_size(self) <= 1) {
-        // Its already a heap
-        return;
-    }
+    nret = fprintf(fobj, "%ld %ld %.16g\n",
+                   match->cat_ind, match->input_ind, match->cosdist);
 
-    for (i=1; i<vector_size(self)-1; i++) {
-        c=i;
-		do {
-			parent  = (c - 1) / 2;
-			if  (data[parent].cosdist < data[c].cosdist)
-			{
-				tmp =  data[parent];
-				data[parent] = data[c];
-				data[c]  = tmp;
-			}
-			c =  parent;
-		} while (c !=  0);
-    }
+    return (nret > 0);
 }
 
 //
-//   make sure the heap is heapified after putting a new element
-//   at the root
-//
-//   it is assumed the data after the root already form a heap
+// write from a match vector to a file
 //
 
-static void match_heap_fix(match_vector* self)
+static int write_matches(void* data, const match_vector* matches)
 {
-    size_t n = vector_size(self)-1;
-
-    const Match* v = &self->data[0];
-    Match* data = self->data;
+    struct match_sink* sink=data;
+    size_t i=0;
+    int status=0;
 
-    size_t jhi = 0;
-    size_t jlo = 1;
+    for (i=0; i<vector_size(matches); i++) {
 
-    while (jlo <= n) {
-        if (jlo < n && data[jlo].cosdist > data[jlo+1].cosdist) {
-            // The right node is smaller
-            jlo += 1;
-        }
-        if (v->cosdist <= data[jlo].cosdist) {
-            // It forms a heap already
-            break;
+        status = write_match(&vector_get(matches, i), sink->fobj);
+        if (!status) {
+            sink->write_failed=1;
+            goto _write_matches_bail;
         }
 
-        data[jhi] = data[jlo]; // promotes the smaller of the branches
-        jhi = jlo;             // move down the heap
-        jlo = 2*jlo + 1;       // calculates position of left branch
     }
 
-    data[jhi] = *v; // places v, vind at correct position in heap
+    sink->nmatches += (int64_t)vector_size(matches);
+    status=1;
 
+_write_matches_bail:
+    return status;
 }
 
 //
-//    possibly insert value, displacing larger values
-//    it is asssumed the data are already a heap other than
-//    the first item
+// write from a match vector to a binary match file
 //
 
-static inline void match_heap_insert(match_vector* self, const Match* match)
+static int write_matches_binary(void* data, const match_vector* matches)
 {
-    if (match->cosdist > self->data[0].cosdist) {
-        self->data[0] = *match;
-        if (vector_size(self) > 1) {
-            match_heap_fix(self);
-        }
+    struct match_sink* sink=data;
+
+    if (!matchfile_write_matches(sink->fobj, matches->data, vector_size(matches))) {
+        sink->write_failed=1;
+        return 0;
     }
+
+    sink->nmatches += (int64_t)vector_size(matches);
+    return 1;
 }
 
 //
-// uses more memory than we need, need to make a simpler point
-// struct
-point_vector* make_points(PyObject* raObj, PyObject* decObj, int* status)
+// make sure the ra,dec are in range, so the engine will not see bad values.
+// The python error is set on failure
+//
+
+static int check_radec(const double* ra, const double* dec, size_t n)
 {
-    size_t i=0, n=0;
-    point_vector* points=NULL;
-    Point pt={0};
-    double *raptr=NULL, *decptr=NULL;
+    size_t bad=0;
+    double theta=0, phi=0;
+
+    if (!hpix_check_radec_array(ra, dec, n, &bad)) {
+        // sets the python error
+        hpix_radec_degrees_to_thetaphi_radians(ra[bad], dec[bad], &theta, &phi);
+        return 0;
+    }
+    return 1;
+}
 
-    n = PyArray_SIZE(raObj);
-    points = point_vector_new();
-    vector_resize(points, n);
+//
+// the data for a float64 array; these are converted to contiguous float64
+// arrays on the python side
+//
 
-    for (i=0; i<n; i++) {
+static int get_array_data(PyObject* arrObj, const char* name, const double** data)
+{
+    if (!PyArray_Check(arrObj)
+            || PyArray_TYPE((PyArrayObject*)arrObj) != NPY_FLOAT64
+            || !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)arrObj)) {
+        PyErr_Format(PyExc_ValueError,
+                     "%s must be a contiguous float64 array", name);
+        return 0;
+    }
+
+    *data = PyArray_DATA((PyArrayObject*)arrObj);
+    return 1;
+}
+
+//
+// build the caches if requested.  The disc pixels are only needed when
+// looping over the catalog entries
+//
+// the caches are built with the GIL released, on a copy of the catalog
+// struct since another python thread may match the catalog meanwhile; they
+// are installed once the GIL is held again, unless that thread got there
+// first
+//
 
-        raptr=PyArray_GETPTR1(raObj, i);
-        decptr=PyArray_GETPTR1(decObj, i);
+static int prepare_catalog(struct PySMatchCat* self, int need_discs)
+{
+    int status=1, build_points=0, build_discs=0;
+    double max_radius=HUGE_VAL;
+    const char* what="Could not allocate catalog points";
+    Catalog built;
+
+    if (!self->use_cache) {
+        return 1;
+    }
+
+    built = *self->cat;
+    build_points = built.points == NULL;
+    build_discs = need_discs && built.disc_offsets == NULL;
+    if (!build_points && !build_discs) {
+        return 1;
+    }
+
+    if (self->nlevels > 1) {
+        max_radius = engine_level_max_radius(self->hpix->nside);
+    }
 
-        *status=hpix_eq2xyz(*raptr, *decptr, &pt.x, &pt.y, &pt.z);
-        if (! (*status) ) {
-            goto _make_points_bail;
+    Py_BEGIN_ALLOW_THREADS
+    if (build_points) {
+        status = cat_build_points(&built);
+    }
+    if (status && build_discs) {
+        status = cat_build_discs(&built, self->hpix, max_radius);
+        if (!status) {
+            what = "Could not allocate disc pixels";
+            if (build_points) {
+                free(built.points);
+            }
         }
+    }
+    Py_END_ALLOW_THREADS
 
-        vector_set(points, i, pt); 
+    if (!status) {
+        PyErr_SetString(PyExc_MemoryError, what);
+        return 0;
+    }
 
+    if (build_points) {
+        if (self->cat->points == NULL) {
+            self->cat->points = built.points;
+        } else {
+            free(built.points);
+        }
+    }
+    if (build_discs) {
+        if (self->cat->disc_offsets == NULL) {
+            self->cat->disc_offsets = built.disc_offsets;
+            self->cat->disc_ranges = built.disc_ranges;
+        } else {
+            free(built.disc_offsets);
+            vector_free(built.disc_ranges);
+        }
     }
 
-    *status=1;
+    return 1;
+}
+
+//
+// get the index over the catalog itself.  If caching is enabled it is kept
+// for later use, in which case *owned is set to 0 and it should not be freed
+//
+// the index is built with the GIL released
+//
 
-_make_points_bail:
+static struct pixindex* get_catalog_index(struct PySMatchCat* self,
+                                          int* owned,
+                                          int* status)
+{
+    struct pixindex* index=NULL;
+    const Catalog* cat=self->cat;
+
+    *owned = !self->use_cache;
+
+    if (self->self_index != NULL) {
+        *status=1;
+        return self->self_index;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    index = create_hpix_index(self->hpix, cat->ra, cat->dec, cat->size);
+    Py_END_ALLOW_THREADS
+
+    if (index == NULL) {
+        *status=0;
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate pixel index");
+        return NULL;
+    }
 
-    if (! (*status) ) {
-        vector_free(points);
+    *status=1;
+    if (!(*owned)) {
+        // another thread may have built it while we did
+        if (self->self_index != NULL) {
+            index = pixindex_delete(index);
+        } else {
+            self->self_index = index;
+        }
+        index = self->self_index;
     }
-    return points;
+
+    return index;
 }
 
 //
-//   fill the entry with xyz and disc_pixels, as well
-//   as resetting the matches
+// get the index and points for the second set of points.  When matching the
+// catalog to itself these are taken from the cache if it is enabled, in which
+// case *owned is set to 0 and they should not be freed
+//
+// the index and points are built with the GIL released
 //
 
-static int fill_catalog_entry(CatalogEntry* entry,
-                              struct healpix* hpix,
-                              double ra,
-                              double dec,
-                              double radius)
+static int get_input_index(struct PySMatchCat* self,
+                           int matching_self,
+                           const double* ra,
+                           const double* dec,
+                           size_t n,
+                           struct pixindex** index,
+                           struct soa_points** points,
+                           int* owned)
 {
     int status=0;
-    CatPoint* cpt=&entry->point;
 
-    status=hpix_eq2xyz(ra, dec, &cpt->x, &cpt->y, &cpt->z);
-    if (!status) {
-        // we expect the error to be set already
-        goto _fill_catalog_entry_bail;
+    *index = NULL;
+    *points = NULL;
+
+    if (matching_self) {
+        *index = get_catalog_index(self, owned, &status);
+        if (!status) {
+            goto _get_input_index_bail;
+        }
+        if (self->self_points != NULL) {
+            *points = self->self_points;
+            return 1;
+        }
+    } else {
+        *owned = 1;
+        Py_BEGIN_ALLOW_THREADS
+        *index = create_hpix_index_points(self->hpix, ra, dec, n,
+                                          self->single, points);
+        Py_END_ALLOW_THREADS
+        if (*index == NULL) {
+            PyErr_SetString(PyExc_MemoryError, "Could not allocate pixel index");
+            goto _get_input_index_bail;
+        }
+        return 1;
     }
 
-    cpt->radius = radius*D2R;
-    cpt->cos_radius = cos( cpt->radius );
+    Py_BEGIN_ALLOW_THREADS
+    *points = soa_points_new(ra, dec, *index, self->single);
+    Py_END_ALLOW_THREADS
 
-    hpix_disc_intersect(hpix, cpt->x, cpt->y, cpt->z, cpt->radius, entry->disc_pixels);
-    vector_resize(entry->matches, 0);
+    if (*points == NULL) {
+        status=0;
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate points");
+        goto _get_input_index_bail;
+    }
 
     status=1;
-_fill_catalog_entry_bail:
+    if (!(*owned)) {
+        // another thread may have built them while we did
+        if (self->self_points != NULL) {
+            *points = soa_points_delete(*points);
+        } else {
+            self->self_points = *points;
+        }
+        *points = self->self_points;
+    }
 
+_get_input_index_bail:
+    if (!status && *owned) {
+        *index = pixindex_delete(*index);
+    }
     return status;
 }
 
 //
-// create the tree.  Put all positions into a binary
-// tree based on healpix id; indices for the objects are held
-// in the tree
+// free the cached data
+//
+
+static void clear_catalog_cache(struct PySMatchCat* self)
+{
+    if (self->loadedObj != NULL) {
+        // the data are views of the loaded arrays, only the structs are ours
+        if (self->cat) {
+            self->cat->points = NULL;
+            self->cat->disc_offsets = NULL;
+            free(self->cat->disc_ranges);
+            self->cat->disc_ranges = NULL;
+        }
+        free(self->self_index);
+        self->self_index = NULL;
+        free(self->self_points);
+        self->self_points = NULL;
+        Py_CLEAR(self->loadedObj);
+        return;
+    }
+
+    cat_clear(self->cat);
+    self->self_index = pixindex_delete(self->self_index);
+    self->self_points = soa_points_delete(self->self_points);
+}
+
+//
+// free the healpix for the coarser levels
 //
 
-static struct tree_node* create_hpix_tree(struct healpix* hpix,
-                                          PyObject* raObj,
-                                          PyObject* decObj,
-                                          int *status)
+static void clear_levels(struct PySMatchCat* self)
 {
+    size_t level=0;
 
-    struct tree_node* tree=NULL;
-    int64_t hpixid=0;
-    int64_t half_npix=0;
-    size_t i=0, n=0;
-    double *raptr=NULL, *decptr=NULL;
-    
-    // this will produce a more balanced tree across the whole sky
-    half_npix = hpix->npix/2;
-
-    n = PyArray_SIZE(raObj);
-    for (i=0; i<n ; i++) {
-
-        raptr=PyArray_GETPTR1(raObj, i);
-        decptr=PyArray_GETPTR1(decObj, i);
-
-        hpixid = hpix_eq2pix(hpix, *raptr, *decptr, status);
-        if ( !(*status) ) {
-            PyErr_SetString(PyExc_ValueError, "Could not get hpix id, band ra,dec\n");
-            goto _create_hpix_tree_bail;
+    if (self->level_hpix) {
+        // level 0 is self->hpix
+        for (level=1; level<self->nlevels; level++) {
+            self->level_hpix[level] = hpix_delete(self->level_hpix[level]);
         }
+        free(self->level_hpix);
+        self->level_hpix = NULL;
+    }
+    self->nlevels = 0;
+}
+
+//
+// set up the levels for multi-resolution matching, for the largest radius
+// in the catalog.  The python error is set on failure
+//
 
-        tree_insert(&tree, hpixid-half_npix, i);
+static int init_levels(struct PySMatchCat* self, int multires)
+{
+    size_t i=0, level=0;
+    double max_radius=0;
+    const Catalog* cat=self->cat;
+
+    self->nlevels = 1;
+    if (!multires) {
+        return 1;
+    }
+
+    for (i=0; i<cat->nradius; i++) {
+        if (cat->radius[i]*D2R > max_radius) {
+            max_radius = cat->radius[i]*D2R;
+        }
+    }
 
+    self->nlevels = engine_nlevels(self->hpix->nside, max_radius);
+    if (self->nlevels == 1) {
+        return 1;
     }
 
-_create_hpix_tree_bail:
+    self->level_hpix = calloc(self->nlevels, sizeof(struct healpix*));
+    if (self->level_hpix == NULL) {
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate levels");
+        return 0;
+    }
 
-    if ( !(*status) ) {
-        tree = tree_delete(tree);
+    self->level_hpix[0] = self->hpix;
+    for (level=1; level<self->nlevels; level++) {
+        self->level_hpix[level] = hpix_new(engine_level_nside(self->hpix->nside, level));
+        if (self->level_hpix[level] == NULL) {
+            // python error is set
+            return 0;
+        }
     }
 
-    return tree;
+    return 1;
 }
 
 
@@ -287,11 +593,54 @@ static int
 PySMatchCat_init(struct PySMatchCat* self, PyObject *args, PyObject *kwds)
 {
     PY_LONG_LONG nside=0;
-    int err=0;
+    int err=0, use_cache=0, multires=0, single=0, collect_stats=0, check=1;
+    PyObject* raObj=NULL;
+    PyObject* decObj=NULL;
+    PyObject* radiusObj=NULL;
+    const double *ra=NULL, *dec=NULL, *radius=NULL;
+
+    if (!PyArg_ParseTuple(args, (char*)"LOOOiiiii",
+                          &nside, &raObj, &decObj, &radiusObj, &use_cache,
+                          &multires, &single, &collect_stats, &check)) {
+        return -1;
+    }
+
+    if (self->nactive > 0) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Cannot initialize the catalog while it is being matched");
+        return -1;
+    }
 
-    if (!PyArg_ParseTuple(args, (char*)"L", &nside)) {
+    if (!get_array_data(raObj, "ra", &ra)
+            || !get_array_data(decObj, "dec", &dec)
+            || !get_array_data(radiusObj, "radius", &radius)) {
         return -1;
     }
+    // check is 0 for an index from load_index, checked when it was saved,
+    // so the columns are not read
+    if (check && !check_radec(ra, dec, (size_t)PyArray_SIZE((PyArrayObject*)raObj))) {
+        return -1;
+    }
+
+    // in case init is called more than once
+    clear_catalog_cache(self);
+    cat_free(self->cat);
+    clear_levels(self);
+    self->hpix = hpix_delete(self->hpix);
+    Py_XDECREF(self->raObj);
+    Py_XDECREF(self->decObj);
+    Py_XDECREF(self->radiusObj);
+
+    Py_INCREF(raObj);
+    Py_INCREF(decObj);
+    Py_INCREF(radiusObj);
+    self->raObj = raObj;
+    self->decObj = decObj;
+    self->radiusObj = radiusObj;
+    self->use_cache = use_cache;
+    self->single = single;
+    self->collect_stats = collect_stats;
+    memset(&self->stats, 0, sizeof(struct match_stats));
 
     self->hpix = hpix_new((int64_t)nside);
     if (self->hpix==NULL) {
@@ -299,8 +648,25 @@ PySMatchCat_init(struct PySMatchCat* self, PyObject *args, PyObject *kwds)
         goto _catalog_init_cleanup;
     }
 
+    self->cat = cat_new(ra,
+                        dec,
+                        (size_t)PyArray_SIZE((PyArrayObject*)raObj),
+                        radius,
+                        (size_t)PyArray_SIZE((PyArrayObject*)radiusObj));
+    if (self->cat==NULL) {
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate catalog");
+        err=1;
+        goto _catalog_init_cleanup;
+    }
+
+    if (!init_levels(self, multires)) {
+        err=1;
+        goto _catalog_init_cleanup;
+    }
+
 _catalog_init_cleanup:
     if (err != 0) {
+        clear_levels(self);
         self->hpix = hpix_delete(self->hpix);
         return -1;
     }
@@ -316,7 +682,13 @@ static void
 PySMatchCat_dealloc(struct PySMatchCat* self)
 {
 
+    clear_levels(self);
     self->hpix = hpix_delete(self->hpix);
+    clear_catalog_cache(self);
+    cat_free(self->cat);
+    Py_XDECREF(self->raObj);
+    Py_XDECREF(self->decObj);
+    Py_XDECREF(self->radiusObj);
 
 #if PY_MAJOR_VERSION >= 3
     Py_TYPE(self)->tp_free((PyObject*)self);
@@ -351,6 +723,10 @@ PySMatchCat_hpix_nside(struct PySMatchCat* self) {
     return Py_BuildValue("l", self->hpix->nside);
 }
 static PyObject *
+PySMatchCat_nlevels(struct PySMatchCat* self) {
+    return Py_BuildValue("n", (Py_ssize_t)self->nlevels);
+}
+static PyObject *
 PySMatchCat_hpix_area(struct PySMatchCat* self) {
     return Py_BuildValue("d", hpix_area(self->hpix->nside));
 }
@@ -360,448 +736,1924 @@ PySMatchCat_nmatches(struct PySMatchCat* self) {
     return Py_BuildValue("l", self->nmatches);
 }
 
-/*
-
-   Match the input catalog entry to the second set of points, the
-   hpix ids of which have been put into a tree. 
-   
-   If no restriction is set on maximum number of matches, then matches are
-   simply appended to the match vector in the catalog entry.
-
-   If the number of matches is restricted (maxmatch > 0) then matches are
-   appended up to the max allowed, then the match vector is converted to a heap
-   and only matches closer than the farthest current match are added.
-
-*/
-
-static void domatch1(struct PySMatchCat* self, 
-                     CatalogEntry* entry,
-                     size_t cat_ind,
-                     struct tree_node* tree,
-                     point_vector* points)
-{
-
-    CatPoint *cpt=NULL;
-    Point *pt=NULL;
+static PyObject *
+PySMatchCat_cache_nbytes(struct PySMatchCat* self) {
+    size_t nbytes=0;
 
-    int64_t hpixid=0;
-    struct tree_node* node=NULL;
-    int64_t half_npix=0;
+    nbytes += cat_nbytes(self->cat);
+    nbytes += pixindex_nbytes(self->self_index);
+    nbytes += soa_points_nbytes(self->self_points);
+    return Py_BuildValue("n", (Py_ssize_t)nbytes);
+}
 
-    size_t i=0, j=0, input_ind=0;
-    double cos_angle=0;
+//
+// the counts and times for the last match as a dict, or None if they are not
+// collected
+//
 
-    int64_t maxmatch = self->maxmatch;
+static PyObject *
+PySMatchCat_get_stats(struct PySMatchCat* self) {
+    const struct match_stats* stats=&self->stats;
 
-    Match match={0};
-    match_vector* matches=NULL;
+    if (!self->collect_stats) {
+        Py_RETURN_NONE;
+    }
 
-    half_npix = self->hpix->npix/2;
+    return Py_BuildValue(
+        "{s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:d,s:d,s:d,s:d,s:d}",
+        "nentries",     (PY_LONG_LONG)stats->search.nentries,
+        "nranges",      (PY_LONG_LONG)stats->search.nranges,
+        "npixels",      (PY_LONG_LONG)stats->search.npixels,
+        "nhits",        (PY_LONG_LONG)stats->search.nhits,
+        "nmisses",      (PY_LONG_LONG)stats->search.nmisses,
+        "ncandidates",  (PY_LONG_LONG)stats->search.ncandidates,
+        "naccepted",    (PY_LONG_LONG)stats->search.naccepted,
+        "nreplaced",    (PY_LONG_LONG)stats->search.nreplaced,
+        "nresize",      (PY_LONG_LONG)stats->nresize,
+        "time_prepare", stats->time_prepare,
+        "time_index",   stats->time_index,
+        "time_search",  stats->time_search,
+        "time_resize",  stats->time_resize,
+        "time_finish",  stats->time_finish);
+}
 
-    matches = entry->matches;
-    cpt = &entry->point;
+/*
+   The data needed by the engine for a match.  The caches are only built
+   while the GIL is held, and the engine works on a copy of the catalog
+   struct, so a cache built by another thread in the meantime is not seen part
+   way.
+*/
+struct match_state {
+    Catalog cat;
 
-    // loop over pixels that intersected a disc around
-    // this object
+    struct pixindex* index;
+    struct soa_points* points;
 
-    for (i=0; i < vector_size(entry->disc_pixels); i++) {
+    // set if we own the index and points
+    int owned;
+    // set if the points in cat are ours
+    int built_points;
 
-        // get the tree node corresponding to this pixel
-        hpixid = vector_get(entry->disc_pixels, i);
-        node = tree_find(tree, hpixid-half_npix);
+    // the index over the catalog used for its walk order, and set if we own it
+    struct pixindex* cat_index;
+    int owned_cat_index;
 
-        if (node != NULL) {
-            for (j=0; j < vector_size(node->indices); j++) {
+    // the second set of points indexed at each level for multi-resolution
+    // matching; we own those above level 0
+    struct match_level* levels;
+    size_t nlevels;
 
-                input_ind = vector_get(node->indices, j);
+    // copied to the catalog stats when cleared, if collect_stats is set
+    struct match_stats stats;
 
-                if (self->matching_self && input_ind==cat_ind) {
-                    continue;
-                }
+    struct match_context ctx;
+};
 
-                pt = &points->data[input_ind];
+//
+// index the second set of points at the coarser levels.  These are not
+// cached; the coarse indexes are only searched by the entries with large
+// radii, but still hold all the points
+//
 
-                cos_angle = pt->x*cpt->x + pt->y*cpt->y + pt->z*cpt->z;
+static int match_state_init_levels(struct PySMatchCat* self,
+                                   struct match_state* state,
+                                   const double* ra,
+                                   const double* dec,
+                                   size_t n)
+{
+    int status=1;
+    size_t level=0, nlevels=self->nlevels;
+    struct match_level* levels=NULL;
+    struct pixindex* index=NULL;
+    struct soa_points* points=NULL;
+
+    levels = calloc(nlevels, sizeof(struct match_level));
+    if (levels == NULL) {
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate levels");
+        return 0;
+    }
+    state->levels = levels;
+    state->nlevels = nlevels;
+
+    levels[0].hpix = self->hpix;
+    levels[0].index = state->index;
+    levels[0].points = state->points;
+
+    Py_BEGIN_ALLOW_THREADS
+    for (level=1; level<nlevels; level++) {
+        index = create_hpix_index_points(self->level_hpix[level], ra, dec, n,
+                                          self->single, &points);
+        if (index == NULL) {
+            status=0;
+            break;
+        }
+        levels[level].hpix = self->level_hpix[level];
+        levels[level].index = index;
+        levels[level].points = points;
+    }
+    Py_END_ALLOW_THREADS
 
-                if (cos_angle > cpt->cos_radius) {
-                    match.cat_ind=cat_ind;
-                    match.input_ind=(int64_t)input_ind;
-                    match.cosdist=cos_angle;
+    if (!status) {
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate pixel index");
+        return 0;
+    }
 
+    state->ctx.levels = levels;
+    state->ctx.nlevels = nlevels;
 
-                    if (maxmatch <= 0 || (int64_t)vector_size(matches) < maxmatch) {
-                        // we increment for new matches
-                        self->nmatches += 1;
+    return 1;
+}
 
-                        // just keep adding entries
-                        vector_push(matches, match);
+// what the match state is prepared for, see match_state_init
+#define MATCH_INDEX_INPUT 0
+#define MATCH_INDEX_CATALOG 1
+#define MATCH_KNN 2
 
-                        // if we are now at capacity, heapify it unless maxmatch
-                        // is size one, in which case it is already a heap
-                        if (maxmatch > 1 && (int64_t)vector_size(matches)==maxmatch) {
-                            match_build_heap(matches);
-                        }
-                    } else {
-                        // note the number of matches is *not* incremented
+// the values of matching_self sent from python: 0 when matching another set
+// of points, otherwise the catalog is matched to itself, with all matches or
+// each pair once, see ENGINE_PAIRS_UNIQUE
+#define MATCH_SELF 1
+#define MATCH_SELF_UNIQUE 2
+#define MATCH_SELF_MIRROR 3
 
-                        // add only if closer than the farthest match
-                        match_heap_insert(matches, &match);
-                    }
+/*
+   Prepare for the match with the GIL held.
 
-                } // within distance
+   For MATCH_INDEX_CATALOG the index is built over the catalog and the input
+   points are streamed, otherwise the index is built over the input.  For
+   MATCH_KNN the disc pixels for the catalog radii are not needed.
 
-            } // loop over indices in node
-        } // id found in tree
-    } // loop over disc pixel ids
+   Unique pairs are only found with the input index, for maxmatch <= 0
 
-}
+   The catalog is marked as active until match_state_clear is called, even
+   on failure.
+*/
 
-static int domatch1_2file_all(struct PySMatchCat* self, 
-                              CatalogEntry* entry,
-                              size_t cat_ind,
-                              struct tree_node* tree, // second cat hpix tree
-                              point_vector* points, // second cat points
-                              FILE* fobj)
+static int match_state_init(struct PySMatchCat* self,
+                            struct match_state* state,
+                            int64_t maxmatch,
+                            int matching_self,
+                            PyObject* raObj,
+                            PyObject* decObj,
+                            int mode)
 {
-    int status=0, nret=0;
-
-    CatPoint *cpt=NULL;
-    Point *pt=NULL;
-
-    int64_t hpixid=0;
-    struct tree_node* node=NULL;
-    int64_t half_npix=0;
-
-    size_t i=0, j=0, input_ind=0;
-    double cos_angle=0;
+    int status=0;
+    size_t n=0;
+    const double *ra=NULL, *dec=NULL;
+    double t0=0;
 
-    half_npix = self->hpix->npix/2;
+    memset(state, 0, sizeof(struct match_state));
 
-    cpt = &entry->point;
+    self->nactive++;
 
-    // loop over pixels that intersected a disc around
-    // this object
+    if (!get_array_data(raObj, "ra", &ra) || !get_array_data(decObj, "dec", &dec)) {
+        goto _match_state_init_bail;
+    }
+    n = (size_t)PyArray_SIZE((PyArrayObject*)raObj);
 
-    for (i=0; i < vector_size(entry->disc_pixels); i++) {
+    if (!matching_self && !check_radec(ra, dec, n)) {
+        goto _match_state_init_bail;
+    }
 
-        // get the tree node corresponding to this pixel
-        hpixid = vector_get(entry->disc_pixels, i);
-        node = tree_find(tree, hpixid-half_npix);
+    if (matching_self > MATCH_SELF
+            && (mode != MATCH_INDEX_INPUT || maxmatch > 0)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "unique pairs are only found for maxmatch <= 0 "
+                        "when indexing the input");
+        goto _match_state_init_bail;
+    }
 
-        if (node != NULL) {
-            for (j=0; j < vector_size(node->indices); j++) {
+    t0 = now();
+    if (mode == MATCH_INDEX_CATALOG) {
+        status = prepare_catalog(self, 0);
+        if (!status) {
+            goto _match_state_init_bail;
+        }
+        state->cat = *self->cat;
 
-                input_ind = vector_get(node->indices, j);
-                if (self->matching_self && input_ind==cat_ind) {
-                    continue;
-                }
+        // the streaming match always needs the catalog points
+        if (state->cat.points == NULL) {
+            Py_BEGIN_ALLOW_THREADS
+            status = cat_build_points(&state->cat);
+            Py_END_ALLOW_THREADS
 
-                pt = &points->data[input_ind];
+            if (!status) {
+                PyErr_SetString(PyExc_MemoryError, "Could not allocate catalog points");
+                goto _match_state_init_bail;
+            }
+            state->built_points=1;
+        }
+        state->stats.time_prepare = now() - t0;
 
-                cos_angle = pt->x*cpt->x + pt->y*cpt->y + pt->z*cpt->z;
+        t0 = now();
+        state->index = get_catalog_index(self, &state->owned, &status);
+        if (!status) {
+            goto _match_state_init_bail;
+        }
 
-                if (cos_angle > cpt->cos_radius) {
+    } else {
 
-                    self->nmatches += 1;
-                    nret = fprintf(fobj, "%ld %ld %.16g\n", cat_ind, input_ind, cos_angle);
-                    if (nret == 0) {
-                        status = 0;
-                        goto _domatch1_2file_all_bail;
-                    }
+        status = prepare_catalog(self, mode == MATCH_INDEX_INPUT);
+        if (!status) {
+            goto _match_state_init_bail;
+        }
+        state->cat = *self->cat;
+        state->stats.time_prepare = now() - t0;
 
-                } // within distance
+        t0 = now();
+        // the index can dominate the memory
+        status = get_input_index(self, matching_self, ra, dec, n,
+                                 &state->index, &state->points, &state->owned);
+        if (!status) {
+            goto _match_state_init_bail;
+        }
+    }
 
-            } // loop over indices in node
-        } // id found in tree
-    } // loop over disc pixel ids
+    state->ctx.hpix = self->hpix;
+    state->ctx.maxmatch = maxmatch;
+    state->ctx.matching_self = matching_self != 0;
+    if (matching_self == MATCH_SELF_UNIQUE) {
+        state->ctx.unique_pairs = ENGINE_PAIRS_UNIQUE;
+    } else if (matching_self == MATCH_SELF_MIRROR) {
+        state->ctx.unique_pairs = ENGINE_PAIRS_MIRROR;
+    }
+    state->ctx.cat = &state->cat;
+    state->ctx.ra = ra;
+    state->ctx.dec = dec;
+    state->ctx.npoints = n;
+    state->ctx.index = state->index;
+    state->ctx.points = state->points;
+    state->ctx.kernel = kernel_get();
+    state->ctx.screen = kernel_get_screen();
+    if (self->collect_stats) {
+        state->ctx.stats = &state->stats.search;
+    }
 
-    status=1;
+    if (mode == MATCH_INDEX_INPUT && self->nlevels > 1) {
+        status = match_state_init_levels(self, state, ra, dec, n);
+    }
+    state->stats.time_index = now() - t0;
 
-_domatch1_2file_all_bail:
+_match_state_init_bail:
     return status;
 }
 
-
 //
-// do the match for each entered point
-// all matches are saved in memory
-// run match_prep() before calling this function
+// visit the catalog entries in pixel order in engine_count and engine_fill,
+// so consecutive entries use nearby candidates.  The order is taken from the
+// index over the catalog, which is the input index when matching to itself
 //
 
-static int domatch(struct PySMatchCat* self,
-                   PyObject* craObj,
-                   PyObject* cdecObj,
-                   PyObject* cradiusObj,
-                   PyObject* raObj,
-                   PyObject* decObj,
-                   PyObject* matchesObj) {
+static int match_state_set_order(struct PySMatchCat* self, struct match_state* state)
+{
     int status=0;
-    size_t i=0, nrad=0, ncat=0;
-
-    struct tree_node* tree=NULL;
+    double t0=0;
 
-    point_vector* points=NULL;
-    double cra=0, cdec=0, crad=0;
+    if (state->ctx.matching_self) {
+        state->ctx.cat_order = state->index->indices;
+        return 1;
+    }
 
-    CatalogEntry *entry=NULL;
+    t0 = now();
+    state->cat_index = get_catalog_index(self, &state->owned_cat_index, &status);
+    state->stats.time_index += now() - t0;
+    if (!status) {
+        return 0;
+    }
+    state->ctx.cat_order = state->cat_index->indices;
 
-    np_match_vector nv = {0};
+    return 1;
+}
 
-    nv.data = matchesObj;
-    nv.capacity = PyArray_SIZE(matchesObj);
-    nv.size = 0;
+//
+// free the data for the match and mark the catalog as not active
+//
 
-    ncat=(size_t)PyArray_SIZE(craObj);
-    nrad=(size_t)PyArray_SIZE(cradiusObj);
+static void match_state_clear(struct PySMatchCat* self, struct match_state* state)
+{
+    size_t level=0;
 
-    // the tree can dominate the memory
-    tree = create_hpix_tree(self->hpix, raObj, decObj, &status);
-    if (!status) {
-        goto _domatch_bail;
+    if (state->levels) {
+        for (level=1; level<state->nlevels; level++) {
+            pixindex_delete((struct pixindex*) state->levels[level].index);
+            soa_points_delete((struct soa_points*) state->levels[level].points);
+        }
+        free(state->levels);
+        state->levels = NULL;
+        state->nlevels = 0;
+    }
+    if (state->owned_cat_index) {
+        state->cat_index = pixindex_delete(state->cat_index);
+        state->owned_cat_index = 0;
+    }
+    if (state->built_points) {
+        free(state->cat.points);
+        state->cat.points = NULL;
+        state->built_points = 0;
+    }
+    if (state->owned) {
+        state->index = pixindex_delete(state->index);
+        state->points = soa_points_delete(state->points);
+        state->owned = 0;
     }
 
-    points = make_points(raObj, decObj, &status);
-    if (!status) {
-        goto _domatch_bail;
+    if (self->collect_stats) {
+        self->stats = state->stats;
     }
 
-    entry = cat_entry_new();
+    self->nactive--;
+}
 
-    self->nmatches=0;
+/*
 
-    for (i=0; i < ncat ; i++) {
-        cra = *(double *)PyArray_GETPTR1(craObj,i);
-        cdec = *(double *)PyArray_GETPTR1(cdecObj,i);
-        if (nrad==1) {
-            crad = *(double *)PyArray_GETPTR1(cradiusObj,0);
-        } else {
-            crad = *(double *)PyArray_GETPTR1(cradiusObj,i);
-        }
+   Run the match, sending the matches to the consumer.
 
-        fill_catalog_entry(entry, self->hpix, cra, cdec, crad);
+   If index_catalog is set, the index is built over the catalog and the
+   input points are streamed, otherwise the index is built over the input and
+   the catalog entries are matched using nthreads threads.
 
-        domatch1(self, entry, i, tree, points);
+   If ordered is not set, matches found with the catalog index may be sent
+   as they are found rather than in order of catalog index
 
-        np_match_vector_push_many(&nv, entry->matches);
+   The match runs with the GIL released.
 
-    }
+*/
 
-    // make sure final array has exactly the desired size
-    if (nv.capacity > nv.size) {
-        np_match_vector_realloc(&nv, nv.size);
+static int domatch_engine(struct PySMatchCat* self,
+                          int64_t maxmatch,
+                          int matching_self,
+                          PyObject* raObj,
+                          PyObject* decObj,
+                          int index_catalog,
+                          int ordered,
+                          int nthreads,
+                          match_consumer consume,
+                          struct match_sink* sink)
+{
+    int status=0;
+    double t0=0;
+    struct match_state state;
+
+    status = match_state_init(self, &state, maxmatch, matching_self,
+                              raObj, decObj,
+                              index_catalog ? MATCH_INDEX_CATALOG : MATCH_INDEX_INPUT);
+    if (!status) {
+        goto _domatch_engine_bail;
     }
 
-_domatch_bail:
+    t0 = now();
+    sink->thread_state = PyEval_SaveThread();
+
+    if (index_catalog) {
+        status = engine_match_catalog_index(&state.ctx, state.index, ordered,
+                                            consume, sink);
+    } else {
+        status = engine_match(&state.ctx, nthreads, consume, sink);
+    }
+
+    PyEval_RestoreThread(sink->thread_state);
+    sink->thread_state = NULL;
+
+    state.stats.time_search = now() - t0;
+    state.stats.nresize = sink->nresize;
+    state.stats.time_resize = sink->time_resize;
+
+    // write errors are reported by the caller
+    if (!status && !PyErr_Occurred() && !sink->write_failed) {
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate matches");
+    }
+
+    self->nmatches = sink->nmatches;
+
+_domatch_engine_bail:
+
+    match_state_clear(self, &state);
+
+    return status;
+}
+
+/*
+
+   Match in two passes: the matches for each catalog entry are counted, then
+   the output is resized once to the total and the matches are written in
+   place, at the offset for each catalog entry.  This avoids growing the
+   array, so the peak memory is the size of the output.
+
+   Both passes run with the GIL released.
+
+*/
+
+static int domatch_exact(struct PySMatchCat* self,
+                         int64_t maxmatch,
+                         int matching_self,
+                         PyObject* raObj,
+                         PyObject* decObj,
+                         PyObject* matchesObj,
+                         int nthreads) {
+    int status=0;
+    size_t i=0, ncat=0;
+    int64_t* offsets=NULL;
+    np_match_vector nv={0};
+    double t0=0;
+    struct match_state state;
+
+    status = match_state_init(self, &state, maxmatch, matching_self,
+                              raObj, decObj, MATCH_INDEX_INPUT);
+    if (!status) {
+        goto _domatch_exact_bail;
+    }
+
+    status = match_state_set_order(self, &state);
+    if (!status) {
+        goto _domatch_exact_bail;
+    }
+
+    ncat = state.cat.size;
+    offsets = calloc(ncat+1, sizeof(int64_t));
+    if (offsets == NULL) {
+        status=0;
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate match offsets");
+        goto _domatch_exact_bail;
+    }
+
+    t0 = now();
+    Py_BEGIN_ALLOW_THREADS
+    status = engine_count(&state.ctx, nthreads, &offsets[1]);
+    Py_END_ALLOW_THREADS
+    state.stats.time_search = now() - t0;
+
+    if (!status) {
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate matches");
+        goto _domatch_exact_bail;
+    }
+
+    for (i=0; i<ncat; i++) {
+        offsets[i+1] += offsets[i];
+    }
+
+    t0 = now();
+    nv.data = matchesObj;
+    nv.capacity = PyArray_SIZE(matchesObj);
+    status = np_match_vector_realloc(&nv, (npy_intp)offsets[ncat]);
+    state.stats.nresize = 1;
+    state.stats.time_resize = now() - t0;
+    if (!status) {
+        goto _domatch_exact_bail;
+    }
+
+    if (offsets[ncat] > 0) {
+        t0 = now();
+        Py_BEGIN_ALLOW_THREADS
+        status = engine_fill(&state.ctx, nthreads, offsets,
+                             (Match*) PyArray_DATA((PyArrayObject*)matchesObj));
+        Py_END_ALLOW_THREADS
+        state.stats.time_search += now() - t0;
+
+        if (!status) {
+            PyErr_SetString(PyExc_MemoryError, "Could not allocate matches");
+            goto _domatch_exact_bail;
+        }
+    }
+
+    self->nmatches = offsets[ncat];
+
+_domatch_exact_bail:
+
+    match_state_clear(self, &state);
+    free(offsets);
+
+    return status;
+}
+
+//
+// do the match for each entered point
+// all matches are saved in memory
+//
+// if exact is set, the matches are counted first and written into an output
+// of the right size; this is not used with the catalog index
+//
+
+static int domatch(struct PySMatchCat* self,
+                   int64_t maxmatch,
+                   int matching_self,
+                   PyObject* raObj,
+                   PyObject* decObj,
+                   PyObject* matchesObj,
+                   int index_catalog,
+                   int nthreads,
+                   int exact) {
+    int status=0;
+    double t0=0;
+    struct match_sink sink={{0}};
+
+    if (exact && !index_catalog) {
+        return domatch_exact(self, maxmatch, matching_self,
+                             raObj, decObj, matchesObj, nthreads);
+    }
+
+    sink.nv.data = matchesObj;
+    sink.nv.capacity = PyArray_SIZE(matchesObj);
+    sink.nv.size = 0;
+
+    status = domatch_engine(self, maxmatch, matching_self, raObj, decObj,
+                            index_catalog, 1, nthreads,
+                            push_matches, &sink);
+
+    // make sure final array has exactly the desired size
+    t0 = now();
+    if (status && sink.nv.capacity > sink.nv.size) {
+        status = np_match_vector_realloc(&sink.nv, sink.nv.size);
+    }
+    if (self->collect_stats) {
+        self->stats.time_finish = now() - t0;
+    }
+
+    return status;
+}
+
+//
+// match the "catalog" to another data set
+//
+
+static PyObject* PySMatchCat_match(struct PySMatchCat* self, PyObject *args)
+{
+    int status=0, index_catalog=0, nthreads=1, matching_self=0, exact=0;
+    PY_LONG_LONG maxmatch=0;
+    PyObject* raObj=NULL;
+    PyObject* decObj=NULL;
+
+    PyObject* matchesObj=NULL;
+
+    if (!PyArg_ParseTuple(args, (char*)"LiOOOiii",
+                          &maxmatch,
+                          &matching_self,
+                          &raObj,
+                          &decObj,
+                          &matchesObj,
+                          &index_catalog,
+                          &nthreads,
+                          &exact)) {
+        return NULL;
+    }
+
+    status=domatch(self,
+                   (int64_t)maxmatch,
+                   matching_self,
+                   raObj,
+                   decObj,
+                   matchesObj,
+                   index_catalog,
+                   nthreads,
+                   exact);
+
+    if (!status) {
+        return NULL;
+    } else {
+        Py_RETURN_NONE;
+    }
+}
+
+
+//
+// do matching while writing to a file
+//
+// when indexing the catalog without a limit on the number of matches, the
+// matches are written as they are found
+//
+// if binary is set the matches are written in the binary format described in
+// matchfile.h; the count in the header is filled in once the match is done
+//
+
+static int domatch2file(struct PySMatchCat* self,
+                        int64_t maxmatch,
+                        int matching_self,
+                        PyObject* raObj,
+                        PyObject* decObj,
+                        const char* filename,
+                        int index_catalog,
+                        int nthreads,
+                        int binary) {
+    int status=0;
+    double t0=0;
+    struct match_sink sink={{0}};
+
+    sink.fobj=fopen(filename, binary ? "wb" : "w");
+    if (sink.fobj == NULL) {
+        PyErr_Format(PyExc_IOError, "Could not open file for writing: '%s'", filename);
+        goto _domatch2file_bail;
+    }
+    setvbuf(sink.fobj, NULL, _IOFBF, MATCHFILE_BUFSIZE);
+
+    if (binary) {
+        // a negative count marks the file as incomplete
+        status = matchfile_write_header(sink.fobj, -1);
+        if (!status) {
+            goto _domatch2file_bail;
+        }
+    }
+
+    status = domatch_engine(self, maxmatch, matching_self, raObj, decObj,
+                            index_catalog, 0, nthreads,
+                            binary ? write_matches_binary : write_matches,
+                            &sink);
+
+    t0 = now();
+    if (status && binary) {
+        status = matchfile_set_nmatches(sink.fobj, sink.nmatches);
+    }
+
+_domatch2file_bail:
+
+    if (sink.fobj) {
+        if (fclose(sink.fobj) != 0) {
+            status=0;
+        }
+    }
+
+    // t0 is only set if the match was run
+    if (t0 > 0 && self->collect_stats) {
+        self->stats.time_finish = now() - t0;
+    }
+
+    if (!status && !PyErr_Occurred()) {
+        PyErr_Format(PyExc_IOError, "Error writing matches to file: '%s'", filename);
+    }
+
+    return status;
+}
+
+
+/*
+
+   do the matching and write to the indicated file
+
+*/
+static PyObject* PySMatchCat_match2file(struct PySMatchCat* self, PyObject *args)
+{
+    int status=0, index_catalog=0, nthreads=1, matching_self=0, binary=0;
+    PY_LONG_LONG maxmatch=0;
+    PyObject* raObj=NULL;
+    PyObject* decObj=NULL;
+    const char *filename=NULL;
+
+    if (!PyArg_ParseTuple(args, (char*)"LiOOsiii",
+                          &maxmatch,
+                          &matching_self,
+                          &raObj,
+                          &decObj,
+                          &filename,
+                          &index_catalog,
+                          &nthreads,
+                          &binary)) {
+        return NULL;
+    }
+
+    status=domatch2file(self,
+                        (int64_t)maxmatch,
+                        matching_self,
+                        raObj,
+                        decObj,
+                        filename,
+                        index_catalog,
+                        nthreads,
+                        binary);
+
+    if (!status) {
+        return NULL;
+    } else {
+        Py_RETURN_NONE;
+    }
+
+}
+
+/*
+   where the matches are sent when several inputs are indexed together.  The
+   points of input k are offsets[k] ... offsets[k+1]-1 of the combined
+   points, and the matches for each input are pushed onto its own numpy
+   array through its sink, with the input index relative to the input.
+
+   If maxmatch > 0 the engine keeps all matches, and only the closest
+   maxmatch for each input are kept here, sorted closest first with ties
+   going to the lower input index as for add_match.  entry_start and
+   entry_mark give where the matches of the current entry start in the
+   pending matches for each input, and touched the inputs it matched
+*/
+struct many_sink {
+    size_t ninputs;
+    const int64_t* offsets;
+    int64_t maxmatch;
+
+    struct match_sink* sinks;
+    match_vector** pending;
+
+    size_t* entry_start;
+    int64_t* entry_mark;
+    lvector* touched;
+
+    PyThreadState* thread_state;
+};
+
+//
+// the input holding the point with the index in the combined points
+//
+
+static size_t find_input(const struct many_sink* sink, int64_t ind)
+{
+    size_t lo=0, hi=sink->ninputs, mid=0;
+
+    // the last input starting at or before ind
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo)/2;
+        if (sink->offsets[mid] <= ind) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+//
+// order the matches closest first, ties by input index
+//
+
+static int compare_closest(const void* a, const void* b)
+{
+    const Match* ma=a;
+    const Match* mb=b;
+
+    if (ma->cosdist != mb->cosdist) {
+        return ma->cosdist > mb->cosdist ? -1 : 1;
+    }
+    return (ma->input_ind > mb->input_ind) - (ma->input_ind < mb->input_ind);
+}
+
+//
+// keep the closest maxmatch of the matches to the last entry for each input
+// it matched
+//
+
+static void select_many(struct many_sink* sink)
+{
+    size_t i=0, tag=0, start=0, n=0;
+    match_vector* pending=NULL;
+
+    for (i=0; i<vector_size(sink->touched); i++) {
+        tag = (size_t)sink->touched->data[i];
+        pending = sink->pending[tag];
+        start = sink->entry_start[tag];
+        n = vector_size(pending) - start;
+
+        if (n > 1) {
+            qsort(&pending->data[start], n, sizeof(Match), compare_closest);
+        }
+        if ((int64_t)n > sink->maxmatch) {
+            vector_resize(pending, start + (size_t)sink->maxmatch);
+        }
+    }
+    vector_resize(sink->touched, 0);
+}
+
+//
+// split the matches by input, then push them onto the array for each input
+//
+
+static int push_many_matches(void* data, const match_vector* matches)
+{
+    struct many_sink* sink=data;
+    struct match_sink* tsink=NULL;
+    size_t i=0, tag=0;
+    int64_t last=-1;
+    int status=1;
+    Match match;
+
+    for (i=0; i<vector_size(matches); i++) {
+        match = matches->data[i];
+
+        if (sink->maxmatch > 0 && match.cat_ind != last) {
+            select_many(sink);
+            last = match.cat_ind;
+        }
+
+        tag = find_input(sink, match.input_ind);
+        match.input_ind -= sink->offsets[tag];
+
+        if (sink->maxmatch > 0 && sink->entry_mark[tag] != match.cat_ind) {
+            sink->entry_mark[tag] = match.cat_ind;
+            sink->entry_start[tag] = vector_size(sink->pending[tag]);
+            vector_push(sink->touched, (int64_t)tag);
+        }
+        vector_push(sink->pending[tag], match);
+    }
+    if (sink->maxmatch > 0) {
+        select_many(sink);
+    }
+
+    // the matches for an entry all come in the same batch
+    for (tag=0; tag<sink->ninputs; tag++) {
+        if (vector_size(sink->pending[tag]) == 0) {
+            continue;
+        }
+
+        tsink = &sink->sinks[tag];
+        tsink->thread_state = sink->thread_state;
+        status = push_matches(tsink, sink->pending[tag]);
+        sink->thread_state = tsink->thread_state;
+        tsink->thread_state = NULL;
+
+        if (!status) {
+            return 0;
+        }
+        vector_resize(sink->pending[tag], 0);
+    }
+
+    return 1;
+}
+
+/*
+
+   match the catalog to several sets of points at once.  The sets are
+   indexed together, so each catalog entry is loaded and its disc pixels
+   found once for all of them.  The offsets, int64 with ninputs+1 elements,
+   give where each set starts in the combined ra,dec, and matchesList is a
+   list of ninputs match arrays, each resized to hold the matches for its
+   set.  The match runs with the GIL released
+
+*/
+
+static PyObject* PySMatchCat_match_many(struct PySMatchCat* self, PyObject *args)
+{
+    int status=0, nthreads=1;
+    PY_LONG_LONG maxmatch=0;
+    size_t ninputs=0, tag=0, n=0;
+    PyObject* raObj=NULL;
+    PyObject* decObj=NULL;
+    PyObject* offsetsObj=NULL;
+    PyObject* matchesList=NULL;
+    PyObject* matchesObj=NULL;
+    double t0=0;
+    struct match_state state;
+    struct many_sink sink={0};
+
+    if (!PyArg_ParseTuple(args, (char*)"LOOOOi",
+                          &maxmatch,
+                          &raObj,
+                          &decObj,
+                          &offsetsObj,
+                          &matchesList,
+                          &nthreads)) {
+        return NULL;
+    }
+
+    if (!PyList_Check(matchesList) || PyList_GET_SIZE(matchesList) < 1) {
+        PyErr_SetString(PyExc_ValueError,
+                        "matches must be a list with an array for each input");
+        return NULL;
+    }
+    ninputs = (size_t)PyList_GET_SIZE(matchesList);
+
+    if (!PyArray_Check(offsetsObj)
+            || PyArray_TYPE((PyArrayObject*)offsetsObj) != NPY_INT64
+            || !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)offsetsObj)
+            || (size_t)PyArray_SIZE((PyArrayObject*)offsetsObj) != ninputs+1) {
+        PyErr_SetString(PyExc_ValueError,
+                        "offsets must be a contiguous int64 array with an "
+                        "element for each input, and one more");
+        return NULL;
+    }
+    sink.offsets = (const int64_t*) PyArray_DATA((PyArrayObject*)offsetsObj);
+    sink.ninputs = ninputs;
+    sink.maxmatch = ninputs > 1 ? (int64_t)maxmatch : 0;
+
+    // with one input the engine can keep the closest itself
+    status = match_state_init(self, &state,
+                              ninputs > 1 ? 0 : (int64_t)maxmatch, 0,
+                              raObj, decObj, MATCH_INDEX_INPUT);
+    if (!status) {
+        goto _match_many_bail;
+    }
+
+    n = (size_t)PyArray_SIZE((PyArrayObject*)raObj);
+    if (sink.offsets[0] != 0 || sink.offsets[ninputs] != (int64_t)n) {
+        status = 0;
+        PyErr_SetString(PyExc_ValueError,
+                        "offsets must run from zero to the number of points");
+        goto _match_many_bail;
+    }
+
+    sink.sinks = calloc(ninputs, sizeof(struct match_sink));
+    sink.pending = calloc(ninputs, sizeof(match_vector*));
+    sink.entry_start = calloc(ninputs, sizeof(size_t));
+    sink.entry_mark = malloc(ninputs*sizeof(int64_t));
+    sink.touched = lvector_new();
+    if (sink.sinks == NULL || sink.pending == NULL
+            || sink.entry_start == NULL || sink.entry_mark == NULL
+            || sink.touched == NULL) {
+        status = 0;
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate matches");
+        goto _match_many_bail;
+    }
+
+    for (tag=0; tag<ninputs; tag++) {
+        matchesObj = PyList_GET_ITEM(matchesList, tag);
+        sink.sinks[tag].nv.data = matchesObj;
+        sink.sinks[tag].nv.capacity = PyArray_SIZE((PyArrayObject*)matchesObj);
+        sink.pending[tag] = match_vector_new();
+        sink.entry_mark[tag] = -1;
+        if (sink.pending[tag] == NULL) {
+            status = 0;
+            PyErr_SetString(PyExc_MemoryError, "Could not allocate matches");
+            goto _match_many_bail;
+        }
+    }
+
+    t0 = now();
+    sink.thread_state = PyEval_SaveThread();
+    status = engine_match(&state.ctx, nthreads, push_many_matches, &sink);
+    PyEval_RestoreThread(sink.thread_state);
+    sink.thread_state = NULL;
+    state.stats.time_search = now() - t0;
+
+    for (tag=0; tag<ninputs; tag++) {
+        state.stats.nresize += sink.sinks[tag].nresize;
+        state.stats.time_resize += sink.sinks[tag].time_resize;
+    }
+
+    if (!status) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_MemoryError, "Could not allocate matches");
+        }
+        goto _match_many_bail;
+    }
+
+    // make sure the final arrays have exactly the desired size
+    t0 = now();
+    self->nmatches = 0;
+    for (tag=0; tag<ninputs; tag++) {
+        if (sink.sinks[tag].nv.capacity > sink.sinks[tag].nv.size) {
+            status = np_match_vector_realloc(&sink.sinks[tag].nv,
+                                             sink.sinks[tag].nv.size);
+            if (!status) {
+                goto _match_many_bail;
+            }
+        }
+        self->nmatches += sink.sinks[tag].nmatches;
+    }
+    state.stats.time_finish = now() - t0;
+
+_match_many_bail:
+
+    match_state_clear(self, &state);
+
+    if (sink.pending) {
+        for (tag=0; tag<ninputs; tag++) {
+            vector_free(sink.pending[tag]);
+        }
+    }
+    free(sink.pending);
+    free(sink.sinks);
+    free(sink.entry_start);
+    free(sink.entry_mark);
+    vector_free(sink.touched);
+
+    if (!status) {
+        return NULL;
+    } else {
+        Py_RETURN_NONE;
+    }
+}
+
+/*
+
+   Count the matches for each catalog entry, up to maxmatch if it is > 0,
+   without keeping them.  The counts are written into countsObj, an int64
+   array with an element for each catalog entry, and the total is returned.
+
+   This shares the index and candidate kernels with engine_fill in the exact
+   match, and runs with the GIL released.
+
+*/
+
+static PyObject* PySMatchCat_count_matches(struct PySMatchCat* self, PyObject *args)
+{
+    int status=0, nthreads=1, matching_self=0;
+    PY_LONG_LONG maxmatch=0;
+    size_t i=0;
+    int64_t total=0;
+    int64_t* counts=NULL;
+    PyObject* raObj=NULL;
+    PyObject* decObj=NULL;
+    PyObject* countsObj=NULL;
+    double t0=0;
+    struct match_state state;
+
+    if (!PyArg_ParseTuple(args, (char*)"LiOOOi",
+                          &maxmatch,
+                          &matching_self,
+                          &raObj,
+                          &decObj,
+                          &countsObj,
+                          &nthreads)) {
+        return NULL;
+    }
+
+    if (!PyArray_Check(countsObj)
+            || PyArray_TYPE((PyArrayObject*)countsObj) != NPY_INT64
+            || !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)countsObj)
+            || (size_t)PyArray_SIZE((PyArrayObject*)countsObj) != self->cat->size) {
+        PyErr_SetString(PyExc_ValueError,
+                        "counts must be a contiguous int64 array with an "
+                        "element for each catalog entry");
+        return NULL;
+    }
+
+    status = match_state_init(self, &state, (int64_t)maxmatch, matching_self,
+                              raObj, decObj, MATCH_INDEX_INPUT);
+    if (!status) {
+        goto _count_matches_bail;
+    }
+
+    status = match_state_set_order(self, &state);
+    if (!status) {
+        goto _count_matches_bail;
+    }
+
+    counts = (int64_t*) PyArray_DATA((PyArrayObject*)countsObj);
+
+    t0 = now();
+    Py_BEGIN_ALLOW_THREADS
+    status = engine_count(&state.ctx, nthreads, counts);
+    Py_END_ALLOW_THREADS
+    state.stats.time_search = now() - t0;
+
+    if (!status) {
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate matches");
+        goto _count_matches_bail;
+    }
+
+    for (i=0; i<state.cat.size; i++) {
+        total += counts[i];
+    }
+
+    self->nmatches = total;
+
+_count_matches_bail:
+
+    match_state_clear(self, &state);
+
+    if (!status) {
+        return NULL;
+    } else {
+        return PyLong_FromLongLong((PY_LONG_LONG)total);
+    }
+}
+
+
+//
+// the data of an optional float64 weights array with n elements, NULL for
+// None
+//
+
+static int get_weights_data(PyObject* weightsObj, const char* name,
+                            size_t n, const double** data)
+{
+    *data = NULL;
+    if (weightsObj == Py_None) {
+        return 1;
+    }
+
+    if (!get_array_data(weightsObj, name, data)) {
+        return 0;
+    }
+    if ((size_t)PyArray_SIZE((PyArrayObject*)weightsObj) != n) {
+        PyErr_Format(PyExc_ValueError,
+                     "%s must have %lu elements", name, (unsigned long)n);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+
+   Count the pairs of the catalog and the input points in bins of
+   separation, without keeping the matches.  The edges are in degrees,
+   increasing, the last being the catalog radius, which is checked on the
+   python side, and the counts for the bins are written into countsObj, an
+   int64 array without weights and a float64 array otherwise.  The weights
+   are None or float64 arrays, for the catalog and the input points.
+
+   This runs with the GIL released.
+
+*/
+
+static PyObject* PySMatchCat_pair_counts(struct PySMatchCat* self, PyObject *args)
+{
+    int status=0, nthreads=1, matching_self=0;
+    size_t i=0, nbins=0;
+    const double *edges=NULL, *w1=NULL, *w2=NULL;
+    double* cos_edges=NULL;
+    int weighted=0, counts_type=NPY_INT64;
+    PyObject* raObj=NULL;
+    PyObject* decObj=NULL;
+    PyObject* edgesObj=NULL;
+    PyObject* w1Obj=NULL;
+    PyObject* w2Obj=NULL;
+    PyObject* countsObj=NULL;
+    double t0=0;
+    struct match_state state;
+
+    if (!PyArg_ParseTuple(args, (char*)"iOOOOOOi",
+                          &matching_self,
+                          &raObj,
+                          &decObj,
+                          &edgesObj,
+                          &w1Obj,
+                          &w2Obj,
+                          &countsObj,
+                          &nthreads)) {
+        return NULL;
+    }
+
+    if (!get_array_data(edgesObj, "edges", &edges)) {
+        return NULL;
+    }
+    nbins = (size_t)PyArray_SIZE((PyArrayObject*)edgesObj);
+    if (nbins < 2) {
+        PyErr_SetString(PyExc_ValueError, "need at least two bin edges");
+        return NULL;
+    }
+    nbins -= 1;
+
+    weighted = w1Obj != Py_None || w2Obj != Py_None;
+    if (weighted) {
+        counts_type = NPY_FLOAT64;
+    }
+    if (!PyArray_Check(countsObj)
+            || PyArray_TYPE((PyArrayObject*)countsObj) != counts_type
+            || !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)countsObj)
+            || (size_t)PyArray_SIZE((PyArrayObject*)countsObj) != nbins) {
+        PyErr_Format(PyExc_ValueError,
+                     "counts must be a contiguous %s array with an element "
+                     "for each bin", weighted ? "float64" : "int64");
+        return NULL;
+    }
+
+    status = match_state_init(self, &state, 0, matching_self,
+                              raObj, decObj, MATCH_INDEX_INPUT);
+    if (!status) {
+        goto _pair_counts_bail;
+    }
+
+    status = get_weights_data(w1Obj, "catalog weights", state.cat.size, &w1)
+        && get_weights_data(w2Obj, "weights", state.ctx.npoints, &w2);
+    if (!status) {
+        goto _pair_counts_bail;
+    }
+
+    cos_edges = malloc((nbins+1)*sizeof(double));
+    if (cos_edges == NULL) {
+        status = 0;
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate bin edges");
+        goto _pair_counts_bail;
+    }
+
+    // the same as the cosine of the catalog radius, see cat_fill_point
+    for (i=0; i<=nbins; i++) {
+        cos_edges[i] = cos(edges[i]*D2R);
+    }
+
+    t0 = now();
+    Py_BEGIN_ALLOW_THREADS
+    if (weighted) {
+        status = engine_pair_counts(&state.ctx, nthreads, cos_edges, nbins,
+                                    w1, w2, NULL,
+                                    (double*) PyArray_DATA((PyArrayObject*)countsObj));
+    } else {
+        status = engine_pair_counts(&state.ctx, nthreads, cos_edges, nbins,
+                                    NULL, NULL,
+                                    (int64_t*) PyArray_DATA((PyArrayObject*)countsObj),
+                                    NULL);
+    }
+    Py_END_ALLOW_THREADS
+    state.stats.time_search = now() - t0;
+
+    if (!status) {
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate pair counts");
+    }
+
+_pair_counts_bail:
+
+    match_state_clear(self, &state);
+    free(cos_edges);
+
+    if (!status) {
+        return NULL;
+    } else {
+        Py_RETURN_NONE;
+    }
+}
+
+//
+// link the points of each match in the forest for a friends-of-friends
+//
+
+static int link_matches(void* data, const match_vector* matches)
+{
+    int64_t* forest=data;
+    size_t i=0;
+
+    for (i=0; i<vector_size(matches); i++) {
+        unionfind_union(forest,
+                        matches->data[i].cat_ind,
+                        matches->data[i].input_ind);
+    }
+    return 1;
+}
+
+/*
+
+   Group the catalog by friends-of-friends: points within the radius of each
+   other are linked, and the groups are the sets of linked points.  The
+   radius must be the same for all entries, which is checked on the python
+   side.
+
+   The pairs are found once each, as for unique pairs, and linked in a
+   disjoint set forest as they come from the engine, so the pairs are never
+   all held in memory.  The forest is held in groupsObj, an int64 array with
+   an element for each entry, which is replaced by the group of each entry;
+   see unionfind_label.  The number of groups is returned.
+
+*/
+
+static PyObject* PySMatchCat_friends_of_friends(struct PySMatchCat* self, PyObject *args)
+{
+    int status=0, nthreads=1;
+    PY_LONG_LONG min_size=1;
+    size_t ngroups=0;
+    int64_t* forest=NULL;
+    PyObject* groupsObj=NULL;
+    double t0=0;
+    struct match_state state;
+
+    if (!PyArg_ParseTuple(args, (char*)"LOi",
+                          &min_size,
+                          &groupsObj,
+                          &nthreads)) {
+        return NULL;
+    }
+
+    if (!PyArray_Check(groupsObj)
+            || PyArray_TYPE((PyArrayObject*)groupsObj) != NPY_INT64
+            || !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)groupsObj)
+            || (size_t)PyArray_SIZE((PyArrayObject*)groupsObj) != self->cat->size) {
+        PyErr_SetString(PyExc_ValueError,
+                        "groups must be a contiguous int64 array with an "
+                        "element for each catalog entry");
+        return NULL;
+    }
+
+    status = match_state_init(self, &state, 0, MATCH_SELF_UNIQUE,
+                              self->raObj, self->decObj, MATCH_INDEX_INPUT);
+    if (!status) {
+        goto _friends_of_friends_bail;
+    }
+
+    forest = (int64_t*) PyArray_DATA((PyArrayObject*)groupsObj);
+
+    t0 = now();
+    Py_BEGIN_ALLOW_THREADS
+    unionfind_init(forest, state.cat.size);
+    status = engine_match(&state.ctx, nthreads, link_matches, forest);
+    if (status) {
+        ngroups = unionfind_label(forest, state.cat.size, (int64_t)min_size);
+    }
+    Py_END_ALLOW_THREADS
+    state.stats.time_search = now() - t0;
+
+    if (!status) {
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate matches");
+    }
+
+_friends_of_friends_bail:
+
+    match_state_clear(self, &state);
+
+    if (!status) {
+        return NULL;
+    } else {
+        return PyLong_FromSize_t(ngroups);
+    }
+}
+
+/*
+
+   find the k nearest of the input points to each catalog entry, within
+   maxdist radians if maxdist > 0.  The matches are put in the array, which
+   is resized to fit.  The search runs with the GIL released
+
+*/
+
+static PyObject* PySMatchCat_knn(struct PySMatchCat* self, PyObject *args)
+{
+    int status=0, nthreads=1, matching_self=0;
+    PY_LONG_LONG k=0;
+    double maxdist=0;
+    PyObject* raObj=NULL;
+    PyObject* decObj=NULL;
+    PyObject* matchesObj=NULL;
+    struct match_sink sink={{0}};
+    double t0=0;
+    struct match_state state;
+
+    if (!PyArg_ParseTuple(args, (char*)"LiOOdOi",
+                          &k,
+                          &matching_self,
+                          &raObj,
+                          &decObj,
+                          &maxdist,
+                          &matchesObj,
+                          &nthreads)) {
+        return NULL;
+    }
+
+    if (k < 1) {
+        PyErr_SetString(PyExc_ValueError, "k must be at least 1");
+        return NULL;
+    }
+
+    status = match_state_init(self, &state, (int64_t)k, matching_self,
+                              raObj, decObj, MATCH_KNN);
+    if (!status) {
+        goto _knn_bail;
+    }
+
+    sink.nv.data = matchesObj;
+    sink.nv.capacity = PyArray_SIZE(matchesObj);
+    sink.nv.size = 0;
+
+    t0 = now();
+    sink.thread_state = PyEval_SaveThread();
+    status = engine_knn(&state.ctx, maxdist, nthreads, push_matches, &sink);
+    PyEval_RestoreThread(sink.thread_state);
+    sink.thread_state = NULL;
+
+    state.stats.time_search = now() - t0;
+    state.stats.nresize = sink.nresize;
+    state.stats.time_resize = sink.time_resize;
+
+    if (!status) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_MemoryError, "Could not allocate matches");
+        }
+        goto _knn_bail;
+    }
+
+    self->nmatches = sink.nmatches;
+
+    // make sure final array has exactly the desired size
+    if (sink.nv.capacity > sink.nv.size) {
+        status = np_match_vector_realloc(&sink.nv, sink.nv.size);
+    }
+
+_knn_bail:
+
+    match_state_clear(self, &state);
+
+    if (!status) {
+        return NULL;
+    } else {
+        Py_RETURN_NONE;
+    }
+}
+
+/*
+
+   An iterator over the matches, for processing them in batches with bounded
+   memory.  The index and other state for the match are kept between batches,
+   and the catalog entries are matched a window at a time as more matches are
+   needed.
+
+   The catalog is marked as active while the iterator exists, so it cannot be
+   re-initialized.
+
+*/
+
+struct PyMatchIter {
+    PyObject_HEAD
+
+    // we hold references to these, the match state points into them
+    struct PySMatchCat* catObj;
+    PyObject* raObj;
+    PyObject* decObj;
+
+    int initialized;
+    struct match_state state;
+    int nthreads;
+
+    // the next catalog entry to match
+    size_t next_entry;
+
+    // matches found but not yet sent, starting at pending_start
+    match_vector* pending;
+    size_t pending_start;
+
+    // set while filling, when the GIL is released
+    int busy;
+};
+
+static int append_pending(void* data, const match_vector* matches)
+{
+    match_vector* pending=data;
+    size_t i=0;
+
+    for (i=0; i<vector_size(matches); i++) {
+        vector_push(pending, matches->data[i]);
+    }
+    return 1;
+}
+
+//
+// move the pending matches to the front of the vector
+//
+
+static void compact_pending(struct PyMatchIter* self)
+{
+    size_t nleft=0;
+    match_vector* pending=self->pending;
+
+    if (self->pending_start == 0) {
+        return;
+    }
+
+    nleft = vector_size(pending) - self->pending_start;
+    if (nleft > 0) {
+        memmove(pending->data,
+                &pending->data[self->pending_start],
+                nleft*sizeof(Match));
+    }
+    vector_resize(pending, nleft);
+    self->pending_start = 0;
+}
+
+//
+// fill the array with up to its size matches.  Returns the number filled,
+// zero when there are no more
+//
+
+static PyObject* PyMatchIter_fill(struct PyMatchIter* self, PyObject *args)
+{
+    int status=1;
+    PyObject* arrObj=NULL;
+    size_t nfill=0, navail=0, ncat=0, end=0;
+
+    if (!PyArg_ParseTuple(args, (char*)"O", &arrObj)) {
+        return NULL;
+    }
+
+    if (!self->initialized) {
+        PyErr_SetString(PyExc_RuntimeError, "iterator is not initialized");
+        return NULL;
+    }
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "iterator is already being filled");
+        return NULL;
+    }
+
+    if (!PyArray_Check(arrObj)
+            || !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)arrObj)
+            || PyArray_ITEMSIZE((PyArrayObject*)arrObj) != sizeof(Match)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "matches must be a contiguous array of the match dtype");
+        return NULL;
+    }
+
+    nfill = (size_t)PyArray_SIZE((PyArrayObject*)arrObj);
+    ncat = self->state.cat.size;
+
+    self->busy=1;
+
+    while (vector_size(self->pending) - self->pending_start < nfill
+            && self->next_entry < ncat) {
+
+        compact_pending(self);
+
+        end = self->next_entry + ENGINE_WINDOW_SIZE(self->nthreads);
+        if (end > ncat) {
+            end = ncat;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        status = engine_match_range(&self->state.ctx,
+                                    self->next_entry,
+                                    end,
+                                    self->nthreads,
+                                    append_pending,
+                                    self->pending);
+        Py_END_ALLOW_THREADS
+
+        if (!status) {
+            break;
+        }
+        self->next_entry = end;
+    }
+
+    self->busy=0;
+
+    if (!status) {
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate matches");
+        return NULL;
+    }
+
+    navail = vector_size(self->pending) - self->pending_start;
+    if (nfill > navail) {
+        nfill = navail;
+    }
+
+    if (nfill > 0) {
+        memcpy(PyArray_DATA((PyArrayObject*)arrObj),
+               &self->pending->data[self->pending_start],
+               nfill*sizeof(Match));
+        self->pending_start += nfill;
+    }
+
+    return Py_BuildValue("n", (Py_ssize_t)nfill);
+}
+
+static void
+PyMatchIter_dealloc(struct PyMatchIter* self)
+{
+    if (self->initialized) {
+        match_state_clear(self->catObj, &self->state);
+    }
+    vector_free(self->pending);
+
+    Py_XDECREF(self->catObj);
+    Py_XDECREF(self->raObj);
+    Py_XDECREF(self->decObj);
+
+#if PY_MAJOR_VERSION >= 3
+    Py_TYPE(self)->tp_free((PyObject*)self);
+#else
+    self->ob_type->tp_free((PyObject*)self);
+#endif
+}
 
-    tree = tree_delete(tree);
-    vector_free(points);
-    cat_entry_free(entry);
+static PyMethodDef PyMatchIter_methods[] = {
+    {"fill",              (PyCFunction)PyMatchIter_fill,          METH_VARARGS,  "Fill the array with the next matches, returning the number filled."},
+    {NULL}  /* Sentinel */
+};
 
-    return status;
-}
+static PyTypeObject PyMatchIterType = {
+#if PY_MAJOR_VERSION >= 3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+#endif
+    "_smatch.MatchIterator",             /*tp_name*/
+    sizeof(struct PyMatchIter), /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PyMatchIter_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Iterator over matches, created by Catalog.iter_matches",           /* tp_doc */
+    0,                     /* tp_traverse */
+    0,                     /* tp_clear */
+    0,                     /* tp_richcompare */
+    0,                     /* tp_weaklistoffset */
+    0,                     /* tp_iter */
+    0,                     /* tp_iternext */
+    PyMatchIter_methods,             /* tp_methods */
+};
 
 //
-// match the "catalog" to another data set
+// create an iterator over the matches
 //
 
-static PyObject* PySMatchCat_match(struct PySMatchCat* self, PyObject *args)
+static PyObject* PySMatchCat_iter_matches(struct PySMatchCat* self, PyObject *args)
 {
-    int status=0;
-    PyObject* craObj=NULL;
-    PyObject* cdecObj=NULL;
-    PyObject* cradiusObj=NULL;
+    int status=0, matching_self=0, nthreads=1;
+    PY_LONG_LONG maxmatch=0;
     PyObject* raObj=NULL;
     PyObject* decObj=NULL;
+    struct PyMatchIter* iter=NULL;
 
-    PyObject* matchesObj=NULL;
-
-    if (!PyArg_ParseTuple(args, (char*)"LiOOOOOO",
-                          &self->maxmatch,
-                          &self->matching_self,
-                          &craObj,
-                          &cdecObj,
-                          &cradiusObj,
+    if (!PyArg_ParseTuple(args, (char*)"LiOOi",
+                          &maxmatch,
+                          &matching_self,
                           &raObj,
                           &decObj,
-                          &matchesObj)) {
+                          &nthreads)) {
         return NULL;
     }
 
-    status=domatch(self,
-                   craObj,
-                   cdecObj,
-                   cradiusObj,
-                   raObj,
-                   decObj,
-                   matchesObj);
+    iter = (struct PyMatchIter*) PyMatchIterType.tp_alloc(&PyMatchIterType, 0);
+    if (iter == NULL) {
+        return NULL;
+    }
 
+    Py_INCREF(self);
+    Py_INCREF(raObj);
+    Py_INCREF(decObj);
+    iter->catObj = self;
+    iter->raObj = raObj;
+    iter->decObj = decObj;
+    iter->nthreads = nthreads < 1 ? 1 : nthreads;
+
+    iter->pending = match_vector_new();
+    if (iter->pending == NULL) {
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate matches");
+        goto _iter_matches_bail;
+    }
+
+    status = match_state_init(self, &iter->state, (int64_t)maxmatch,
+                              matching_self, raObj, decObj, MATCH_INDEX_INPUT);
+    iter->initialized=1;
+
+_iter_matches_bail:
     if (!status) {
+        Py_DECREF(iter);
         return NULL;
-    } else {
-        Py_RETURN_NONE;
     }
+    return (PyObject*) iter;
 }
 
-
 //
-// write from a match vector to a file
+// copy n elements of the data into a new array of the type; returns NULL
+// with the python error set on failure
 //
 
-static int write_matches(match_vector* matches, FILE *fobj)
+static PyObject* copy_to_array(const void* data, size_t n, int typenum)
 {
-    size_t i=0;
-    Match* match=NULL;
-    int status=0, nret=0;
-
-    for (i=0; i<vector_size(matches); i++) {
-
-        match = &vector_get(matches, i);
-        nret = fprintf(fobj, "%ld %ld %.16g\n",
-                       match->cat_ind, match->input_ind, match->cosdist);
-        if (nret == 0) {
-            status=0;
-            goto _write_matches_bail;
-        }
-
+    npy_intp dims[1];
+    PyObject* arrObj=NULL;
+
+    dims[0] = (npy_intp)n;
+    arrObj = PyArray_SimpleNew(1, dims, typenum);
+    if (arrObj != NULL && n > 0) {
+        memcpy(PyArray_DATA((PyArrayObject*)arrObj), data,
+               n*PyArray_ITEMSIZE((PyArrayObject*)arrObj));
     }
-
-    status=1;
-
-_write_matches_bail:
-    return status;
+    return arrObj;
 }
 
-//
-// do matching while writing to a file
-//
+/*
 
-static int domatch2file(struct PySMatchCat* self,
-                        PyObject* craObj,
-                        PyObject* cdecObj,
-                        PyObject* cradiusObj,
-                        PyObject* raObj,
-                        PyObject* decObj,
-                        const char* filename) {
-    int status=0;
-    size_t i=0, nrad=0, ncat=0;
-    struct tree_node* tree=NULL;
-    point_vector* points=NULL;
+   Get copies of the cached catalog points, disc pixels, and the index and
+   points over the catalog itself, building them if needed, for saving the
+   index.  The catalog must be cached.
 
-    double cra=0, cdec=0, crad=0;
-    CatalogEntry *entry=NULL;
+   Returns the tuple (points, disc_offsets, disc_ranges, pixels, offsets,
+   indices, x, y, z) as taken by _set_index
 
-    FILE* fobj=NULL;
+*/
 
-    fobj=fopen(filename, "w");
-    if (fobj == NULL) {
-        PyErr_Format(PyExc_IOError, "Could not open file for writing: '%s'", filename);
-        goto _domatch2file_bail;
+static PyObject* PySMatchCat_get_index(struct PySMatchCat* self)
+{
+    int status=0, owned=0, typenum=NPY_FLOAT64;
+    size_t n=0;
+    const Catalog* cat=self->cat;
+    struct pixindex* index=NULL;
+    struct soa_points* points=NULL;
+    PyObject* arrays[9]={NULL};
+    PyObject* result=NULL;
+
+    if (!self->use_cache) {
+        PyErr_SetString(PyExc_ValueError,
+                        "the index is only kept for a cached catalog");
+        return NULL;
     }
 
-    ncat=(size_t)PyArray_SIZE(craObj);
-    nrad=(size_t)PyArray_SIZE(cradiusObj);
+    self->nactive++;
 
-    tree = create_hpix_tree(self->hpix, raObj, decObj, &status);
+    status = prepare_catalog(self, 1);
     if (!status) {
-        goto _domatch2file_bail;
+        goto _get_index_bail;
     }
-
-    points = make_points(raObj, decObj, &status);
+    status = get_input_index(self, 1, cat->ra, cat->dec, cat->size,
+                             &index, &points, &owned);
     if (!status) {
-        goto _domatch2file_bail;
+        goto _get_index_bail;
     }
 
-    entry = cat_entry_new();
-
-    self->nmatches=0;
-    status=1;
-
-    for (i=0; i< ncat ; i++) {
+    n = cat->size;
+    arrays[0] = copy_to_array(cat->points, 5*n, NPY_FLOAT64);
+    arrays[1] = copy_to_array(cat->disc_offsets, n+1, NPY_UINT64);
+    arrays[2] = copy_to_array(cat->disc_ranges->data,
+                              vector_size(cat->disc_ranges), NPY_INT64);
+    arrays[3] = copy_to_array(index->pixels, index->npix, NPY_INT64);
+    arrays[4] = copy_to_array(index->offsets, index->npix+1, NPY_UINT64);
+    arrays[5] = copy_to_array(index->indices, index->npoints, NPY_INT64);
+    if (points->x) {
+        arrays[6] = copy_to_array(points->x, n, typenum);
+        arrays[7] = copy_to_array(points->y, n, typenum);
+        arrays[8] = copy_to_array(points->z, n, typenum);
+    } else {
+        typenum = NPY_FLOAT32;
+        arrays[6] = copy_to_array(points->xf, n, typenum);
+        arrays[7] = copy_to_array(points->yf, n, typenum);
+        arrays[8] = copy_to_array(points->zf, n, typenum);
+    }
 
-        cra = *(double *)PyArray_GETPTR1(craObj,i);
-        cdec = *(double *)PyArray_GETPTR1(cdecObj,i);
-        if (nrad==1) {
-            crad = *(double *)PyArray_GETPTR1(cradiusObj,0);
-        } else {
-            crad = *(double *)PyArray_GETPTR1(cradiusObj,i);
+    status = !PyErr_Occurred();
+    if (status) {
+        result = Py_BuildValue("NNNNNNNNN",
+                               arrays[0], arrays[1], arrays[2],
+                               arrays[3], arrays[4], arrays[5],
+                               arrays[6], arrays[7], arrays[8]);
+    } else {
+        for (n=0; n<9; n++) {
+            Py_XDECREF(arrays[n]);
         }
+    }
 
-        fill_catalog_entry(entry, self->hpix, cra, cdec, crad);
-
-        if (self->maxmatch > 0) {
+_get_index_bail:
+    self->nactive--;
+    return result;
+}
 
-            domatch1(self, entry, i, tree, points);
+//
+// get the data for an array of the type with the given number of
+// elements, for _set_index
+//
 
-            if (vector_size(entry->matches) > 0) {
-                status = write_matches(entry->matches, fobj);
-            }
+static int get_index_array(PyObject* arrObj,
+                           const char* name,
+                           int typenum,
+                           size_t n,
+                           void** data)
+{
+    if (!PyArray_Check(arrObj)
+            || PyArray_TYPE((PyArrayObject*)arrObj) != typenum
+            || !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)arrObj)
+            || (size_t)PyArray_SIZE((PyArrayObject*)arrObj) != n) {
+        PyErr_Format(PyExc_ValueError,
+                     "index %s must be a contiguous array of %s with %zu "
+                     "elements",
+                     name,
+                     typenum == NPY_FLOAT32 ? "float32"
+                     : typenum == NPY_FLOAT64 ? "float64"
+                     : typenum == NPY_UINT64 ? "uint64" : "int64",
+                     n);
+        return 0;
+    }
 
-        } else {
-            status = domatch1_2file_all(self, entry, i, tree, points, fobj);
-        }
+    *data = PyArray_DATA((PyArrayObject*)arrObj);
+    return 1;
+}
 
+/*
 
-        if (!status) {
-            goto _domatch2file_bail;
-        }
+   Use the arrays from _get_index as the cached data, usually views of a
+   file mapped into memory by load_index, so nothing is built for the
+   matches.  The arrays are only read, and references are held until the
+   cache is cleared; only the structs pointing into them are allocated.
 
-    }
+   The sizes and the ends of the offsets are checked, but not the contents,
+   so the arrays must come from _get_index for a catalog with the same
+   ra, dec, radius, nside, multires and float32.
 
-_domatch2file_bail:
+*/
 
-    if (fobj) {
-        fclose(fobj);
+static PyObject* PySMatchCat_set_index(struct PySMatchCat* self, PyObject *args)
+{
+    int typenum=NPY_FLOAT64;
+    size_t n=0, npix=0, nranges=0;
+    PyObject* arrObjs[9]={NULL};
+    void* data[9]={NULL};
+    const size_t* disc_offsets=NULL;
+    const size_t* offsets=NULL;
+    lvector* disc_ranges=NULL;
+    struct pixindex* index=NULL;
+    struct soa_points* points=NULL;
+
+    if (!PyArg_ParseTuple(args, (char*)"OOOOOOOOO",
+                          &arrObjs[0], &arrObjs[1], &arrObjs[2],
+                          &arrObjs[3], &arrObjs[4], &arrObjs[5],
+                          &arrObjs[6], &arrObjs[7], &arrObjs[8])) {
+        return NULL;
     }
 
-    tree = tree_delete(tree);
-    vector_free(points);
-    cat_entry_free(entry);
-
-    return status;
-}
-
+    if (self->nactive > 0) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Cannot set the index while the catalog is being matched");
+        return NULL;
+    }
+    if (!self->use_cache) {
+        PyErr_SetString(PyExc_ValueError,
+                        "the index is only kept for a cached catalog");
+        return NULL;
+    }
+    // the offsets are held as size_t
+    if (sizeof(size_t) != sizeof(uint64_t)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "loading an index needs a 64 bit size_t");
+        return NULL;
+    }
 
-/*
+    n = self->cat->size;
+    if (!get_index_array(arrObjs[0], "points", NPY_FLOAT64, 5*n, &data[0])
+            || !get_index_array(arrObjs[1], "disc offsets", NPY_UINT64, n+1, &data[1])) {
+        return NULL;
+    }
+    disc_offsets = data[1];
+    nranges = disc_offsets[n];
+    if (disc_offsets[0] != 0 || nranges % 2 != 0) {
+        PyErr_SetString(PyExc_ValueError, "bad index disc offsets");
+        return NULL;
+    }
+    if (!get_index_array(arrObjs[2], "disc ranges", NPY_INT64, nranges, &data[2])) {
+        return NULL;
+    }
 
-   do the matching and write to the indicated file
+    if (!PyArray_Check(arrObjs[3])) {
+        PyErr_SetString(PyExc_ValueError, "index pixels must be an array");
+        return NULL;
+    }
+    npix = (size_t)PyArray_SIZE((PyArrayObject*)arrObjs[3]);
+    if (!get_index_array(arrObjs[3], "pixels", NPY_INT64, npix, &data[3])
+            || !get_index_array(arrObjs[4], "offsets", NPY_UINT64, npix+1, &data[4])
+            || !get_index_array(arrObjs[5], "indices", NPY_INT64, n, &data[5])) {
+        return NULL;
+    }
+    offsets = data[4];
+    if (offsets[0] != 0 || offsets[npix] != n) {
+        PyErr_SetString(PyExc_ValueError, "bad index offsets");
+        return NULL;
+    }
 
-*/
-static PyObject* PySMatchCat_match2file(struct PySMatchCat* self, PyObject *args)
-{
-    int status=0;
-    PyObject* craObj=NULL;
-    PyObject* cdecObj=NULL;
-    PyObject* cradiusObj=NULL;
-    PyObject* raObj=NULL;
-    PyObject* decObj=NULL;
-    const char *filename=NULL;
+    if (self->single) {
+        typenum = NPY_FLOAT32;
+    }
+    if (!get_index_array(arrObjs[6], "x", typenum, n, &data[6])
+            || !get_index_array(arrObjs[7], "y", typenum, n, &data[7])
+            || !get_index_array(arrObjs[8], "z", typenum, n, &data[8])) {
+        return NULL;
+    }
 
-    if (!PyArg_ParseTuple(args, (char*)"LiOOOOOs",
-                          &self->maxmatch,
-                          &self->matching_self,
-                          &craObj,
-                          &cdecObj,
-                          &cradiusObj,
-                          &raObj,
-                          &decObj,
-                          &filename)) {
+    disc_ranges = calloc(1, sizeof(lvector));
+    index = calloc(1, sizeof(struct pixindex));
+    points = calloc(1, sizeof(struct soa_points));
+    if (disc_ranges == NULL || index == NULL || points == NULL) {
+        free(disc_ranges);
+        free(index);
+        free(points);
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate index");
         return NULL;
     }
 
-    status=domatch2file(self,
-                        craObj,
-                        cdecObj,
-                        cradiusObj,
-                        raObj,
-                        decObj,
-                        filename);
+    clear_catalog_cache(self);
 
-    if (!status) {
+    self->loadedObj = PyTuple_Pack(9, arrObjs[0], arrObjs[1], arrObjs[2],
+                                   arrObjs[3], arrObjs[4], arrObjs[5],
+                                   arrObjs[6], arrObjs[7], arrObjs[8]);
+    if (self->loadedObj == NULL) {
+        free(disc_ranges);
+        free(index);
+        free(points);
         return NULL;
+    }
+
+    disc_ranges->size = nranges;
+    disc_ranges->capacity = nranges;
+    disc_ranges->data = data[2];
+    self->cat->points = data[0];
+    self->cat->disc_offsets = data[1];
+    self->cat->disc_ranges = disc_ranges;
+
+    index->npix = npix;
+    index->npoints = n;
+    index->pixels = data[3];
+    index->offsets = data[4];
+    index->indices = data[5];
+    self->self_index = index;
+
+    points->size = n;
+    if (self->single) {
+        points->xf = data[6];
+        points->yf = data[7];
+        points->zf = data[8];
     } else {
-        Py_RETURN_NONE;
+        points->x = data[6];
+        points->y = data[7];
+        points->z = data[8];
     }
+    self->self_points = points;
 
+    Py_RETURN_NONE;
 }
 
 //
@@ -918,9 +2770,20 @@ _load_matches_bail:
 static PyMethodDef PySMatchCat_methods[] = {
     {"get_nmatches",           (PyCFunction)PySMatchCat_nmatches,          METH_VARARGS,  "Get the number of matches."},
     {"get_hpix_nside",              (PyCFunction)PySMatchCat_hpix_nside,          METH_VARARGS,  "Get the nside for healpix."},
+    {"get_nlevels",              (PyCFunction)PySMatchCat_nlevels,          METH_VARARGS,  "Get the number of resolution levels used for matching."},
     {"get_hpix_area",              (PyCFunction)PySMatchCat_hpix_area,          METH_VARARGS,  "Get the nside for healpix."},
+    {"get_cache_nbytes",       (PyCFunction)PySMatchCat_cache_nbytes,       METH_VARARGS,  "Get the memory used by the cached catalog data in bytes."},
+    {"get_stats",              (PyCFunction)PySMatchCat_get_stats,          METH_NOARGS,  "Get the counts and times for the last match, or None if not collected."},
     {"match",              (PyCFunction)PySMatchCat_match,          METH_VARARGS,  "Match the catalog to the input ra,dec arrays."},
     {"match2file",              (PyCFunction)PySMatchCat_match2file,          METH_VARARGS,  "Match the catalog to the input ra,dec arrays and write results to a file."},
+    {"match_many",              (PyCFunction)PySMatchCat_match_many,          METH_VARARGS,  "Match the catalog to several sets of ra,dec arrays in one pass."},
+    {"count_matches",              (PyCFunction)PySMatchCat_count_matches,          METH_VARARGS,  "Count the matches of the catalog to the input ra,dec arrays for each catalog entry."},
+    {"pair_counts",              (PyCFunction)PySMatchCat_pair_counts,          METH_VARARGS,  "Count the pairs of the catalog and the input ra,dec arrays in bins of separation."},
+    {"friends_of_friends",              (PyCFunction)PySMatchCat_friends_of_friends,          METH_VARARGS,  "Group the catalog by friends-of-friends within the catalog radius."},
+    {"knn",              (PyCFunction)PySMatchCat_knn,          METH_VARARGS,  "Find the nearest of the input ra,dec to each catalog point."},
+    {"_get_index",              (PyCFunction)PySMatchCat_get_index,          METH_NOARGS,  "Get copies of the cached catalog data and the index over the catalog."},
+    {"_set_index",              (PyCFunction)PySMatchCat_set_index,          METH_VARARGS,  "Use the arrays as the cached catalog data and the index over the catalog."},
+    {"iter_matches",              (PyCFunction)PySMatchCat_iter_matches,          METH_VARARGS,  "Get an iterator over matches of the catalog to the input ra,dec arrays."},
     {NULL}  /* Sentinel */
 };
 
@@ -980,9 +2843,211 @@ static PyTypeObject PyCatalogType = {
 
 
 
+//
+// get the name of the candidate kernel in use
+//
+
+static PyObject *
+PySMatch_kernel_name(PyObject* self, PyObject* args)
+{
+    return Py_BuildValue("s", kernel_name());
+}
+
+//
+// check if the named candidate kernel is supported by this cpu
+//
+
+static PyObject *
+PySMatch_kernel_supported(PyObject* self, PyObject* args)
+{
+    const char *name=NULL;
+
+    if (!PyArg_ParseTuple(args, (char*)"s", &name)) {
+        return NULL;
+    }
+
+    return Py_BuildValue("i", kernel_supported(name));
+}
+
+//
+// use the named candidate kernel for later matches
+//
+
+static PyObject *
+PySMatch_set_kernel(PyObject* self, PyObject* args)
+{
+    const char *name=NULL;
+
+    if (!PyArg_ParseTuple(args, (char*)"s", &name)) {
+        return NULL;
+    }
+
+    if (!kernel_set(name)) {
+        PyErr_Format(PyExc_ValueError,
+                     "kernel '%s' is not known or not supported by this cpu", name);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+//
+// the pixel number of each ra,dec at the given nside, filling the int64
+// pixels array.  This is used to split the points into sky partitions
+//
+
+static PyObject *
+PySMatch_eq2pix(PyObject* self, PyObject* args)
+{
+    PY_LONG_LONG nside=0;
+    size_t n=0;
+    const double* ra=NULL;
+    const double* dec=NULL;
+    PyObject* raObj=NULL;
+    PyObject* decObj=NULL;
+    PyObject* pixelsObj=NULL;
+    struct healpix* hpix=NULL;
+
+    if (!PyArg_ParseTuple(args, (char*)"LOOO",
+                          &nside, &raObj, &decObj, &pixelsObj)) {
+        return NULL;
+    }
+
+    if (!get_array_data(raObj, "ra", &ra)
+            || !get_array_data(decObj, "dec", &dec)) {
+        return NULL;
+    }
+
+    n = (size_t)PyArray_SIZE((PyArrayObject*)raObj);
+    if ((size_t)PyArray_SIZE((PyArrayObject*)decObj) != n
+            || !PyArray_Check(pixelsObj)
+            || PyArray_TYPE((PyArrayObject*)pixelsObj) != NPY_INT64
+            || !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)pixelsObj)
+            || (size_t)PyArray_SIZE((PyArrayObject*)pixelsObj) != n) {
+        PyErr_SetString(PyExc_ValueError,
+                        "pixels must be a contiguous int64 array the "
+                        "same size as ra,dec");
+        return NULL;
+    }
+
+    if (!check_radec(ra, dec, n)) {
+        return NULL;
+    }
+
+    hpix = hpix_new((int64_t)nside);
+    if (hpix == NULL) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    hpix_eq2pix_xyz_array(hpix, ra, dec, n,
+                          (int64_t*) PyArray_DATA((PyArrayObject*)pixelsObj),
+                          NULL, NULL, NULL);
+    Py_END_ALLOW_THREADS
+
+    hpix = hpix_delete(hpix);
+    Py_RETURN_NONE;
+}
+
+//
+// the pixels at the given nside intersecting the disc of the given radius
+// (degrees) around each ra,dec.  Returns the index of the point and the
+// pixel number for each, as a tuple of int64 arrays
+//
+
+static PyObject *
+PySMatch_disc_pixels(PyObject* self, PyObject* args)
+{
+    PY_LONG_LONG nside=0;
+    double radius=0, x=0, y=0, z=0;
+    size_t n=0, i=0, j=0;
+    const double* ra=NULL;
+    const double* dec=NULL;
+    PyObject* raObj=NULL;
+    PyObject* decObj=NULL;
+    PyObject* indObj=NULL;
+    PyObject* pixObj=NULL;
+    npy_intp dims[1];
+    struct healpix* hpix=NULL;
+    lvector* listpix=NULL;
+    lvector* inds=NULL;
+    lvector* pixels=NULL;
+
+    if (!PyArg_ParseTuple(args, (char*)"LOOd",
+                          &nside, &raObj, &decObj, &radius)) {
+        return NULL;
+    }
+
+    if (!get_array_data(raObj, "ra", &ra)
+            || !get_array_data(decObj, "dec", &dec)) {
+        return NULL;
+    }
+
+    n = (size_t)PyArray_SIZE((PyArrayObject*)raObj);
+    if ((size_t)PyArray_SIZE((PyArrayObject*)decObj) != n) {
+        PyErr_SetString(PyExc_ValueError, "ra,dec must be the same size");
+        return NULL;
+    }
+
+    if (!check_radec(ra, dec, n)) {
+        return NULL;
+    }
+
+    hpix = hpix_new((int64_t)nside);
+    if (hpix == NULL) {
+        return NULL;
+    }
+
+    listpix = lvector_new();
+    inds = lvector_new();
+    pixels = lvector_new();
+
+    Py_BEGIN_ALLOW_THREADS
+    for (i=0; i<n; i++) {
+        hpix_eq2xyz(ra[i], dec[i], &x, &y, &z);
+        hpix_disc_intersect(hpix, x, y, z, radius*D2R, listpix);
+
+        for (j=0; j<vector_size(listpix); j++) {
+            vector_push(inds, (int64_t)i);
+            vector_push(pixels, listpix->data[j]);
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    dims[0] = (npy_intp)vector_size(pixels);
+    indObj = PyArray_SimpleNew(1, dims, NPY_INT64);
+    pixObj = PyArray_SimpleNew(1, dims, NPY_INT64);
+
+    if (indObj != NULL && pixObj != NULL && dims[0] > 0) {
+        memcpy(PyArray_DATA((PyArrayObject*)indObj), inds->data,
+               dims[0]*sizeof(int64_t));
+        memcpy(PyArray_DATA((PyArrayObject*)pixObj), pixels->data,
+               dims[0]*sizeof(int64_t));
+    }
+
+    vector_free(listpix);
+    vector_free(inds);
+    vector_free(pixels);
+    hpix = hpix_delete(hpix);
+
+    if (indObj == NULL || pixObj == NULL) {
+        Py_XDECREF(indObj);
+        Py_XDECREF(pixObj);
+        return NULL;
+    }
+
+    return Py_BuildValue("NN", indObj, pixObj);
+}
+
 static PyMethodDef smatch_module_methods[] = {
     {"_count_lines",      (PyCFunction)PySMatchCat_count_lines, METH_VARARGS,  "count the lines in the specified file."},
     {"_load_matches",              (PyCFunction)PySMatchCat_load_matches,          METH_VARARGS,  "Load matches from the specifed filename."},
+    {"_kernel_name",      (PyCFunction)PySMatch_kernel_name, METH_NOARGS,  "Get the name of the candidate kernel in use."},
+    {"_kernel_supported", (PyCFunction)PySMatch_kernel_supported, METH_VARARGS,  "Check if the named candidate kernel is supported by this cpu."},
+    {"_set_kernel",       (PyCFunction)PySMatch_set_kernel, METH_VARARGS,  "Use the named candidate kernel for later matches."},
+    {"_eq2pix",           (PyCFunction)PySMatch_eq2pix, METH_VARARGS,  "Get the pixel number of each ra,dec at the given nside."},
+    {"_disc_pixels",      (PyCFunction)PySMatch_disc_pixels, METH_VARARGS,  "Get the pixels intersecting the disc around each ra,dec at the given nside."},
+    {NULL}  /* Sentinel */
 };
 
 
@@ -1022,6 +3087,9 @@ init_smatch(void)
     if (PyType_Ready(&PyCatalogType) < 0) {
         return NULL;
     }
+    if (PyType_Ready(&PyMatchIterType) < 0) {
+        return NULL;
+    }
     m = PyModule_Create(&moduledef);
     if (m==NULL) {
         return NULL;
@@ -1031,6 +3099,8 @@ init_smatch(void)
 
     if (PyType_Ready(&PyCatalogType) < 0)
         return;
+    if (PyType_Ready(&PyMatchIterType) < 0)
+        return;
 
     m = Py_InitModule3("_smatch", smatch_module_methods, "Define module methods.");
     if (m==NULL) {
@@ -1,5 +1,7 @@
 from __future__ import print_function
 from sys import stderr
+import os
+import struct
 import numpy as np
 from . import _smatch
 
@@ -12,9 +14,40 @@ else:
 # area 0.013114 square degrees
 NSIDE_DEFAULT=4096
 
+# relative costs per catalog entry of each ring and each pixel searched in
+# the disc, and of each candidate point tested, used to choose nside; these
+# were measured with the matching engine
+NSIDE_COST_RING=100.0
+NSIDE_COST_PIXEL=10.0
+NSIDE_COST_CANDIDATE=1.0
+
+# the largest nside available
+NSIDE_MAX=2**28
+
+# the matching_self sent to the C code for self matches, with all matches or
+# each pair once
+MATCH_SELF=1
+MATCH_SELF_UNIQUE=2
+MATCH_SELF_MIRROR=3
+
+# the binary match file format; see matchfile.h
+MATCHFILE_MAGIC = b'SMATCHBN'
+MATCHFILE_HEADER_SIZE = 64
+
+# the saved index format, see Catalog.save_index.  The header holds the magic,
+# then the version, a byte order mark, the multires and float32 flags, and the
+# nside and the sizes of the arrays, followed by the arrays in the order of
+# _index_file_sections, each starting on a multiple of INDEXFILE_ALIGN bytes
+INDEXFILE_MAGIC = b'SMATCHIX'
+INDEXFILE_VERSION = 1
+INDEXFILE_HEADER_SIZE = 64
+INDEXFILE_ALIGN = 64
+INDEXFILE_BYTE_ORDER_MARK = 0x01020304
+
 def match(ra1, dec1, radius1, ra2, dec2,
           nside=NSIDE_DEFAULT, maxmatch=1,
-          file=None):
+          file=None, index='input', nthreads=1, format='binary',
+          exact=None, multires=False, float32=False):
     """
     match points on the sphere
 
@@ -34,17 +67,38 @@ def match(ra1, dec1, radius1, ra2, dec2,
     dec2: array
         declination array 2 same size as ra2 in degrees
 
-    nside: int, optional
-        nside for the healpix layout. Default 2048
+    nside: int or 'auto', optional
+        nside for the healpix layout.  If 'auto', choose the nside from the
+        radii and the density of the second set of points; see
+        choose_nside. Default 4096
 
     maxmatch: int, optional
         maximum number of matches to allow per point. The closest maxmatch
-        matches will be kept.  Default is 1, which implles keepin the
-        closest match.  Set to <= 0 to keep all matches.
+        matches will be kept, sorted closest first.  Default is 1, which
+        implles keepin the closest match.  Set to <= 0 to keep all
+        matches.
 
     file: string
         File in which to write matches.
 
+    index: string, optional
+        Which set of points to index; see Catalog.match. Default 'input'
+    nthreads: int, optional
+        Number of threads to use for the match.  The results do not depend on
+        the number of threads.  Default 1
+    format: string, optional
+        Format of the file, 'binary' or 'text'; see Catalog.match.
+        Default 'binary'
+    exact: bool, optional
+        If True, count the matches before finding them, so the output is
+        allocated once with the right size; see Catalog.match.  Default None
+    multires: bool, optional
+        If True, search entries with large radii at a coarser resolution;
+        see Catalog.  Default False
+    float32: bool, optional
+        If True, hold the indexed points in single precision, with the same
+        results; see Catalog.  Default False
+
     returns
     -------
     matchcat: structured array
@@ -58,9 +112,14 @@ def match(ra1, dec1, radius1, ra2, dec2,
     If a file is sent, None is returned
     """
 
-    cat = Catalog(ra1, dec1, radius1, nside=nside)
+    if _is_auto(nside):
+        nside = choose_nside(radius1, ra2, dec2)
 
-    cat.match(ra2, dec2, maxmatch=maxmatch, file=file)
+    cat = Catalog(ra1, dec1, radius1, nside=nside, cache=False,
+                  multires=multires, float32=float32)
+
+    cat.match(ra2, dec2, maxmatch=maxmatch, file=file, index=index,
+              nthreads=nthreads, format=format, exact=exact)
 
     if file is not None:
         return None
@@ -69,7 +128,9 @@ def match(ra1, dec1, radius1, ra2, dec2,
 
 def match_self(ra, dec, radius,
                nside=NSIDE_DEFAULT, maxmatch=1,
-               file=None):
+               file=None, nthreads=1, format='binary', exact=None,
+               multires=False, float32=False, unique_pairs=False,
+               mirror=False):
     """
     match points on the sphere.  Match the catalog to itself, 
     ignoring exact matches
@@ -85,16 +146,40 @@ def match_self(ra, dec, radius,
         search radius around each point in degrees; can be a scalar
         or same size as ra1/dec1.
 
-    nside: int, optional
-        nside for the healpix layout. Default 2048
+    nside: int or 'auto', optional
+        nside for the healpix layout.  If 'auto', choose the nside from the
+        radii and the density of the points; see choose_nside. Default 4096
 
     maxmatch: int, optional
         maximum number of matches to allow per point. The closest maxmatch
-        matches will be kept.  Default is 1, which implles keepin the
-        closest match.  Set to <= 0 to keep all matches.
+        matches will be kept, sorted closest first.  Default is 1, which
+        implles keepin the closest match.  Set to <= 0 to keep all
+        matches.
 
     file: string
         File in which to write matches.
+    nthreads: int, optional
+        Number of threads to use for the match.  The results do not depend on
+        the number of threads.  Default 1
+    format: string, optional
+        Format of the file, 'binary' or 'text'; see Catalog.match.
+        Default 'binary'
+    exact: bool, optional
+        If True, count the matches before finding them, so the output is
+        allocated once with the right size; see Catalog.match.  Default None
+    multires: bool, optional
+        If True, search entries with large radii at a coarser resolution;
+        see Catalog.  Default False
+    float32: bool, optional
+        If True, hold the indexed points in single precision, with the same
+        results; see Catalog.  Default False
+    unique_pairs: bool, optional
+        If True, find each pair once, with i1 < i2, testing about half the
+        candidates; see Catalog.match_self.  Only for maxmatch <= 0 and a
+        single radius.  Default False
+    mirror: bool, optional
+        If True, with unique_pairs, give each pair in both orders; see
+        Catalog.match_self.  Default False
 
     returns
     -------
@@ -109,15 +194,305 @@ def match_self(ra, dec, radius,
     If a file is sent, None is returned
     """
 
-    cat = Catalog(ra, dec, radius, nside=nside)
+    cat = Catalog(ra, dec, radius, nside=nside, cache=False,
+                  multires=multires, float32=float32)
 
-    cat.match_self(maxmatch=maxmatch, file=file)
+    cat.match_self(maxmatch=maxmatch, file=file, nthreads=nthreads,
+                   format=format, exact=exact, unique_pairs=unique_pairs,
+                   mirror=mirror)
 
     if file is not None:
         return None
     else:
         return cat.matches
 
+def count_matches(ra1, dec1, radius1, ra2, dec2,
+                  nside=NSIDE_DEFAULT, maxmatch=0, nthreads=1, total=False,
+                  multires=False, float32=False):
+    """
+    count the matches of the second set of points to each of the first,
+    without keeping them; see match() for the parameters
+
+    parameters
+    ----------
+
+    ra1, dec1, radius1, ra2, dec2, nside, nthreads, multires, float32:
+        As for match()
+    maxmatch: int, optional
+        If > 0 the count for each point is at most maxmatch.  Default 0,
+        counting all matches
+    total: bool, optional
+        If True return the total number of matches rather than the counts
+        for each point.  Default False
+
+    returns
+    -------
+    counts: int64 array
+        The number of matches for each point in the first set, or the total
+        if total=True
+    """
+
+    if _is_auto(nside):
+        nside = choose_nside(radius1, ra2, dec2)
+
+    cat = Catalog(ra1, dec1, radius1, nside=nside, cache=False,
+                  multires=multires, float32=float32)
+
+    return cat.count_matches(ra2, dec2, maxmatch=maxmatch, nthreads=nthreads,
+                             total=total)
+
+def count_matches_self(ra, dec, radius,
+                       nside=NSIDE_DEFAULT, maxmatch=0, nthreads=1,
+                       total=False, multires=False, float32=False):
+    """
+    count the matches of the points to the others within the radius, as
+    used for crowding flags or local densities, without keeping the matches;
+    see match_self() and count_matches() for the parameters
+
+    returns
+    -------
+    counts: int64 array
+        The number of other points matched to each point, or the total if
+        total=True
+    """
+
+    cat = Catalog(ra, dec, radius, nside=nside, cache=False,
+                  multires=multires, float32=float32)
+
+    return cat.count_matches_self(maxmatch=maxmatch, nthreads=nthreads,
+                                  total=total)
+
+def friends_of_friends(ra, dec, linking_radius, nside=NSIDE_DEFAULT,
+                       min_match=1, nthreads=1, float32=False):
+    """
+    group points on the sphere by friends-of-friends; see
+    Catalog.friends_of_friends
+
+    parameters
+    ----------
+    ra: array
+        right ascension array in degrees
+    dec: array
+        declination array in degrees, same size as ra
+    linking_radius: float
+        The linking radius in degrees
+    nside: int or 'auto', optional
+        nside for the healpix layout.  If 'auto', choose the nside from the
+        linking radius and the density of the points; see choose_nside.
+        Default 4096
+    min_match: int, optional
+        The smallest number of members for a group; points in smaller groups
+        are given the group -1.  Default 1
+    nthreads: int, optional
+        Number of threads to use.  Default 1
+    float32: bool, optional
+        If True, hold the indexed points in single precision, with the same
+        results; see Catalog.  Default False
+
+    returns
+    -------
+    groups: int64 array
+        The group of each point, numbered from 0 in order of the lowest
+        index of their members
+    """
+
+    cat = Catalog(ra, dec, float(linking_radius), nside=nside, cache=False,
+                  float32=float32)
+
+    return cat.friends_of_friends(min_match=min_match, nthreads=nthreads)
+
+def pair_counts(ra1, dec1, ra2, dec2, bins, weights1=None, weights2=None,
+                nside=NSIDE_DEFAULT, nthreads=1):
+    """
+    count the pairs of points from the two sets in bins of separation,
+    without keeping them; see Catalog.pair_counts
+
+    parameters
+    ----------
+    ra1, dec1: array
+        The first set of points, in degrees
+    ra2, dec2: array
+        The second set of points, in degrees
+    bins: array
+        The bin edges in degrees, increasing
+    weights1, weights2: array, optional
+        The weights for the first and second set of points.  Default None,
+        weights of 1
+    nside: int or 'auto', optional
+        nside for the healpix layout.  If 'auto', choose the nside from the
+        last bin edge and the density of the second set; see choose_nside.
+        Default 4096
+    nthreads: int, optional
+        Number of threads to use.  Default 1
+
+    returns
+    -------
+    counts: array
+        The counts in each bin, int64 when there are no weights and float64
+        otherwise
+    """
+
+    radius = float(np.max(bins))
+    if _is_auto(nside):
+        nside = choose_nside(radius, ra2, dec2)
+
+    cat = Catalog(ra1, dec1, radius, nside=nside, cache=False)
+
+    return cat.pair_counts(ra2, dec2, bins, weights=weights2,
+                           cat_weights=weights1, nthreads=nthreads)
+
+def pair_counts_self(ra, dec, bins, weights=None, nside=NSIDE_DEFAULT,
+                     nthreads=1):
+    """
+    count the pairs of points in bins of separation, each pair counted once;
+    see pair_counts() and Catalog.pair_counts_self
+    """
+
+    radius = float(np.max(bins))
+    if _is_auto(nside):
+        nside = choose_nside(radius, ra, dec)
+
+    cat = Catalog(ra, dec, radius, nside=nside, cache=False)
+
+    return cat.pair_counts_self(bins, weights=weights, nthreads=nthreads)
+
+def knn(ra1, dec1, ra2, dec2, k=1, maxdist=None, nside=NSIDE_DEFAULT,
+        nthreads=1):
+    """
+    find the k nearest of the second set of points to each of the first,
+    without a fixed search radius
+
+    parameters
+    ----------
+
+    ra1: array
+        right ascension array 1 in degrees
+    dec1: array
+        declination array 1 in degrees, same size as ra1
+    ra2: array
+        right ascension array 2 in degrees
+    dec2: array
+        declination array 2 same size as ra2 in degrees
+    k: int, optional
+        The number of neighbors to find.  Default 1
+    maxdist: float, optional
+        The maximum distance in degrees to a neighbor.  Default None, meaning
+        no limit
+    nside: int, optional
+        nside for the healpix layout.  Default 4096
+    nthreads: int, optional
+        Number of threads to use.  The results do not depend on the number
+        of threads.  Default 1
+
+    returns
+    -------
+    matchcat: structured array
+        Structured array with fields i1, i2, cosdist as for match(); the
+        matches for each point in the first set are sorted closest first
+    """
+
+    cat = Catalog(ra1, dec1, 0.0, nside=nside, cache=False)
+
+    cat.knn(ra2, dec2, k=k, maxdist=maxdist, nthreads=nthreads)
+
+    return cat.matches
+
+def choose_nside(radius, ra, dec):
+    """
+    choose the nside for which a match is expected to be fastest
+
+    A low nside gives large pixels holding many candidate points, while a
+    high nside gives many pixels in each search disc.  The cost per catalog
+    entry is modeled as
+
+        NSIDE_COST_RING*nrings + NSIDE_COST_PIXEL*npixels
+            + NSIDE_COST_CANDIDATE*ncandidates
+
+    for the number of rings and pixels searched for the typical radius, and
+    the number of candidates expected in those pixels given the density of
+    the points being searched.  The density is estimated from the sky area
+    covered by the points.
+
+    parameters
+    ----------
+    radius: array or scalar
+        The catalog search radii in degrees; the median is used
+    ra: array
+        right ascension in degrees of the points that will be searched,
+        usually the second set of points sent to match
+    dec: array
+        declination in degrees of the points that will be searched
+
+    returns
+    -------
+    nside: int
+    """
+    radius = np.array(radius, ndmin=1, dtype='f8', copy=copy_if_needed)
+    ra, dec = _get_arrays(ra, dec)
+
+    if ra.size == 0 or radius.size == 0:
+        return NSIDE_DEFAULT
+
+    rad = np.deg2rad(np.median(radius))
+    density = ra.size/_get_sky_area(ra, dec)
+
+    # a grid in steps of sqrt(2)
+    nsides = np.unique(
+        np.round(2.0**(np.arange(57)/2.0)).astype('i8')
+    )
+    nsides = nsides[nsides <= NSIDE_MAX]
+
+    # as in hpix_disc_intersect, the disc is enlarged by about a pixel
+    fudge = 1.362*np.pi/(4*nsides)
+    pixarea = np.pi/(3.0*nsides**2)
+    disc_rad = rad + fudge
+    disc_area = np.pi*disc_rad**2
+
+    nrings = 2*disc_rad*nsides/(2.0/3.0) + 3
+    npixels = disc_area/pixarea + 1
+    ncand = np.minimum(disc_area*density, ra.size)
+
+    cost = (NSIDE_COST_RING*nrings
+            + NSIDE_COST_PIXEL*npixels
+            + NSIDE_COST_CANDIDATE*ncand)
+
+    return int(nsides[cost.argmin()])
+
+def _get_sky_area(ra, dec, maxpoints=1000000, per_cell=16):
+    """
+    estimate the area covered by the points in steradians, from the number
+    of cells they occupy in an equal area grid.  The grid is refined until
+    the occupied cells hold on average fewer than per_cell points
+
+    at most maxpoints are used
+    """
+    stride = max(1, ra.size//maxpoints)
+    ra = ra[::stride]
+    z = np.sin(np.deg2rad(dec[::stride]))
+
+    nra, nz = 36, 18
+    while True:
+        ira = np.clip((ra/360.0*nra).astype('i8'), 0, nra-1)
+        iz = np.clip(((z + 1)/2.0*nz).astype('i8'), 0, nz-1)
+        nocc = np.unique(iz*nra + ira).size
+
+        if ra.size < per_cell*nocc or nra >= 2**20:
+            break
+        nra *= 2
+        nz *= 2
+
+    return nocc*4*np.pi/(nra*nz)
+
+def _is_auto(nside):
+    """
+    check nside is 'auto', or an integer
+    """
+    if isinstance(nside, str):
+        if nside != 'auto':
+            raise ValueError("nside should be an integer or 'auto', "
+                             "got '%s'" % nside)
+        return True
+    return False
 
 class Catalog(_smatch.Catalog):
     """
@@ -131,21 +506,67 @@ class Catalog(_smatch.Catalog):
         declination in degrees
     radius: array or scalar
         Search radius in degrees. Can be scalar or same size as ra/dec
-    nside: int, optional
-        nside for the healpix layout. Default 2048
+    nside: int or 'auto', optional
+        nside for the healpix layout.  If 'auto', choose the nside from the
+        radii and the density of the catalog, see choose_nside; the choice
+        is given by the hpix_nside attribute.  Default 4096
+    cache: bool, optional
+        If True, the catalog points and the healpix pixels intersecting the
+        disc around each point are computed on the first match and kept for
+        later matches, as is the index over the catalog used by match_self.
+        This speeds up repeated matches at the expense of memory; see the
+        cache_nbytes attribute.  Set to False for very large catalogs.
+        Default True.
+    multires: bool, optional
+        If True, entries with radii large compared to the pixels are searched
+        at a coarser resolution, the nside being divided by 4 at each level
+        until the disc spans a few pixels across.  This keeps a few entries
+        with very large radii from dominating the time when the radii vary
+        widely.  The second set of points is indexed at each level needed;
+        see the nlevels attribute.  Only used when indexing the second set
+        of points.  Default False
+    float32: bool, optional
+        If True, the indexed points are held in single precision, halving
+        their memory, and candidates are screened in single precision with
+        a margin.  Those passing are recomputed in double precision, so the
+        matches and cosdist are the same as without.  This pays off when
+        memory is tight or the index is large compared to the cpu cache;
+        the recomputation costs some trig for each candidate passing the
+        screen.  Only used when indexing the second set of points.
+        Default False
+    stats: bool, optional
+        If True, keep counts of the work done and the time taken by each
+        phase of the last match; see the stats attribute.  Default False
     """
-    def __init__(self, ra, dec, radius, nside=NSIDE_DEFAULT):
+    def __init__(self, ra, dec, radius, nside=NSIDE_DEFAULT, cache=True,
+                 multires=False, float32=False, stats=False):
+        self._init(ra, dec, radius, nside, cache, multires, float32, stats,
+                   True)
+
+    def _init(self, ra, dec, radius, nside, cache, multires, float32, stats,
+              check):
+        """
+        set up the catalog; the ra and dec are only checked if check is
+        True, so load_index does not read them
+        """
 
         ra,dec,radius=_get_arrays(ra,dec,radius=radius)
         self._matches = None
 
-        #super(Catalog,self).__init__(
-        #    nside, ra, dec, radius,
-        #)
-        super(Catalog,self).__init__(nside)
+        self._nside_auto = _is_auto(nside)
+        if self._nside_auto:
+            nside = choose_nside(radius, ra, dec)
+
+        super(Catalog,self).__init__(
+            nside, ra, dec, radius, int(cache), int(multires), int(float32),
+            int(stats), int(check),
+        )
         self._ra=ra
         self._dec=dec
         self._radius=radius
+        self._cache=bool(cache)
+        self._multires=bool(multires)
+        self._float32=bool(float32)
 
     def get_matches(self):
         """
@@ -186,13 +607,62 @@ class Catalog(_smatch.Catalog):
         """
         return super(Catalog,self).get_hpix_area()
 
+    def get_cache_nbytes(self):
+        """
+        get the memory in bytes used by the data cached between matches.
+        This is zero until the first match, or if caching is disabled.  For a
+        catalog from load_index this is the size of the mapped index
+        """
+        return super(Catalog,self).get_cache_nbytes()
+
+    def get_nlevels(self):
+        """
+        get the number of resolution levels used for matching.  This is 1
+        unless multires is set and some radii are large compared to the
+        pixels
+        """
+        return super(Catalog,self).get_nlevels()
+
+    def get_stats(self):
+        """
+        get the counts and times for the last match on this catalog, as a
+        dict, or None if the catalog was not made with stats=True.  The
+        counts do not depend on nthreads
+
+            nentries: catalog entries searched
+            nranges: ranges of disc pixels looked up in the index
+            npixels: pixels in those ranges
+            nhits, nmisses: ranges holding points of the index, and not
+            ncandidates: points tested against the radius
+            naccepted: points within the radius; this can exceed the
+                number of matches when maxmatch > 0
+            nreplaced: matches displaced by closer ones when maxmatch > 0
+            nresize: times the output array was grown
+
+        The times are wall clock seconds
+
+            time_prepare: building the catalog points and disc pixels
+            time_index: indexing the second set of points, or the catalog
+            time_search: the search, including writing the matches
+            time_resize: growing the output, part of time_search
+            time_finish: trimming the output, or finishing the file
+
+        The counts are zero for counting the matches, for pair counts and
+        when indexing the catalog; only the times are kept
+        """
+        return super(Catalog,self).get_stats()
+
 
     matches=property(fget=get_matches)
     nmatches=property(fget=get_nmatches)
     hpix_nside=property(fget=get_hpix_nside)
     hpix_area=property(fget=get_hpix_nside)
+    cache_nbytes=property(fget=get_cache_nbytes)
+    nlevels=property(fget=get_nlevels)
+    stats=property(fget=get_stats)
 
-    def match(self, ra, dec, maxmatch=1, file=None):
+    def match(self, ra, dec, maxmatch=1, file=None, index='input',
+              nthreads=1, format='binary', exact=None):
         """
         match the catalog to the second set of points
 
@@ -204,10 +674,46 @@ class Catalog(_smatch.Catalog):
             dec to match, in degrees
         maxmatch: int, optional
             maximum number of matches to allow per point. The closest maxmatch
-            matches will be kept.  Default is 1, which implles keepin the
-            closest match.  Set to <= 0 to keep all matches.
+            matches will be kept, sorted closest first.  Default is 1, which
+            implles keepin the closest match.  Set to <= 0 to keep all
+            matches.
         file: filename
             Send matches to the specified file
+        index: string, optional
+            Which set of points to index.
+
+            'input': index the second set of points and loop over the
+                catalog.
+            'catalog': index the catalog and stream through the second set of
+                points, so the memory used follows the size of the catalog.
+                The input points are searched with the largest catalog
+                radius, so this works best when the radii are similar.  When
+                writing all matches to a file, they are written as found and
+                are not ordered by i1.
+            'auto': index the catalog if it is the smaller set and the radii
+                are all within a factor of two, otherwise index the input.
+
+            The same matches are found in all cases. Default 'input'
+        nthreads: int, optional
+            Number of threads to use for the match.  The results do not
+            depend on the number of threads.  The match with the catalog
+            index uses a single thread.  Default 1
+        format: string, optional
+            Format of the file.
+
+            'binary': a small header holding the count and data type,
+                followed by the packed matches.  This is much faster to write
+                and read than text, and smaller.
+            'text': a line "i1 i2 cosdist" for each match.
+
+            read_matches reads either format.  Default 'binary'
+        exact: bool, optional
+            If True, the matches for each catalog entry are counted in a
+            first pass, then found again and written directly into an output
+            array of exactly the right size.  This costs an extra pass but
+            avoids growing the output, so the peak memory is the size of the
+            result.  Only used when indexing the input and not writing to a
+            file.  The default None means use this when maxmatch <= 0
         """
 
         ra,dec=_get_arrays(ra,dec)
@@ -219,9 +725,69 @@ class Catalog(_smatch.Catalog):
             ra,
             dec,
             file,
+            index=index,
+            nthreads=nthreads,
+            format=format,
+            exact=exact,
         )
 
-    def match_self(self, maxmatch=1, file=None):
+    def match_many(self, inputs, maxmatch=1, nthreads=1):
+        """
+        match the catalog to several sets of points in one pass.  The sets
+        are indexed together, so each catalog entry and the pixels
+        intersecting its disc are only computed once for all of them, rather
+        than once for each call to match().  The matches for each set are
+        the same as from match() with the input index.
+
+        The combined sets are held in memory, along with their index.  With
+        more than one set and maxmatch > 0, all matches for a block of
+        catalog entries are found before the closest for each set are kept.
+
+        parameters
+        ----------
+        inputs: sequence
+            A sequence of (ra, dec) pairs of arrays, in degrees
+        maxmatch: int, optional
+            maximum number of matches to allow per point for each set, as
+            for match().  Default 1
+        nthreads: int, optional
+            Number of threads to use for the match.  The results do not
+            depend on the number of threads.  Default 1
+
+        returns
+        -------
+        matches: list
+            The match structure for each set, with i2 the index in that
+            set.  The matches attribute is set to None
+        """
+
+        nthreads = int(nthreads)
+        if nthreads < 1:
+            raise ValueError("nthreads should be >= 1, got %d" % nthreads)
+
+        self._matches = None
+
+        arrays = [_get_arrays(ra, dec) for ra, dec in inputs]
+        if len(arrays) == 0:
+            return []
+
+        offsets = np.zeros(len(arrays)+1, dtype='i8')
+        offsets[1:] = np.cumsum([ra.size for ra, dec in arrays])
+        ra = np.concatenate([ra for ra, dec in arrays])
+        dec = np.concatenate([dec for ra, dec in arrays])
+
+        # the GIL is released during the match, so only return the matches
+        # once they are complete
+        matches = [np.zeros(1, dtype=match_dtype) for _ in arrays]
+        super(Catalog, self).match_many(
+            maxmatch, ra, dec, offsets, matches, nthreads,
+        )
+
+        return matches
+
+    def match_self(self, maxmatch=1, file=None, nthreads=1,
+                   format='binary', exact=None, unique_pairs=False,
+                   mirror=False):
         """
         match the catalog against itself, ignoring exact
         matches
@@ -230,11 +796,37 @@ class Catalog(_smatch.Catalog):
         ----------
         maxmatch: int, optional
             maximum number of matches to allow per point. The closest maxmatch
-            matches will be kept.  Default is 1, which implles keepin the
-            closest match.  Set to <= 0 to keep all matches.
+            matches will be kept, sorted closest first.  Default is 1, which
+            implles keepin the closest match.  Set to <= 0 to keep all
+            matches.
+        file: filename
+            Send matches to the specified file
+        nthreads: int, optional
+            Number of threads to use for the match.  The results do not
+            depend on the number of threads.  The match with the catalog
+            index uses a single thread.  Default 1
+        format: string, optional
+            Format of the file, 'binary' or 'text'; see match().
+            Default 'binary'
+        exact: bool, optional
+            If True, count the matches before finding them, so the output is
+            allocated once with the right size; see match().  Default None
+        unique_pairs: bool, optional
+            If True, find each pair once, with i1 < i2.  The matches are
+            symmetric when all entries have the same radius, so each entry
+            only tests the candidates after it in the index, about half of
+            them.  Only for maxmatch <= 0 and the same radius for all
+            entries.  The matches are grouped by the entry that found them
+            rather than ordered by i1.  Default False
+        mirror: bool, optional
+            If True, with unique_pairs, give each pair in both orders, so
+            the matches are the same as without unique_pairs, although in a
+            different order.  Default False
         """
 
-        matching_self=1
+        matching_self=MATCH_SELF
+        if unique_pairs:
+            matching_self = self._get_unique_pairs_mode(maxmatch, mirror)
 
         self._match(
             maxmatch,
@@ -242,59 +834,641 @@ class Catalog(_smatch.Catalog):
             self._ra,
             self._dec,
             file,
+            nthreads=nthreads,
+            format=format,
+            exact=exact,
+        )
+
+    def _get_unique_pairs_mode(self, maxmatch, mirror):
+        """
+        the matching_self for unique pairs, checking they can be used
+        """
+        if maxmatch > 0:
+            raise ValueError("unique_pairs is only supported for "
+                             "maxmatch <= 0, got %d" % maxmatch)
+
+        if np.any(self._radius != self._radius[0]):
+            raise ValueError("unique_pairs requires the same radius for "
+                             "all entries")
+
+        if mirror:
+            return MATCH_SELF_MIRROR
+        else:
+            return MATCH_SELF_UNIQUE
+
+    def friends_of_friends(self, linking_radius=None, min_match=1,
+                           nthreads=1):
+        """
+        group the catalog by friends-of-friends: points within the linking
+        radius of each other are friends, and the groups are the sets of
+        points joined by chains of friends.
+
+        The pairs are found as for match_self with unique_pairs, and are
+        joined as they are found, so they are never all held in memory.
+
+        parameters
+        ----------
+        linking_radius: float, optional
+            The linking radius in degrees.  Default None, meaning the radius
+            of the catalog, which must then be the same for all entries
+        min_match: int, optional
+            The smallest number of members for a group, including the point
+            itself.  Points in smaller groups are given the group -1.
+            Default 1, so all points are in groups
+        nthreads: int, optional
+            Number of threads to use for finding the pairs.  The results do
+            not depend on the number of threads.  Default 1
+
+        returns
+        -------
+        groups: int64 array
+            The group of each point.  The groups are numbered from 0, in
+            order of the lowest index of their members
+        """
+
+        min_match = int(min_match)
+        if min_match < 1:
+            raise ValueError("min_match should be >= 1, got %d" % min_match)
+        nthreads = int(nthreads)
+        if nthreads < 1:
+            raise ValueError("nthreads should be >= 1, got %d" % nthreads)
+
+        if linking_radius is None:
+            cat = self
+            cat._get_unique_pairs_mode(0, False)
+        else:
+            linking_radius = float(linking_radius)
+            cat = Catalog(self._ra, self._dec, linking_radius,
+                          nside=self.get_hpix_nside(), cache=False,
+                          float32=self._float32)
+
+        groups = np.zeros(self._ra.size, dtype='i8')
+        super(Catalog, cat).friends_of_friends(min_match, groups, nthreads)
+
+        return groups
+
+    def count_matches(self, ra, dec, maxmatch=0, nthreads=1, total=False):
+        """
+        count the matches of the second set of points to each catalog point,
+        without keeping them.  The same index and candidate tests are used
+        as for match(), but only a count is kept for each catalog point, so
+        the memory does not grow with the number of matches.  The matches
+        attribute is set to None.
+
+        parameters
+        ----------
+        ra: array
+            ra to match, in degrees
+        dec: array
+            dec to match, in degrees
+        maxmatch: int, optional
+            If > 0 the count for each catalog point is at most maxmatch, the
+            number that match() would find.  Default 0, counting all matches
+        nthreads: int, optional
+            Number of threads to use.  The results do not depend on the
+            number of threads.  Default 1
+        total: bool, optional
+            If True return the total number of matches rather than the counts
+            for each catalog point.  Default False
+
+        returns
+        -------
+        counts: int64 array
+            The number of matches for each catalog point, or the total if
+            total=True
+        """
+        ra,dec=_get_arrays(ra,dec)
+        matching_self=0
+
+        return self._count_matches(maxmatch, matching_self, ra, dec,
+                                   nthreads, total)
+
+    def count_matches_self(self, maxmatch=0, nthreads=1, total=False):
+        """
+        count the matches of the catalog against itself, ignoring exact
+        matches; see count_matches()
+
+        parameters
+        ----------
+        maxmatch: int, optional
+            If > 0 the count for each catalog point is at most maxmatch.
+            Default 0, counting all matches
+        nthreads: int, optional
+            Number of threads to use.  Default 1
+        total: bool, optional
+            If True return the total number of matches rather than the counts
+            for each catalog point.  Default False
+        """
+        matching_self=MATCH_SELF
+
+        return self._count_matches(maxmatch, matching_self,
+                                   self._ra, self._dec, nthreads, total)
+
+    def _count_matches(self, maxmatch, matching_self, ra, dec, nthreads,
+                       total):
+        """
+        run the count
+        """
+        nthreads = int(nthreads)
+        if nthreads < 1:
+            raise ValueError("nthreads should be >= 1, got %d" % nthreads)
+
+        self._matches=None
+
+        counts = np.zeros(self._ra.size, dtype='i8')
+        ntotal = super(Catalog, self).count_matches(
+            maxmatch, matching_self, ra, dec, counts, nthreads,
+        )
+
+        if total:
+            return ntotal
+        else:
+            return counts
+
+    def pair_counts(self, ra, dec, bins, weights=None, cat_weights=None,
+                    nthreads=1):
+        """
+        count the pairs of catalog points and the second set of points in
+        bins of separation, as for an angular correlation function.  The
+        pairs are found as for match() with maxmatch=0, but only the counts
+        in each bin are kept, so the memory does not depend on the number
+        of pairs.  The matches attribute is set to None.
+
+        parameters
+        ----------
+        ra: array
+            ra to match, in degrees
+        dec: array
+            dec to match, in degrees
+        bins: array
+            The bin edges in degrees, increasing.  The last edge must be no
+            larger than the smallest catalog radius.  Pairs closer than the
+            first edge are not counted
+        weights: array, optional
+            A weight for each of the second set of points
+        cat_weights: array, optional
+            A weight for each catalog point.  Each pair counts the product of
+            the weights of its points.  Default None, weights of 1
+        nthreads: int, optional
+            Number of threads to use.  The results do not depend on the
+            number of threads.  Default 1
+
+        returns
+        -------
+        counts: array
+            The counts in each bin, int64 when there are no weights and
+            float64 otherwise.  A bin holds the pairs with separations in
+            [bins[i], bins[i+1]), as the catalog radius is exclusive for
+            match()
+        """
+        ra,dec=_get_arrays(ra,dec)
+        matching_self=0
+
+        return self._pair_counts(matching_self, ra, dec, bins,
+                                 cat_weights, weights, nthreads)
+
+    def pair_counts_self(self, bins, weights=None, nthreads=1):
+        """
+        count the pairs of catalog points in bins of separation, each pair
+        counted once; see pair_counts().  The pairs are found as for
+        match_self with unique_pairs, so the catalog radius must be the same
+        for all entries
+
+        parameters
+        ----------
+        bins: array
+            The bin edges in degrees, increasing, the last no larger than the
+            catalog radius
+        weights: array, optional
+            A weight for each catalog point.  Default None, weights of 1
+        nthreads: int, optional
+            Number of threads to use.  Default 1
+        """
+        matching_self = self._get_unique_pairs_mode(0, False)
+
+        return self._pair_counts(matching_self, self._ra, self._dec, bins,
+                                 weights, weights, nthreads)
+
+    def _pair_counts(self, matching_self, ra, dec, bins, w1, w2, nthreads):
+        """
+        run the pair count
+        """
+        nthreads = int(nthreads)
+        if nthreads < 1:
+            raise ValueError("nthreads should be >= 1, got %d" % nthreads)
+
+        edges = np.array(bins, ndmin=1, dtype='f8')
+        if edges.size < 2:
+            raise ValueError("need at least two bin edges")
+        if np.any(np.diff(edges) <= 0) or edges[0] < 0:
+            raise ValueError("bins must be positive and increasing")
+        if edges[-1] > self._radius.min():
+            raise ValueError("the last bin edge %g is larger than the "
+                             "catalog radius %g" %
+                             (edges[-1], self._radius.min()))
+
+        weighted = w1 is not None or w2 is not None
+        if w1 is not None:
+            w1 = np.ascontiguousarray(w1, dtype='f8')
+        if w2 is not None:
+            w2 = np.ascontiguousarray(w2, dtype='f8')
+
+        self._matches=None
+
+        # exact integer counts without weights
+        if weighted:
+            counts = np.zeros(edges.size-1, dtype='f8')
+        else:
+            counts = np.zeros(edges.size-1, dtype='i8')
+
+        super(Catalog, self).pair_counts(
+            matching_self, ra, dec, edges, w1, w2, counts, nthreads,
+        )
+
+        return counts
+
+    def knn(self, ra, dec, k=1, maxdist=None, nthreads=1):
+        """
+        find the k nearest of the second set of points to each catalog
+        point, without a fixed search radius.  The catalog radii are not
+        used.  The search around each point starts at the scale of a pixel
+        and grows until k points are found.
+
+        The results are in the matches attribute, with the k matches for each
+        catalog point sorted closest first.  Fewer than k are found if there
+        are fewer points within maxdist, or fewer points in total.
+
+        parameters
+        ----------
+        ra: array
+            ra to match, in degrees
+        dec: array
+            dec to match, in degrees
+        k: int, optional
+            The number of neighbors to find.  Default 1
+        maxdist: float, optional
+            The maximum distance in degrees to a neighbor.  Default None,
+            meaning no limit
+        nthreads: int, optional
+            Number of threads to use.  The results do not depend on the
+            number of threads.  Default 1
+        """
+        ra,dec=_get_arrays(ra,dec)
+        matching_self=0
+
+        self._knn(k, matching_self, ra, dec, maxdist, nthreads)
+
+    def knn_self(self, k=1, maxdist=None, nthreads=1):
+        """
+        find the k nearest other catalog points to each catalog point; see
+        knn()
+
+        parameters
+        ----------
+        k: int, optional
+            The number of neighbors to find.  Default 1
+        maxdist: float, optional
+            The maximum distance in degrees to a neighbor.  Default None,
+            meaning no limit
+        nthreads: int, optional
+            Number of threads to use.  Default 1
+        """
+        matching_self=MATCH_SELF
+
+        self._knn(k, matching_self, self._ra, self._dec, maxdist, nthreads)
+
+    def _knn(self, k, matching_self, ra, dec, maxdist, nthreads):
+        """
+        run the nearest neighbor search
+        """
+        k = int(k)
+        if k < 1:
+            raise ValueError("k should be >= 1, got %d" % k)
+        nthreads = int(nthreads)
+        if nthreads < 1:
+            raise ValueError("nthreads should be >= 1, got %d" % nthreads)
+
+        if maxdist is None:
+            maxdist_rad = 0.0
+        else:
+            maxdist_rad = np.deg2rad(float(maxdist))
+            if maxdist_rad <= 0:
+                raise ValueError("maxdist should be > 0, got %g" % maxdist)
+
+        self._matches=None
+
+        # without a limit on the distance this is the exact size; an entry
+        # is not its own neighbor in a self match
+        nself = 1 if matching_self else 0
+        nmax = min(k, ra.size - nself)
+        matches = np.zeros(max(1, self._ra.size*max(0, nmax)),
+                           dtype=match_dtype)
+        super(Catalog, self).knn(
+            k, matching_self, ra, dec, maxdist_rad, matches, nthreads,
+        )
+        self._matches = matches
+
+    def iter_matches(self, ra, dec, maxmatch=1, chunk_size=100000,
+                     nthreads=1):
+        """
+        iterate over the matches of the catalog to the second set of points,
+        in batches.  This can be used to process very large numbers of
+        matches with bounded memory.
+
+        The matches are the same, and in the same order, as for match(); the
+        input points are indexed
+
+        parameters
+        ----------
+        ra: array
+            ra to match, in degrees
+        dec: array
+            dec to match, in degrees
+        maxmatch: int, optional
+            maximum number of matches to allow per point. The closest maxmatch
+            matches will be kept, sorted closest first.  Default is 1, which
+            implles keepin the closest match.  Set to <= 0 to keep all
+            matches.
+        chunk_size: int, optional
+            The number of matches in each batch; the last batch may be
+            smaller.  Default 100000
+        nthreads: int, optional
+            Number of threads to use for the match.  Default 1
+
+        yields
+        ------
+        matches: structured array
+            Structured array with fields i1, i2, cosdist as for the matches
+            attribute
+        """
+        ra,dec=_get_arrays(ra,dec)
+        matching_self=0
+
+        return self._iter_matches(
+            maxmatch, matching_self, ra, dec, chunk_size, nthreads,
         )
 
-    def _match(self, maxmatch, matching_self, ra, dec, file):
+    def iter_matches_self(self, maxmatch=1, chunk_size=100000, nthreads=1):
+        """
+        iterate over the matches of the catalog against itself, ignoring
+        exact matches, in batches; see iter_matches
+
+        parameters
+        ----------
+        maxmatch: int, optional
+            maximum number of matches to allow per point. The closest maxmatch
+            matches will be kept, sorted closest first.  Default is 1, which
+            implles keepin the closest match.  Set to <= 0 to keep all
+            matches.
+        chunk_size: int, optional
+            The number of matches in each batch; the last batch may be
+            smaller.  Default 100000
+        nthreads: int, optional
+            Number of threads to use for the match.  Default 1
+
+        yields
+        ------
+        matches: structured array
+            Structured array with fields i1, i2, cosdist as for the matches
+            attribute
+        """
+        matching_self=MATCH_SELF
+
+        return self._iter_matches(
+            maxmatch, matching_self, self._ra, self._dec, chunk_size, nthreads,
+        )
+
+    def _iter_matches(self, maxmatch, matching_self, ra, dec, chunk_size,
+                      nthreads):
+        """
+        create the iterator up front, so errors are raised right away
+        """
+        chunk_size = int(chunk_size)
+        if chunk_size < 1:
+            raise ValueError("chunk_size should be >= 1, got %d" % chunk_size)
+
+        nthreads = int(nthreads)
+        if nthreads < 1:
+            raise ValueError("nthreads should be >= 1, got %d" % nthreads)
+
+        miter = super(Catalog, self).iter_matches(
+            maxmatch,
+            matching_self,
+            ra,
+            dec,
+            nthreads,
+        )
+        return _iter_chunks(miter, chunk_size)
+
+    def _match(self, maxmatch, matching_self, ra, dec, file,
+               index='input', nthreads=1, format='binary', exact=None):
         """
         We keep all the logic of choosing different methods here
         """
 
+        index_catalog = self._index_catalog(index, ra)
+        nthreads = int(nthreads)
+        if nthreads < 1:
+            raise ValueError("nthreads should be >= 1, got %d" % nthreads)
+
         # make sure to store None here, since the matches are in a file
         self._matches=None
 
         if file is not None:
+            if format not in ('binary', 'text'):
+                raise ValueError("format should be 'binary' or 'text', "
+                                 "got '%s'" % format)
+
             super(Catalog, self).match2file(
                 maxmatch,
                 matching_self,
-                self._ra,
-                self._dec,
-                self._radius,
                 ra,
                 dec,
                 file,
+                index_catalog,
+                nthreads,
+                int(format == 'binary'),
             )
 
         else:
-            self._matches = np.zeros(1, dtype=match_dtype)
+            if exact is None:
+                exact = maxmatch <= 0
+
+            # the GIL is released during the match, so only store the
+            # matches once they are complete
+            matches = np.zeros(1, dtype=match_dtype)
             super(Catalog, self).match(
                 maxmatch,
                 matching_self,
-                self._ra,
-                self._dec,
-                self._radius,
                 ra,
                 dec,
-                self._matches,
+                matches,
+                index_catalog,
+                nthreads,
+                int(exact),
             )
 
             nmatches = self.get_nmatches()
-            assert self._matches.size == nmatches,\
+            assert matches.size == nmatches,\
                 ('match count does not match: '
-                 '%d in array, %d counted' % (self._matches.size, nmatches))
+                 '%d in array, %d counted' % (matches.size, nmatches))
+
+            self._matches = matches
+
+    def _index_catalog(self, index, ra):
+        """
+        returns 1 if the catalog should be indexed, 0 if the input
+        """
+        if index == 'input':
+            return 0
+        elif index == 'catalog':
+            return 1
+        elif index == 'auto':
+            rmin = self._radius.min()
+            rmax = self._radius.max()
+            if self._ra.size < ra.size and rmax <= 2*rmin:
+                return 1
+            else:
+                return 0
+        else:
+            raise ValueError("index should be 'input', 'catalog' "
+                             "or 'auto', got '%s'" % index)
+
+    def save_index(self, filename):
+        """
+        save the catalog and the data built for matching it, so it can be
+        loaded with load_index without building them again.  This is meant
+        for static catalogs matched by many short lived processes.
+
+        The file holds the ra, dec and radius, the catalog points and the
+        disc pixels, and the index over the catalog with its points, for the
+        nside, multires and float32 settings of this catalog.  The arrays are
+        in the byte order of this machine.
+
+        parameters
+        ----------
+        filename: string
+            The file to write
+        """
+
+        cat = self
+        if not self._cache:
+            cat = Catalog(self._ra, self._dec, self._radius,
+                          nside=self.get_hpix_nside(),
+                          multires=self._multires, float32=self._float32)
+
+        arrays = super(Catalog, cat)._get_index()
+
+        header = {
+            'multires': self._multires,
+            'float32': self._float32,
+            'nside': self.get_hpix_nside(),
+            'size': self._ra.size,
+            'nradius': self._radius.size,
+            'npix': arrays[3].size,
+            'nranges': arrays[2].size,
+        }
+        data = (self._ra, self._dec, self._radius) + tuple(arrays)
+
+        with open(filename, 'wb') as fobj:
+            _write_indexfile_header(fobj, header)
+            for (name, dtype, count, offset), arr in zip(
+                    _index_file_sections(header), data):
+                fobj.write(b'\0'*(offset - fobj.tell()))
+                arr.astype(dtype, copy=False).tofile(fobj)
+
+    @classmethod
+    def load_index(cls, filename, stats=False):
+        """
+        load a catalog saved with save_index.  The file is mapped into
+        memory and used in place, so loading takes about the same time
+        whatever the size of the catalog, and the pages are shared by all
+        the processes on a machine that load the same file.  The ra and dec
+        are not checked again, so their pages are only read by the matches;
+        with multires the radii are read to set up the levels.  The file
+        must not be changed while the catalog is in use.
+
+        parameters
+        ----------
+        filename: string
+            The file written by save_index
+        stats: bool, optional
+            If True, keep the counts and times for the last match; see the
+            stats attribute.  Default False
+
+        returns
+        -------
+        cat: Catalog
+            The catalog, with the saved nside, multires and float32
+            settings, and caching enabled.  The ra, dec and radius are read
+            only views of the file
+        """
+
+        mapped = np.memmap(filename, dtype='u1', mode='r')
+        header = _read_indexfile_header(filename, bytes(mapped[:INDEXFILE_HEADER_SIZE]))
+
+        arrays = []
+        for name, dtype, count, offset in _index_file_sections(header):
+            nbytes = count*np.dtype(dtype).itemsize
+            if offset + nbytes > mapped.size:
+                raise IOError("the %s in the index file are truncated: "
+                              "'%s'" % (name, filename))
+            arrays.append(mapped[offset:offset+nbytes].view(dtype))
+
+        # the ra and dec were checked by save_index, so they are not read
+        # here
+        ra, dec, radius = arrays[:3]
+        cat = cls.__new__(cls)
+        cat._init(ra, dec, radius, header['nside'], True,
+                  header['multires'], header['float32'], stats, False)
+        super(Catalog, cat)._set_index(*arrays[3:])
+
+        return cat
 
     def __repr__(self):
         area=self.get_hpix_area()*(180.0/np.pi)**2
         lines=[
             'smatch catalog',
-            '    nside:               %d' % self.get_hpix_nside(),
+            '    nside:               %d%s' % (
+                self.get_hpix_nside(), ' (auto)' if self._nside_auto else ''
+            ),
             '    pixel area (sq deg): %f' % area,
             '    npoints:             %d' % self._ra.size,
+            '    nlevels:             %d' % self.get_nlevels(),
+            '    float32:             %s' % self._float32,
+            '    cache (bytes):       %d' % self.get_cache_nbytes(),
         ]
         return '\n'.join(lines)
 
-def read_matches(filename):
+def _iter_chunks(miter, chunk_size):
     """
-    read matches from the indicated file
+    yield batches of matches from the C iterator
+    """
+    while True:
+        matches = np.zeros(chunk_size, dtype=match_dtype)
+        nfilled = miter.fill(matches)
+        if nfilled == 0:
+            break
+
+        if nfilled < chunk_size:
+            matches = matches[:nfilled].copy()
+
+        yield matches
+
+def read_matches(filename, mmap=False):
+    """
+    read matches from the indicated file, which can be in the binary or
+    text format
+
+    parameters
+    ----------
+    filename: string
+        The match file
+    mmap: bool, optional
+        If True, map the file into memory rather than reading it, so only the
+        parts of the file that are accessed are read.  The array is read only,
+        and has the byte order of the machine that wrote the file.  Only
+        supported for the binary format.  Default False
 
     returns
     -------
@@ -305,7 +1479,41 @@ def read_matches(filename):
             cos(dist): cosine of the angular distance
                 between the points
 
+        If mmap is True this is a read only np.memmap
     """
+
+    header = _read_matchfile_header(filename)
+
+    if mmap:
+        if header is None:
+            raise ValueError("only binary match files can be memory mapped: "
+                             "'%s'" % filename)
+
+        nmatches, dtype = header
+        if nmatches == 0:
+            # an empty region cannot be mapped
+            matches = np.zeros(0, dtype=dtype)
+            matches.flags.writeable = False
+            return matches
+
+        return np.memmap(
+            filename,
+            dtype=dtype,
+            mode='r',
+            offset=MATCHFILE_HEADER_SIZE,
+            shape=(nmatches,),
+        )
+
+    if header is not None:
+        nmatches, dtype = header
+        matches = np.fromfile(
+            filename,
+            dtype=dtype,
+            count=nmatches,
+            offset=MATCHFILE_HEADER_SIZE,
+        )
+        return matches.astype(match_dtype, copy=False)
+
     nmatches = _smatch._count_lines(filename)
     matches = np.zeros(nmatches, dtype=match_dtype)
 
@@ -313,11 +1521,154 @@ def read_matches(filename):
         _smatch._load_matches(filename, matches)
     return matches
 
+def _read_matchfile_header(filename):
+    """
+    read the header of a binary match file
+
+    returns
+    -------
+    (nmatches, dtype), or None if the file is not in the binary format
+    """
+
+    with open(filename, 'rb') as fobj:
+        header = fobj.read(MATCHFILE_HEADER_SIZE)
+
+    if header[:len(MATCHFILE_MAGIC)] != MATCHFILE_MAGIC:
+        return None
+
+    if len(header) < MATCHFILE_HEADER_SIZE:
+        raise IOError("truncated header in match file: '%s'" % filename)
+
+    # the numbers are in the byte order given by the dtype
+    typecodes = header[24:].rstrip(b'\0').decode('ascii').split(',')
+    order = typecodes[0][0]
+
+    version, record_size, nmatches = struct.unpack(
+        order + 'IIq', header[8:24],
+    )
+
+    names = [d[0] for d in match_dtype]
+    dtype = np.dtype(list(zip(names, typecodes)))
+
+    if version != 1 or record_size != dtype.itemsize:
+        raise IOError("unsupported match file version %d with record size %d: "
+                      "'%s'" % (version, record_size, filename))
+
+    if nmatches < 0:
+        raise IOError("the match writing this file did not finish: "
+                      "'%s'" % filename)
+
+    nbytes = MATCHFILE_HEADER_SIZE + nmatches*record_size
+    if os.path.getsize(filename) < nbytes:
+        raise IOError("expected %d matches in file, but it is too "
+                      "short: '%s'" % (nmatches, filename))
+
+    return nmatches, dtype
+
+def _write_matchfile_header(fobj, nmatches):
+    """
+    write the header of a binary match file, in the same form as the C code,
+    for matches with match_dtype in the byte order of this machine
+    """
+
+    dtype = np.dtype(match_dtype)
+    typecodes = ','.join(dtype[name].str for name in dtype.names)
+
+    header = (
+        MATCHFILE_MAGIC
+        + struct.pack('=IIq', 1, dtype.itemsize, nmatches)
+        + typecodes.encode('ascii')
+    )
+    fobj.write(header.ljust(MATCHFILE_HEADER_SIZE, b'\0'))
+
+def _index_file_sections(header):
+    """
+    the name, dtype, number of elements and offset of each array in a saved
+    index, for the header as from _read_indexfile_header
+    """
+
+    size = header['size']
+    npix = header['npix']
+    ptype = 'f4' if header['float32'] else 'f8'
+
+    sections = [
+        ('ra', 'f8', size),
+        ('dec', 'f8', size),
+        ('radius', 'f8', header['nradius']),
+        ('points', 'f8', 5*size),
+        ('disc offsets', 'u8', size+1),
+        ('disc ranges', 'i8', header['nranges']),
+        ('pixels', 'i8', npix),
+        ('offsets', 'u8', npix+1),
+        ('indices', 'i8', size),
+        ('x', ptype, size),
+        ('y', ptype, size),
+        ('z', ptype, size),
+    ]
+
+    offset = INDEXFILE_HEADER_SIZE
+    result = []
+    for name, dtype, count in sections:
+        offset = -(-offset//INDEXFILE_ALIGN)*INDEXFILE_ALIGN
+        result.append((name, '='+dtype, count, offset))
+        offset += count*np.dtype(dtype).itemsize
+
+    return result
+
+def _write_indexfile_header(fobj, header):
+    """
+    write the header of a saved index, in the byte order of this machine
+    """
+
+    packed = (
+        INDEXFILE_MAGIC
+        + struct.pack(
+            '=IIiiqqqqq',
+            INDEXFILE_VERSION,
+            INDEXFILE_BYTE_ORDER_MARK,
+            int(header['multires']),
+            int(header['float32']),
+            header['nside'],
+            header['size'],
+            header['nradius'],
+            header['npix'],
+            header['nranges'],
+        )
+    )
+    fobj.write(packed.ljust(INDEXFILE_HEADER_SIZE, b'\0'))
+
+def _read_indexfile_header(filename, data):
+    """
+    unpack the header of a saved index, checking it can be used here
+    """
+
+    if data[:len(INDEXFILE_MAGIC)] != INDEXFILE_MAGIC:
+        raise IOError("not a saved index: '%s'" % filename)
+
+    if len(data) < INDEXFILE_HEADER_SIZE:
+        raise IOError("truncated header in index file: '%s'" % filename)
+
+    values = struct.unpack('=IIiiqqqqq', data[8:64])
+    version, mark = values[:2]
+
+    if mark != INDEXFILE_BYTE_ORDER_MARK:
+        raise IOError("the index file was written on a machine with a "
+                      "different byte order: '%s'" % filename)
+    if version != INDEXFILE_VERSION:
+        raise IOError("unsupported index file version %d: '%s'" %
+                      (version, filename))
+
+    names = ['multires', 'float32', 'nside', 'size', 'nradius', 'npix',
+             'nranges']
+    header = dict(zip(names, values[2:]))
+    header['multires'] = bool(header['multires'])
+    header['float32'] = bool(header['float32'])
 
+    return header
 
 def _get_arrays(ra, dec, radius=None):
-    ra=np.array(ra, ndmin=1, dtype='f8', copy=copy_if_needed)
-    dec=np.array(dec, ndmin=1, dtype='f8', copy=copy_if_needed)
+    ra=np.array(ra, ndmin=1, dtype='f8', order='C', copy=copy_if_needed)
+    dec=np.array(dec, ndmin=1, dtype='f8', order='C', copy=copy_if_needed)
 
     if ra.size != dec.size:
         mess="ra/dec size mismatch: %d %d"
@@ -325,7 +1676,8 @@ def _get_arrays(ra, dec, radius=None):
 
     if radius is not None:
 
-        radarr=np.array(radius, ndmin=1, dtype='f8', copy=copy_if_needed)
+        radarr=np.array(radius, ndmin=1, dtype='f8', order='C',
+                        copy=copy_if_needed)
 
         if radarr.size != ra.size and radarr.size != 1:
             mess=("radius has size %d but expected either "
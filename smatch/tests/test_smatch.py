@@ -5,7 +5,16 @@ import unittest
 
 import numpy
 
-from ..smatch import Catalog, read_matches, match
+from ..smatch import (
+    Catalog, read_matches, match, match_self, choose_nside, knn,
+    count_matches, count_matches_self, friends_of_friends,
+    pair_counts, pair_counts_self, INDEXFILE_HEADER_SIZE,
+)
+from ..partition import (
+    match_partitioned, match_self_partitioned,
+    shard_plan, shard_plan_self, read_shard_plan,
+    match_shard, match_self_shard, merge_shards,
+)
 
 
 class TestSMatch(unittest.TestCase):
@@ -183,6 +192,993 @@ class TestSMatch(unittest.TestCase):
 
 
 
+    def testMatch2FileFormats(self):
+
+        cat, ok = self.make_cat(self.two)
+        self.assertTrue(ok,"creating Catalog object")
+
+        for maxmatch, expected in zip(self.maxmatches,self.expected):
+            cat.match(self.ra2, self.dec2, maxmatch=maxmatch)
+            mref = cat.matches
+
+            for format in ['binary', 'text']:
+                fname=tempfile.mktemp(prefix="testSMatch2File",suffix='.dat')
+                try:
+                    cat.match(self.ra2, self.dec2, maxmatch=maxmatch,
+                              file=fname, format=format)
+
+                    with open(fname, 'rb') as fobj:
+                        magic = fobj.read(8)
+                    self.assertEqual(magic == b'SMATCHBN', format == 'binary')
+
+                    matches=read_matches(fname)
+                    self.check_matches(matches.size,
+                                       expected,
+                                       maxmatch,
+                                       'format=%s' % format)
+                    self.assertTrue(numpy.all(matches['i1'] == mref['i1']))
+                    self.assertTrue(numpy.all(matches['i2'] == mref['i2']))
+                    self.assertTrue(numpy.allclose(matches['cosdist'],
+                                                   mref['cosdist']))
+                finally:
+                    if os.path.exists(fname):
+                        os.remove(fname)
+
+        self.assertRaises(ValueError, cat.match, self.ra2, self.dec2,
+                          file='nofile.dat', format='fits')
+
+    def testReadMatchesMmap(self):
+
+        cat, ok = self.make_cat(self.two)
+        self.assertTrue(ok,"creating Catalog object")
+
+        for maxmatch, expected in zip(self.maxmatches,self.expected):
+            fname=tempfile.mktemp(prefix="testSMatch2File",suffix='.dat')
+            try:
+                cat.match(self.ra2, self.dec2, maxmatch=maxmatch, file=fname)
+                mref = read_matches(fname)
+
+                matches = read_matches(fname, mmap=True)
+                self.assertTrue(isinstance(matches, numpy.memmap))
+                self.assertFalse(matches.flags.writeable)
+                self.check_matches(matches.size,
+                                   expected,
+                                   maxmatch,
+                                   'mmap')
+                for name in ['i1', 'i2', 'cosdist']:
+                    self.assertTrue(numpy.all(matches[name] == mref[name]))
+                del matches
+
+                cat.match(self.ra2, self.dec2, maxmatch=maxmatch,
+                          file=fname, format='text')
+                self.assertRaises(ValueError, read_matches, fname, mmap=True)
+            finally:
+                if os.path.exists(fname):
+                    os.remove(fname)
+
+        # no matches
+        fname=tempfile.mktemp(prefix="testSMatch2File",suffix='.dat')
+        try:
+            cat.match([0.0], [-89.0], file=fname)
+            matches = read_matches(fname, mmap=True)
+            self.assertEqual(matches.size, 0)
+        finally:
+            if os.path.exists(fname):
+                os.remove(fname)
+
+    def testMatchCache(self):
+
+        for cache in [True, False]:
+            cat = Catalog(self.ra1, self.dec1, self.two, nside=self.nside,
+                          cache=cache)
+            self.assertEqual(cat.cache_nbytes, 0)
+
+            # repeat the matches to check the cached data are reused
+            # correctly
+            for repeat in range(2):
+                for maxmatch, expected in zip(self.maxmatches,self.expected):
+                    cat.match(self.ra2, self.dec2, maxmatch=maxmatch)
+                    self.check_matches(cat.get_nmatches(),
+                                       expected,
+                                       maxmatch,
+                                       'cache=%s' % cache)
+
+            if cache:
+                self.assertTrue(cat.cache_nbytes > 0)
+            else:
+                self.assertEqual(cat.cache_nbytes, 0)
+
+        cat = Catalog(self.ra2, self.dec2, self.two, nside=self.nside)
+        for repeat in range(2):
+            for maxmatch, expected in zip(self.maxmatches,self.expected_self):
+                cat.match_self(maxmatch=maxmatch)
+                self.check_matches(cat.get_nmatches(),
+                                   expected,
+                                   maxmatch,
+                                   'cached match_self')
+
+    def testMatchIndexCatalog(self):
+
+        radii = numpy.zeros(self.ra1.size) + self.two
+
+        for rad in [self.two, radii]:
+            cat, ok = self.make_cat(rad)
+            self.assertTrue(ok,"creating Catalog object")
+
+            for maxmatch, expected in zip(self.maxmatches,self.expected):
+                cat.match(self.ra2, self.dec2, maxmatch=maxmatch)
+                mref = cat.matches
+
+                for index in ['catalog', 'auto']:
+                    cat.match(self.ra2, self.dec2, maxmatch=maxmatch,
+                              index=index)
+                    self.check_matches(cat.get_nmatches(),
+                                       expected,
+                                       maxmatch,
+                                       'index=%s' % index)
+
+                    m = cat.matches
+                    self.assertTrue(numpy.all(numpy.diff(m['i1']) >= 0))
+                    self.assertEqual(
+                        sorted(zip(m['i1'], m['i2'])),
+                        sorted(zip(mref['i1'], mref['i2'])),
+                    )
+
+                fname=tempfile.mktemp(prefix="testSMatch2File",suffix='.dat')
+                try:
+                    cat.match(self.ra2, self.dec2, maxmatch=maxmatch,
+                              file=fname, index='catalog')
+                    matches=read_matches(fname)
+                    self.check_matches(matches.size,
+                                       expected,
+                                       maxmatch,
+                                       'index=catalog file')
+                finally:
+                    if os.path.exists(fname):
+                        os.remove(fname)
+
+    def testMatchThreads(self):
+
+        # enough points that the catalog is split over several chunks
+        rng = numpy.random.RandomState(8312)
+        num = 5000
+        ra = 200.0 + rng.uniform(size=num)
+        dec = 24.0 + rng.uniform(size=num)
+        ra2 = 200.0 + rng.uniform(size=num)
+        dec2 = 24.0 + rng.uniform(size=num)
+        rad = 60.0/3600.0
+
+        for cache in [True, False]:
+            cat = Catalog(ra, dec, rad, nside=self.nside, cache=cache)
+
+            for maxmatch in self.maxmatches:
+                cat.match(ra2, dec2, maxmatch=maxmatch, nthreads=1)
+                mref = cat.matches
+
+                cat.match(ra2, dec2, maxmatch=maxmatch, nthreads=3)
+                self.assertTrue(numpy.all(cat.matches == mref))
+
+                cat.match_self(maxmatch=maxmatch, nthreads=1)
+                mref_self = cat.matches
+
+                fname=tempfile.mktemp(prefix="testSMatchThreads",suffix='.dat')
+                try:
+                    cat.match_self(maxmatch=maxmatch, file=fname, nthreads=3)
+                    matches=read_matches(fname)
+                    self.assertEqual(matches.size, mref_self.size)
+                    self.assertTrue(numpy.all(matches['i1'] == mref_self['i1']))
+                    self.assertTrue(numpy.all(matches['i2'] == mref_self['i2']))
+                finally:
+                    if os.path.exists(fname):
+                        os.remove(fname)
+
+    def testMatchExact(self):
+
+        rng = numpy.random.RandomState(1874)
+        num = 3000
+        ra = 200.0 + rng.uniform(size=num)
+        dec = 24.0 + rng.uniform(size=num)
+        ra2 = 200.0 + rng.uniform(size=num)
+        dec2 = 24.0 + rng.uniform(size=num)
+        rad = 60.0/3600.0
+
+        for cache in [True, False]:
+            cat = Catalog(ra, dec, rad, nside=self.nside, cache=cache)
+
+            for maxmatch in self.maxmatches:
+                cat.match(ra2, dec2, maxmatch=maxmatch, exact=False)
+                mref = cat.matches
+
+                # the catalog is walked in pixel order for the exact match,
+                # but the matches are still in catalog order
+                for nthreads in [1, 3]:
+                    cat.match(ra2, dec2, maxmatch=maxmatch, exact=True,
+                              nthreads=nthreads)
+                    self.assertEqual(cat.nmatches, mref.size)
+                    self.assertTrue(numpy.all(cat.matches == mref))
+                    self.assertTrue(numpy.all(numpy.diff(cat.matches['i1']) >= 0))
+
+                cat.match_self(maxmatch=maxmatch, exact=False)
+                mref = cat.matches
+                cat.match_self(maxmatch=maxmatch, exact=True)
+                self.assertTrue(numpy.all(cat.matches == mref))
+
+        for maxmatch, expected in zip(self.maxmatches,self.expected):
+            m = match(self.ra1, self.dec1, self.two, self.ra2, self.dec2,
+                      nside=self.nside, maxmatch=maxmatch, exact=True)
+            self.check_matches(m.size, expected, maxmatch, 'exact')
+
+    def testMatchHighNside(self):
+
+        # above 16384 the disc queries compute the rings as needed rather
+        # than using a table
+        for nside in [16384, 32768]:
+            cat = Catalog(self.ra1, self.dec1, self.two, nside=nside)
+            for maxmatch, expected in zip(self.maxmatches,self.expected):
+                cat.match(self.ra2, self.dec2, maxmatch=maxmatch)
+                self.check_matches(cat.get_nmatches(),
+                                   expected,
+                                   maxmatch,
+                                   'nside=%d' % nside)
+
+    def testMatchMaxmatchOrder(self):
+
+        rng = numpy.random.RandomState(17)
+        ra1 = 200 + rng.uniform(size=300)
+        dec1 = 20 + rng.uniform(size=300)
+        ra2 = 200 + rng.uniform(size=20000)
+        dec2 = 20 + rng.uniform(size=20000)
+
+        cat = Catalog(ra1, dec1, 1.0/60, nside=4096)
+        cat.match(ra2, dec2, maxmatch=0)
+        mall = cat.matches
+
+        # closest first, ties by index
+        s = numpy.lexsort((mall['i2'], -mall['cosdist'], mall['i1']))
+        mall = mall[s]
+        rank = numpy.arange(mall.size) - numpy.searchsorted(mall['i1'],
+                                                            mall['i1'])
+
+        # one each for the running best, the sorted buffer and the heap
+        for maxmatch in [1, 3, 8, 9, 20]:
+            expected = mall[rank < maxmatch]
+            for index in ['input', 'catalog']:
+                cat.match(ra2, dec2, maxmatch=maxmatch, index=index)
+                m = cat.matches
+                self.assertEqual(m.size, expected.size)
+                self.assertTrue(numpy.all(m['i1'] == expected['i1']))
+                self.assertTrue(numpy.all(m['i2'] == expected['i2']))
+
+    def testMatchPartitioned(self):
+
+        rng = numpy.random.RandomState(23)
+        # spans several partitions of nside 16, about 3.7 degrees
+        ra1 = 40 + 10*rng.uniform(size=2000)
+        dec1 = -5 + 10*rng.uniform(size=2000)
+        ra2 = 40 + 10*rng.uniform(size=3000)
+        dec2 = -5 + 10*rng.uniform(size=3000)
+        radius = 0.05 + 0.1*rng.uniform(size=ra1.size)
+
+        def lexsorted(m):
+            return m[numpy.lexsort((m['i2'], m['i1']))]
+
+        for maxmatch in [0, 1, 3]:
+            expected = match(ra1, dec1, radius, ra2, dec2, maxmatch=maxmatch)
+            m = match_partitioned(ra1, dec1, radius, ra2, dec2,
+                                  maxmatch=maxmatch, partition_nside=16,
+                                  chunk_size=500)
+            if maxmatch <= 0:
+                expected = lexsorted(expected)
+                m = lexsorted(m)
+            self.assertTrue(numpy.all(m == expected))
+
+            expected = Catalog(ra1, dec1, radius)
+            expected.match_self(maxmatch=maxmatch)
+            expected = expected.matches
+            m = match_self_partitioned(ra1, dec1, radius, maxmatch=maxmatch,
+                                       partition_nside=16, chunk_size=500)
+            if maxmatch <= 0:
+                expected = lexsorted(expected)
+                m = lexsorted(m)
+            self.assertTrue(numpy.all(m == expected))
+
+        # memory mapped sources and output to a file
+        expected = lexsorted(match(ra1, dec1, 0.1, ra2, dec2, maxmatch=0))
+        with tempfile.TemporaryDirectory() as tmpdir:
+            names = []
+            for i, arr in enumerate([ra1, dec1, ra2, dec2]):
+                name = os.path.join(tmpdir, 'col%d.npy' % i)
+                numpy.save(name, arr)
+                names.append(name)
+
+            fname = os.path.join(tmpdir, 'matches.dat')
+            res = match_partitioned(names[0], names[1], 0.1,
+                                    names[2], names[3], maxmatch=0,
+                                    file=fname, partition_nside=16,
+                                    tmpdir=tmpdir)
+            self.assertIsNone(res)
+
+            m = lexsorted(read_matches(fname))
+            self.assertTrue(numpy.all(m == expected))
+
+    def testMatchShards(self):
+
+        rng = numpy.random.RandomState(29)
+        ra1 = 40 + 10*rng.uniform(size=2000)
+        dec1 = -5 + 10*rng.uniform(size=2000)
+        ra2 = 40 + 10*rng.uniform(size=3000)
+        dec2 = -5 + 10*rng.uniform(size=3000)
+        radius = 0.05 + 0.1*rng.uniform(size=ra1.size)
+
+        nshards = 3
+        plan = shard_plan(ra1, dec1, radius, ra2, dec2, nshards,
+                          partition_nside=16)
+        self.assertEqual(plan.nshards, nshards)
+        self.assertEqual(plan.partitions['n1'].sum(), ra1.size)
+        self.assertTrue(numpy.all(plan.get_loads() > 0))
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            pname = os.path.join(tmpdir, 'plan.npz')
+            plan.write(pname)
+            rplan = read_shard_plan(pname)
+            self.assertEqual(rplan.partition_nside, plan.partition_nside)
+            self.assertEqual(rplan.halo, plan.halo)
+            self.assertTrue(numpy.all(rplan.partitions == plan.partitions))
+
+            for maxmatch in [0, 1, 3]:
+                fnames = []
+                for shard in range(nshards):
+                    fname = os.path.join(tmpdir, 'shard%d.dat' % shard)
+                    match_shard(rplan, shard, ra1, dec1, radius, ra2, dec2,
+                                maxmatch=maxmatch, file=fname)
+                    fnames.append(fname)
+
+                m = merge_shards(fnames, maxmatch=maxmatch)
+                expected = match(ra1, dec1, radius, ra2, dec2,
+                                 maxmatch=maxmatch)
+                if maxmatch <= 0:
+                    s = numpy.lexsort((expected['i2'], -expected['cosdist'],
+                                       expected['i1']))
+                    expected = expected[s]
+                self.assertTrue(numpy.all(m == expected))
+
+                # a repeated file does not change the result
+                m = merge_shards(fnames + fnames[:1], maxmatch=maxmatch)
+                self.assertTrue(numpy.all(m == expected))
+
+            plan = shard_plan_self(ra1, dec1, radius, nshards,
+                                   partition_nside=16)
+            fnames = []
+            for shard in range(nshards):
+                fname = os.path.join(tmpdir, 'self%d.dat' % shard)
+                match_self_shard(plan, shard, ra1, dec1, radius, maxmatch=2,
+                                 file=fname)
+                fnames.append(fname)
+
+            cat = Catalog(ra1, dec1, radius)
+            cat.match_self(maxmatch=2)
+            m = merge_shards(fnames, maxmatch=2)
+            self.assertTrue(numpy.all(m == cat.matches))
+
+    def testMatchSelfUniquePairs(self):
+
+        rng = numpy.random.RandomState(31)
+        ra = 200 + rng.uniform(size=5000)
+        dec = 20 + rng.uniform(size=5000)
+        # some exact duplicates
+        ra[-100:] = ra[:100]
+        dec[-100:] = dec[:100]
+        radius = 1.0/60
+
+        def lexsorted(m):
+            return m[numpy.lexsort((m['i2'], m['i1']))]
+
+        mall = lexsorted(match_self(ra, dec, radius, maxmatch=0))
+        expected = mall[mall['i1'] < mall['i2']]
+
+        cat = Catalog(ra, dec, radius)
+        for exact in [False, True]:
+            for nthreads in [1, 3]:
+                cat.match_self(maxmatch=0, unique_pairs=True, exact=exact,
+                               nthreads=nthreads)
+                m = cat.matches
+                self.assertTrue(numpy.all(m['i1'] < m['i2']))
+                self.assertTrue(numpy.all(lexsorted(m) == expected))
+
+                cat.match_self(maxmatch=0, unique_pairs=True, mirror=True,
+                               exact=exact, nthreads=nthreads)
+                self.assertTrue(numpy.all(lexsorted(cat.matches) == mall))
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            fname = os.path.join(tmpdir, 'matches.dat')
+            for format in ['binary', 'text']:
+                match_self(ra, dec, radius, maxmatch=0, file=fname,
+                           format=format, unique_pairs=True)
+                m = read_matches(fname)
+                self.assertTrue(numpy.all(lexsorted(m) == expected))
+
+        with self.assertRaises(ValueError):
+            cat.match_self(maxmatch=1, unique_pairs=True)
+
+        radii = radius*(1 + rng.uniform(size=ra.size))
+        with self.assertRaises(ValueError):
+            match_self(ra, dec, radii, maxmatch=0, unique_pairs=True)
+
+    def testFriendsOfFriends(self):
+
+        rng = numpy.random.RandomState(37)
+        ra = 200 + 0.5*rng.uniform(size=5000)
+        dec = 20 + 0.5*rng.uniform(size=5000)
+        radius = 0.5/60
+
+        # the groups by propagating the lowest index over the pairs
+        m = match_self(ra, dec, radius, maxmatch=0)
+        lowest = numpy.arange(ra.size)
+        while True:
+            low = numpy.minimum(lowest[m['i1']], lowest[m['i2']])
+            new = lowest.copy()
+            numpy.minimum.at(new, m['i1'], low)
+            numpy.minimum.at(new, m['i2'], low)
+            if numpy.all(new == lowest):
+                break
+            lowest = new
+
+        sizes = numpy.bincount(lowest, minlength=ra.size)
+
+        cat = Catalog(ra, dec, radius)
+        for min_match in [1, 2, 4]:
+            keep = sizes[lowest] >= min_match
+            roots = numpy.unique(lowest[keep])
+            expected = numpy.full(ra.size, -1, dtype='i8')
+            expected[keep] = numpy.searchsorted(roots, lowest[keep])
+
+            for nthreads in [1, 3]:
+                groups = cat.friends_of_friends(min_match=min_match,
+                                                nthreads=nthreads)
+                self.assertTrue(numpy.all(groups == expected))
+
+            groups = friends_of_friends(ra, dec, radius, min_match=min_match)
+            self.assertTrue(numpy.all(groups == expected))
+
+        # a different linking radius from the catalog radius
+        groups = Catalog(ra, dec, 2*radius).friends_of_friends(radius)
+        self.assertTrue(numpy.all(groups == numpy.searchsorted(
+            numpy.unique(lowest), lowest)))
+
+        with self.assertRaises(ValueError):
+            Catalog(ra, dec, radius*(1 + rng.uniform(size=ra.size))
+                    ).friends_of_friends()
+
+    def testPairCounts(self):
+
+        rng = numpy.random.RandomState(41)
+        ra1 = 200 + rng.uniform(size=3000)
+        dec1 = 20 + rng.uniform(size=3000)
+        ra2 = 200 + rng.uniform(size=4000)
+        dec2 = 20 + rng.uniform(size=4000)
+        w1 = rng.uniform(size=ra1.size)
+        w2 = rng.uniform(size=ra2.size)
+        bins = numpy.geomspace(0.1, 3.0, 9)/60
+        cos_edges = numpy.cos(numpy.deg2rad(bins))
+
+        def binned(m, weights=None):
+            # bin k holds cos_edges[k] >= cosdist > cos_edges[k+1]
+            ind = numpy.searchsorted(-cos_edges, -m['cosdist'],
+                                     side='right') - 1
+            keep = (ind >= 0) & (ind < bins.size-1)
+            return numpy.bincount(ind[keep], minlength=bins.size-1,
+                                  weights=None if weights is None
+                                  else weights[keep])
+
+        m = match(ra1, dec1, bins[-1], ra2, dec2, maxmatch=0)
+        expected = binned(m)
+        wexpected = binned(m, w1[m['i1']]*w2[m['i2']])
+
+        cat = Catalog(ra1, dec1, bins[-1])
+        for nthreads in [1, 3]:
+            counts = cat.pair_counts(ra2, dec2, bins, nthreads=nthreads)
+            self.assertEqual(counts.dtype, numpy.dtype('i8'))
+            self.assertTrue(numpy.all(counts == expected))
+
+            wcounts = cat.pair_counts(ra2, dec2, bins, weights=w2,
+                                      cat_weights=w1, nthreads=nthreads)
+            self.assertEqual(wcounts.dtype, numpy.dtype('f8'))
+            self.assertTrue(numpy.allclose(wcounts, wexpected))
+
+        counts = pair_counts(ra1, dec1, ra2, dec2, bins)
+        self.assertTrue(numpy.all(counts == expected))
+
+        # self pairs are counted once
+        m = match_self(ra1, dec1, bins[-1], maxmatch=0)
+        m = m[m['i1'] < m['i2']]
+        expected = binned(m)
+        wexpected = binned(m, w1[m['i1']]*w1[m['i2']])
+        for nthreads in [1, 3]:
+            counts = cat.pair_counts_self(bins, nthreads=nthreads)
+            self.assertEqual(counts.dtype, numpy.dtype('i8'))
+            self.assertTrue(numpy.all(counts == expected))
+            wcounts = cat.pair_counts_self(bins, weights=w1,
+                                           nthreads=nthreads)
+            self.assertTrue(numpy.allclose(wcounts, wexpected))
+
+        counts = pair_counts_self(ra1, dec1, bins)
+        self.assertTrue(numpy.all(counts == expected))
+
+        with self.assertRaises(ValueError):
+            cat.pair_counts(ra2, dec2, 2*bins)
+        with self.assertRaises(ValueError):
+            cat.pair_counts(ra2, dec2, bins[::-1])
+        with self.assertRaises(ValueError):
+            cat.pair_counts(ra2, dec2, bins, weights=w1)
+
+    def testSaveIndex(self):
+
+        rng = numpy.random.RandomState(43)
+        ra1 = 200 + rng.uniform(size=3000)
+        dec1 = 20 + rng.uniform(size=3000)
+        ra2 = 200 + rng.uniform(size=4000)
+        dec2 = 20 + rng.uniform(size=4000)
+        radius = 2.0/60
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            fname = os.path.join(tmpdir, 'index.smidx')
+
+            for kw in [dict(), dict(float32=True), dict(cache=False),
+                       dict(radius=radius*(0.1 + rng.uniform(size=ra1.size)),
+                            multires=True, nside=2048)]:
+                kw = dict(kw)
+                rad = kw.pop('radius', radius)
+                cat = Catalog(ra1, dec1, rad, **kw)
+                cat.save_index(fname)
+
+                loaded = Catalog.load_index(fname)
+                self.assertEqual(loaded.hpix_nside, cat.hpix_nside)
+                self.assertEqual(loaded.nlevels, cat.nlevels)
+                self.assertTrue(numpy.all(loaded._ra == ra1))
+                self.assertFalse(loaded._ra.flags.writeable)
+                self.assertGreater(loaded.cache_nbytes, 0)
+
+                for index in ['input', 'catalog']:
+                    cat.match(ra2, dec2, maxmatch=0, index=index)
+                    loaded.match(ra2, dec2, maxmatch=0, index=index)
+                    self.assertTrue(numpy.all(loaded.matches == cat.matches))
+
+                cat.match(ra2, dec2, maxmatch=2)
+                loaded.match(ra2, dec2, maxmatch=2, nthreads=3)
+                self.assertTrue(numpy.all(loaded.matches == cat.matches))
+
+                cat.match_self(maxmatch=0)
+                loaded.match_self(maxmatch=0)
+                self.assertTrue(numpy.all(loaded.matches == cat.matches))
+
+                # saving a loaded catalog gives the same file
+                fname2 = os.path.join(tmpdir, 'index2.smidx')
+                loaded.save_index(fname2)
+                with open(fname, 'rb') as f1, open(fname2, 'rb') as f2:
+                    self.assertEqual(f1.read(), f2.read())
+                del loaded
+
+            # the ra and dec, the first section, are not read when loading,
+            # so a bad value written into the file is not checked
+            cat = Catalog(ra1, dec1, radius)
+            cat.save_index(fname)
+            bad = numpy.memmap(fname, dtype='f8', mode='r+',
+                               offset=INDEXFILE_HEADER_SIZE, shape=(1,))
+            bad[0] = numpy.nan
+            bad.flush()
+            del bad
+            loaded = Catalog.load_index(fname)
+            self.assertTrue(numpy.isnan(loaded._ra[0]))
+            del loaded
+            with self.assertRaises(ValueError):
+                Catalog(ra1[:1]*numpy.nan, dec1[:1], radius)
+
+            with open(fname, 'r+b') as fobj:
+                fobj.write(b'NOTINDEX')
+            with self.assertRaises(IOError):
+                Catalog.load_index(fname)
+
+    def testMatchMany(self):
+
+        rng = numpy.random.RandomState(47)
+        ra1 = 200 + rng.uniform(size=3000)
+        dec1 = 20 + rng.uniform(size=3000)
+        radius = 2.0/60
+
+        inputs = []
+        for n in [4000, 0, 2500, 1]:
+            inputs.append((200 + rng.uniform(size=n), 20 + rng.uniform(size=n)))
+        # an exposure overlapping the first, for ties
+        inputs.append((inputs[0][0][:500], inputs[0][1][:500]))
+
+        cat = Catalog(ra1, dec1, radius)
+        for maxmatch in [0, 1, 3, 10]:
+            expected = []
+            for ra, dec in inputs:
+                cat.match(ra, dec, maxmatch=maxmatch)
+                expected.append(cat.matches)
+
+            for nthreads in [1, 3]:
+                mlist = cat.match_many(inputs, maxmatch=maxmatch,
+                                       nthreads=nthreads)
+                self.assertEqual(len(mlist), len(inputs))
+                for m, e in zip(mlist, expected):
+                    self.assertTrue(numpy.all(m == e))
+
+            mlist = cat.match_many(inputs[:1], maxmatch=maxmatch)
+            self.assertTrue(numpy.all(mlist[0] == expected[0]))
+
+        self.assertEqual(cat.match_many([]), [])
+
+    def testMatchStats(self):
+
+        rng = numpy.random.RandomState(53)
+        ra1 = 200 + rng.uniform(size=2000)
+        dec1 = 20 + rng.uniform(size=2000)
+        ra2 = 200 + rng.uniform(size=5000)
+        dec2 = 20 + rng.uniform(size=5000)
+        radius = 2.0/60
+
+        cat = Catalog(ra1, dec1, radius)
+        cat.match(ra2, dec2)
+        self.assertTrue(cat.stats is None)
+
+        cat = Catalog(ra1, dec1, radius, stats=True)
+        for maxmatch in [0, 1, 3]:
+            first = None
+            for nthreads in [1, 3]:
+                cat.match(ra2, dec2, maxmatch=maxmatch, nthreads=nthreads)
+                stats = cat.stats
+
+                self.assertEqual(stats['nentries'], ra1.size)
+                self.assertEqual(stats['nhits'] + stats['nmisses'],
+                                 stats['nranges'])
+                self.assertTrue(stats['npixels'] >= stats['nranges'])
+                self.assertTrue(stats['ncandidates'] >= stats['naccepted'])
+                self.assertTrue(stats['naccepted'] >= cat.nmatches)
+                if maxmatch == 0:
+                    self.assertEqual(stats['naccepted'], cat.nmatches)
+                    self.assertEqual(stats['nreplaced'], 0)
+                for key in stats:
+                    if key.startswith('time_'):
+                        self.assertTrue(stats[key] >= 0)
+
+                counts = dict((k, v) for k, v in stats.items()
+                              if not k.startswith('time_'))
+                if first is None:
+                    first = counts
+                else:
+                    self.assertEqual(counts, first)
+
+    def testMatchNaN(self):
+
+        ra = numpy.array([200.0, 200.1, 200.2])
+        dec = numpy.array([20.0, 20.1, 20.2])
+        radius = 1.0/60
+
+        for bad in ['ra', 'dec']:
+            bra, bdec = ra.copy(), dec.copy()
+            if bad == 'ra':
+                bra[1] = numpy.nan
+            else:
+                bdec[1] = numpy.nan
+
+            with self.assertRaises(ValueError):
+                Catalog(bra, bdec, radius)
+
+            cat = Catalog(ra, dec, radius)
+            with self.assertRaises(ValueError):
+                cat.match(bra, bdec)
+
+            with self.assertRaises(ValueError):
+                match_partitioned(bra, bdec, radius, ra, dec,
+                                  partition_nside=16)
+
+    def testMatchFloat32(self):
+
+        rng = numpy.random.RandomState(41)
+        ra1 = 200 + rng.uniform(size=500)
+        dec1 = 20 + rng.uniform(size=500)
+        ra2 = 200 + rng.uniform(size=5000)
+        dec2 = 20 + rng.uniform(size=5000)
+
+        for radius in [1.0/3600, 1.0/60, rng.uniform(size=500)/60]:
+            cat = Catalog(ra1, dec1, radius, nside=4096)
+            fcat = Catalog(ra1, dec1, radius, nside=4096, float32=True)
+
+            # the results are exactly the same, including cosdist
+            for maxmatch in [0, 1, 3]:
+                cat.match(ra2, dec2, maxmatch=maxmatch)
+                fcat.match(ra2, dec2, maxmatch=maxmatch)
+                self.assertEqual(cat.matches.size, fcat.matches.size)
+                self.assertTrue(numpy.all(cat.matches == fcat.matches))
+
+                cat.match_self(maxmatch=maxmatch)
+                fcat.match_self(maxmatch=maxmatch)
+                self.assertTrue(numpy.all(cat.matches == fcat.matches))
+
+        m = match(ra1, dec1, 1.0/60, ra2, dec2, maxmatch=0)
+        fm = match(ra1, dec1, 1.0/60, ra2, dec2, maxmatch=0, float32=True)
+        self.assertTrue(numpy.all(m == fm))
+
+    def testNsideAuto(self):
+
+        cat = Catalog(self.ra1, self.dec1, self.two, nside='auto')
+        nside = cat.get_hpix_nside()
+        self.assertTrue(1 <= nside <= 2**28)
+        self.assertIn('(auto)', repr(cat))
+
+        for maxmatch, expected in zip(self.maxmatches,self.expected):
+            cat.match(self.ra2, self.dec2, maxmatch=maxmatch)
+            self.check_matches(cat.get_nmatches(),
+                               expected,
+                               maxmatch,
+                               'nside=auto')
+
+            m = match(self.ra1, self.dec1, self.two,
+                      self.ra2, self.dec2,
+                      maxmatch=maxmatch, nside='auto')
+            self.check_matches(m.size, expected, maxmatch, 'match nside=auto')
+
+        # smaller radii or denser points call for finer pixels
+        rng = numpy.random.RandomState(8)
+        ra = 200 + rng.uniform(size=10000)
+        dec = 20 + rng.uniform(size=10000)
+
+        nside_big = choose_nside(60.0/3600, ra, dec)
+        nside_small = choose_nside(self.two, ra, dec)
+        self.assertGreater(nside_small, nside_big)
+
+        nside_sparse = choose_nside(60.0/3600, ra[:100], dec[:100])
+        self.assertGreaterEqual(nside_big, nside_sparse)
+
+        with self.assertRaises(ValueError):
+            Catalog(self.ra1, self.dec1, self.two, nside='best')
+
+    def testMatchMultires(self):
+
+        rng = numpy.random.RandomState(31)
+        ra1 = 200 + rng.uniform(size=500)
+        dec1 = 20 + rng.uniform(size=500)
+        ra2 = 200 + rng.uniform(size=5000)
+        dec2 = 20 + rng.uniform(size=5000)
+
+        # mostly small radii, with a few large
+        radius = numpy.zeros(ra1.size) + 10.0/3600
+        radius[::100] = 0.5
+
+        for cache in [False, True]:
+            cat = Catalog(ra1, dec1, radius, nside=4096, cache=cache)
+            mcat = Catalog(ra1, dec1, radius, nside=4096, cache=cache,
+                           multires=True)
+            self.assertEqual(cat.nlevels, 1)
+            self.assertGreater(mcat.nlevels, 1)
+
+            # the order within an entry follows the pixels searched
+            for maxmatch in [0, 1, 2]:
+                cat.match(ra2, dec2, maxmatch=maxmatch)
+                mcat.match(ra2, dec2, maxmatch=maxmatch)
+                m = numpy.sort(cat.matches, order=['i1', 'i2'])
+                mm = numpy.sort(mcat.matches, order=['i1', 'i2'])
+                self.assertEqual(m.size, mm.size)
+                self.assertTrue(numpy.all(m == mm))
+
+                mcat.match(ra2, dec2, maxmatch=maxmatch, exact=True)
+                mm = numpy.sort(mcat.matches, order=['i1', 'i2'])
+                self.assertTrue(numpy.all(m == mm))
+
+        m = match(ra1, dec1, radius, ra2, dec2, maxmatch=0)
+        mm = match(ra1, dec1, radius, ra2, dec2, maxmatch=0, multires=True)
+        self.assertEqual(m.size, mm.size)
+
+    def testMatchWrap(self):
+
+        # the disc pixels are searched as ranges within each ring, which are
+        # split where they wrap past ra=0
+        ra1 = numpy.array([0.0001, 359.9999, 0.0, 180.0])
+        dec1 = numpy.array([0.0, 45.0, 89.9999, -89.9999])
+        ra2 = numpy.array([359.9999, 0.0001, 180.0, 0.0])
+        dec2 = numpy.array([0.0, 45.0, 89.9999, -89.9999])
+
+        for nside in [64, 4096, 65536]:
+            m = match(ra1, dec1, self.two, ra2, dec2, nside=nside, maxmatch=0)
+            self.assertEqual(m.size, 4)
+            self.assertTrue(numpy.all(m['i1'] == m['i2']))
+
+    def testCountMatches(self):
+
+        radii = numpy.zeros(self.ra1.size) + self.two
+
+        for rad in [self.two, radii]:
+            cat, ok = self.make_cat(rad)
+            self.assertTrue(ok,"creating Catalog object")
+
+            for maxmatch in [0, 1, 2]:
+                cat.match(self.ra2, self.dec2, maxmatch=maxmatch)
+                expected = numpy.bincount(cat.matches['i1'],
+                                          minlength=self.ra1.size)
+
+                for nthreads in [1, 3]:
+                    counts = cat.count_matches(self.ra2, self.dec2,
+                                               maxmatch=maxmatch,
+                                               nthreads=nthreads)
+                    self.assertEqual(counts.dtype, numpy.dtype('i8'))
+                    self.assertTrue(numpy.all(counts == expected))
+                    self.assertIsNone(cat.matches)
+
+                ntotal = cat.count_matches(self.ra2, self.dec2,
+                                           maxmatch=maxmatch, total=True)
+                self.assertEqual(ntotal, expected.sum())
+                self.assertEqual(cat.get_nmatches(), ntotal)
+
+                counts = count_matches(self.ra1, self.dec1, rad,
+                                       self.ra2, self.dec2, nside=self.nside,
+                                       maxmatch=maxmatch)
+                self.assertTrue(numpy.all(counts == expected))
+
+                cat.match_self(maxmatch=maxmatch)
+                expected = numpy.bincount(cat.matches['i1'],
+                                          minlength=self.ra1.size)
+                counts = cat.count_matches_self(maxmatch=maxmatch)
+                self.assertTrue(numpy.all(counts == expected))
+
+                counts = count_matches_self(self.ra1, self.dec1, rad,
+                                            nside=self.nside,
+                                            maxmatch=maxmatch)
+                self.assertTrue(numpy.all(counts == expected))
+
+    def testKnn(self):
+
+        rng = numpy.random.RandomState(17)
+        ra1 = 200 + rng.uniform(size=200)
+        dec1 = 20 + rng.uniform(size=200)
+        ra2 = 200 + 2*rng.uniform(size=2000) - 0.5
+        dec2 = 20 + 2*rng.uniform(size=2000) - 0.5
+
+        def get_xyz(ra, dec):
+            r, d = numpy.deg2rad(ra), numpy.deg2rad(dec)
+            return numpy.array([numpy.cos(d)*numpy.cos(r),
+                                numpy.cos(d)*numpy.sin(r),
+                                numpy.sin(d)]).T
+
+        # all pairs, closest first
+        cosdist = numpy.dot(get_xyz(ra1, dec1), get_xyz(ra2, dec2).T)
+        expected = -numpy.sort(-cosdist, axis=1)
+
+        maxdist = 0.02
+        for k in [1, 3, 10]:
+            m = knn(ra1, dec1, ra2, dec2, k=k)
+            self.assertEqual(m.size, ra1.size*k)
+            self.assertTrue(numpy.all(m['i1'] == numpy.repeat(numpy.arange(ra1.size), k)))
+            numpy.testing.assert_allclose(
+                m['cosdist'].reshape(ra1.size, k), expected[:, :k],
+                rtol=0, atol=1e-15,
+            )
+
+            mt = knn(ra1, dec1, ra2, dec2, k=k, nthreads=3)
+            self.assertTrue(numpy.all(m == mt))
+
+            m = knn(ra1, dec1, ra2, dec2, k=k, maxdist=maxdist)
+            nexp = numpy.minimum(
+                (cosdist > numpy.cos(numpy.deg2rad(maxdist))).sum(axis=1), k
+            )
+            self.assertEqual(m.size, nexp.sum())
+
+        # the nearest other point
+        cat = Catalog(ra2, dec2, self.two)
+        cat.knn_self(k=2)
+        m = cat.matches
+        self.assertEqual(m.size, 2*ra2.size)
+        self.assertFalse(numpy.any(m['i1'] == m['i2']))
+        self.assertTrue(numpy.all(m['cosdist'][::2] >= m['cosdist'][1::2]))
+
+        with self.assertRaises(ValueError):
+            knn(ra1, dec1, ra2, dec2, k=0)
+
+    def testMatchKernels(self):
+        from .. import _smatch
+
+        rng = numpy.random.RandomState(4419)
+        num = 5000
+        ra = 200.0 + rng.uniform(size=num)
+        dec = 24.0 + rng.uniform(size=num)
+        ra2 = 200.0 + rng.uniform(size=num)
+        dec2 = 24.0 + rng.uniform(size=num)
+        rad = 60.0/3600.0
+
+        default = _smatch._kernel_name()
+        kernels = [k for k in ['scalar', 'avx2', 'avx512', 'neon']
+                   if _smatch._kernel_supported(k)]
+        self.assertTrue('scalar' in kernels)
+
+        with self.assertRaises(ValueError):
+            _smatch._set_kernel('nosuchkernel')
+
+        # a low nside puts many points in each pixel
+        cat = Catalog(ra, dec, rad, nside=64)
+        try:
+            for maxmatch in self.maxmatches:
+                _smatch._set_kernel('scalar')
+                cat.match(ra2, dec2, maxmatch=maxmatch)
+                mref = cat.matches
+                cat.match_self(maxmatch=maxmatch)
+                mref_self = cat.matches
+
+                for kernel in kernels:
+                    _smatch._set_kernel(kernel)
+                    self.assertEqual(_smatch._kernel_name(), kernel)
+
+                    cat.match(ra2, dec2, maxmatch=maxmatch)
+                    self.assertTrue(numpy.all(cat.matches == mref))
+
+                    cat.match_self(maxmatch=maxmatch)
+                    self.assertTrue(numpy.all(cat.matches == mref_self))
+        finally:
+            _smatch._set_kernel(default)
+
+    def testMatchPythonThreads(self):
+        from concurrent.futures import ThreadPoolExecutor
+
+        rng = numpy.random.RandomState(551)
+        num = 2000
+        ra = 200.0 + rng.uniform(size=num)
+        dec = 24.0 + rng.uniform(size=num)
+        rad = 60.0/3600.0
+
+        def do_match(maxmatch):
+            cat = Catalog(ra, dec, rad, nside=self.nside)
+            cat.match_self(maxmatch=maxmatch)
+            return cat.matches
+
+        expected = [do_match(maxmatch) for maxmatch in self.maxmatches]
+
+        # the GIL is released during the match, so these run concurrently
+        with ThreadPoolExecutor(max_workers=3) as executor:
+            results = list(executor.map(do_match, self.maxmatches))
+
+        for res, mref in zip(results, expected):
+            self.assertTrue(numpy.all(res == mref))
+
+    def testIterMatches(self):
+
+        rng = numpy.random.RandomState(9151)
+        num = 5000
+        ra = 200.0 + rng.uniform(size=num)
+        dec = 24.0 + rng.uniform(size=num)
+        ra2 = 200.0 + rng.uniform(size=num)
+        dec2 = 24.0 + rng.uniform(size=num)
+        rad = 60.0/3600.0
+
+        cat = Catalog(ra, dec, rad, nside=self.nside)
+
+        for maxmatch in self.maxmatches:
+            cat.match(ra2, dec2, maxmatch=maxmatch)
+            mref = cat.matches
+
+            for chunk_size, nthreads in [(1000, 1), (777, 2)]:
+                chunks = list(cat.iter_matches(ra2, dec2, maxmatch=maxmatch,
+                                               chunk_size=chunk_size,
+                                               nthreads=nthreads))
+                for chunk in chunks[:-1]:
+                    self.assertEqual(chunk.size, chunk_size)
+                self.assertTrue(chunks[-1].size <= chunk_size)
+
+                matches = numpy.concatenate(chunks)
+                self.assertTrue(numpy.all(matches == mref))
+
+            cat.match_self(maxmatch=maxmatch)
+            mref = cat.matches
+            chunks = list(cat.iter_matches_self(maxmatch=maxmatch,
+                                                chunk_size=500))
+            self.assertTrue(numpy.all(numpy.concatenate(chunks) == mref))
+
+        # no matches
+        chunks = list(cat.iter_matches([0.0], [-89.0]))
+        self.assertEqual(len(chunks), 0)
+
+        self.assertRaises(ValueError, cat.iter_matches, ra2, dec2,
+                          chunk_size=0)
+
     def check_matches(self, nmatches, expected, maxmatch,extra):
         mess="expected %d matches with maxmatch=%d, got %d (%s)"
         mess = mess % (expected, maxmatch, nmatches, extra),
@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "unionfind.h"
+
+void unionfind_init(int64_t* forest, size_t n)
+{
+    size_t i=0;
+
+    for (i=0; i<n; i++) {
+        forest[i] = -1;
+    }
+}
+
+int64_t unionfind_find(int64_t* forest, int64_t i)
+{
+    while (forest[i] >= 0) {
+        // the grandparent is lower than the parent, so the order is kept
+        if (forest[forest[i]] >= 0) {
+            forest[i] = forest[forest[i]];
+        }
+        i = forest[i];
+    }
+    return i;
+}
+
+void unionfind_union(int64_t* forest, int64_t a, int64_t b)
+{
+    int64_t tmp=0;
+
+    a = unionfind_find(forest, a);
+    b = unionfind_find(forest, b);
+
+    if (a == b) {
+        return;
+    }
+    if (b < a) {
+        tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    // the lower root is kept
+    forest[a] += forest[b];
+    forest[b] = a;
+}
+
+size_t unionfind_label(int64_t* forest, size_t n, int64_t min_size)
+{
+    size_t i=0, nlabels=0;
+
+    // the parents are lower, so they are labelled first
+    for (i=0; i<n; i++) {
+        if (forest[i] < 0) {
+            if (-forest[i] >= min_size) {
+                forest[i] = (int64_t)nlabels;
+                nlabels++;
+            } else {
+                forest[i] = -1;
+            }
+        } else {
+            forest[i] = forest[forest[i]];
+        }
+    }
+
+    return nlabels;
+}
@@ -0,0 +1,37 @@
+/*
+   A disjoint set forest over the integers 0 ... n-1, for grouping points
+   linked by matches, as in a friends-of-friends.
+
+   The forest is held in an int64 array supplied by the caller, one element
+   for each point, so the labels can be written in place.  A root holds
+   minus the size of its set, and every other element holds its parent.  The
+   root of a set is always its lowest member, so the parent of an element is
+   lower than the element itself; this keeps the results independent of the
+   order in which the links are made.
+
+   This is not thread safe.
+*/
+#ifndef _UNIONFIND_H
+#define _UNIONFIND_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// make each of the n elements a set of its own
+void unionfind_init(int64_t* forest, size_t n);
+
+// the root of the set holding i, halving the path to it
+int64_t unionfind_find(int64_t* forest, int64_t i);
+
+// merge the sets holding a and b
+void unionfind_union(int64_t* forest, int64_t a, int64_t b);
+
+/*
+   replace the forest with a label for each element: the sets with at least
+   min_size members are numbered from 0 in order of their lowest member, and
+   the elements of smaller sets are given -1.  Returns the number of sets
+   labelled
+*/
+size_t unionfind_label(int64_t* forest, size_t n, int64_t min_size);
+
+#endif